@@ -1,23 +1,315 @@
 #include "STM32Flasher.h"
 #include "stm_flash.h"
 #include "stm_pro_mode.h"
+#include "stm_devices.h"
+
+#include <new>
 
 namespace stm32flash {
 
-FlashStatus flash(const FlashConfig& config, const char* filename) {
+FlashStatus flash(const FlashConfig& config, const char* filename, FlashReport* report) {
     if (!config.isValid()) {
         return ERROR_CONFIG_INVALID;
     }
 
     // Everything is handled in flashSTM
-    return internal::flashSTM(
-        filename,
-        config.reset_pin,
-        config.boot0_pin,
-        config.uart_tx,
-        config.uart_rx,
-        config.uart_num
-    );
+    return internal::flashSTM(filename, config, report);
+}
+
+FlashStatus flash(const FlashConfig& config, const FlashImage& image, FlashReport* report) {
+    if (!config.isValid() || !image.isValid()) {
+        return ERROR_CONFIG_INVALID;
+    }
+
+    return internal::flashSTM(image, config, report);
+}
+
+static bool areTargetsValid(const FlashTarget* targets, size_t count) {
+    if (targets == NULL || count == 0 || count > MAX_FLASH_TARGETS) {
+        return false;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (!targets[i].config.isValid()) {
+            return false;
+        }
+        for (size_t j = 0; j < i; j++) {
+            if (targets[j].config.uart_num == targets[i].config.uart_num) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+FlashStatus flashAll(FlashTarget* targets, size_t count, const char* filename) {
+    if (!areTargetsValid(targets, count)) {
+        return ERROR_CONFIG_INVALID;
+    }
+
+    return internal::flashTargets(filename, targets, count);
+}
+
+FlashStatus flashAll(FlashTarget* targets, size_t count, const FlashImage& image) {
+    if (!areTargetsValid(targets, count) || !image.isValid()) {
+        return ERROR_CONFIG_INVALID;
+    }
+
+    return internal::flashTargets(image, targets, count);
+}
+
+// Allocate the job of an asynchronous flash, NULL if out of memory
+static internal::AsyncJob* createJob(const FlashConfig& config) {
+    internal::AsyncJob* job = new (std::nothrow) internal::AsyncJob();
+    if (job == NULL) {
+        return NULL;
+    }
+    job->done = xSemaphoreCreateBinary();
+    if (job->done == NULL) {
+        delete job;
+        return NULL;
+    }
+    job->config = config;
+    return job;
+}
+
+// Handle of a job that did not start
+static FlashHandle finishJob(internal::AsyncJob* job, FlashStatus status) {
+    job->status = status;
+    job->finished = true;
+    xSemaphoreGive(job->done);
+    return FlashHandle(job);
+}
+
+FlashHandle flashAsync(const FlashConfig& config, const char* filename, const AsyncOptions& options) {
+    internal::AsyncJob* job = createJob(config);
+    if (job == NULL) {
+        return FlashHandle();
+    }
+    if (!config.isValid() || filename == NULL || filename[0] == '\0' || strlen(filename) >= sizeof(job->file_name)) {
+        return finishJob(job, ERROR_CONFIG_INVALID);
+    }
+
+    strcpy(job->file_name, filename);
+    internal::startAsyncJob(job, options);
+    return FlashHandle(job);
+}
+
+FlashHandle flashAsync(const FlashConfig& config, const FlashImage& image, const AsyncOptions& options) {
+    internal::AsyncJob* job = createJob(config);
+    if (job == NULL) {
+        return FlashHandle();
+    }
+    if (!config.isValid() || !image.isValid() ||
+        (image.partition_label != NULL && strlen(image.partition_label) >= sizeof(job->partition_label))) {
+        return finishJob(job, ERROR_CONFIG_INVALID);
+    }
+
+    // The label is copied, in-memory data is used in place
+    job->image = image;
+    if (image.partition_label != NULL) {
+        strcpy(job->partition_label, image.partition_label);
+        job->image.partition_label = job->partition_label;
+    }
+    internal::startAsyncJob(job, options);
+    return FlashHandle(job);
+}
+
+FlashHandle::~FlashHandle() {
+    if (_job == NULL) {
+        return;
+    }
+    cancel();
+    wait();
+    vSemaphoreDelete(_job->done);
+    delete _job;
+}
+
+FlashHandle& FlashHandle::operator=(FlashHandle&& other) {
+    // The previous job, if any, is released by other
+    internal::AsyncJob* job = _job;
+    _job = other._job;
+    other._job = job;
+    return *this;
+}
+
+bool FlashHandle::isDone() const {
+    return _job == NULL || _job->finished;
+}
+
+bool FlashHandle::wait(uint32_t timeout_ms) {
+    if (_job == NULL) {
+        return true;
+    }
+
+    // pdMS_TO_TICKS() multiplies in 32 bits: a timeout it would overflow waits forever instead.
+    // The semaphore is only given once the task no longer uses the job, so it is given back for the next waits
+    const TickType_t ticks = (timeout_ms >= UINT32_MAX / configTICK_RATE_HZ) ? portMAX_DELAY : pdMS_TO_TICKS(timeout_ms);
+    if (xSemaphoreTake(_job->done, ticks) != pdTRUE) {
+        return false;
+    }
+    xSemaphoreGive(_job->done);
+    return true;
+}
+
+void FlashHandle::cancel() {
+    if (_job != NULL) {
+        _job->monitor.cancelled = true;
+    }
+}
+
+FlashStatus FlashHandle::status() const {
+    return (_job != NULL) ? (FlashStatus)_job->status : ERROR_UNKNOWN;
+}
+
+FlashProgress FlashHandle::progress() const {
+    return (_job != NULL) ? internal::progressOf(_job->monitor) : FlashProgress();
+}
+
+FlashReport FlashHandle::report() const {
+    return (_job != NULL) ? _job->report : FlashReport();
+}
+
+FlashStatus Session::connect() {
+    if (_connected) {
+        return SUCCESS;
+    }
+    if (!_config.isValid()) {
+        return ERROR_CONFIG_INVALID;
+    }
+
+    const FlashConfig& c = _config;
+    if (internal::setFlashMode(c.reset_pin, c.boot0_pin, c.uart_num, true, c.reset_pulse_ms, c.reset_settle_ms) != SUCCESS) {
+        return ERROR_GPIO_INIT;
+    }
+
+    FlashStatus status = internal::initFlashUART(c.uart_num, c.uart_tx, c.uart_rx, c.baud_rate);
+    if (status == SUCCESS) {
+        _info = DeviceInfo();
+        status = internal::isSTMPresent(c.reset_pin, c.uart_num, c, &_info);
+    }
+    if (status == SUCCESS) {
+        status = internal::setupSTM(c.uart_num, _info);
+    }
+
+    if (status != SUCCESS) {
+        internal::setFlashMode(c.reset_pin, c.boot0_pin, c.uart_num, false, c.reset_pulse_ms, c.reset_settle_ms);
+        return status;
+    }
+
+    _connected = true;
+    return SUCCESS;
+}
+
+void Session::disconnect() {
+    if (!_connected) {
+        return;
+    }
+
+    const FlashConfig& c = _config;
+    internal::setFlashMode(c.reset_pin, c.boot0_pin, c.uart_num, false, c.reset_pulse_ms, c.reset_settle_ms);
+    _connected = false;
+}
+
+FlashStatus Session::erase(uint32_t address, size_t size) {
+    if (!_connected) {
+        return ERROR_NOT_CONNECTED;
+    }
+    if (address < STM32_FLASH_BASE || size == 0) {
+        return ERROR_INVALID_RANGE;
+    }
+
+    internal::ErasePlan plan;
+    const internal::FlashLayout layout = internal::flashLayout(_config, _info);
+    if (!layout.isValid() || !internal::planErase(plan, address - STM32_FLASH_BASE, size, layout)) {
+        return ERROR_INVALID_RANGE;
+    }
+    return internal::eraseSTM(_config.uart_num, _info, &plan);
+}
+
+FlashStatus Session::eraseAll() {
+    if (!_connected) {
+        return ERROR_NOT_CONNECTED;
+    }
+    return internal::eraseSTM(_config.uart_num, _info);
+}
+
+FlashStatus Session::write(uint32_t address, const uint8_t* data, size_t size) {
+    if (!_connected) {
+        return ERROR_NOT_CONNECTED;
+    }
+    const uint32_t align = internal::writeAlignment(_info);
+    if (address % align != 0 || data == NULL) {
+        return ERROR_INVALID_RANGE;
+    }
+
+    // WRITE MEMORY takes up to BLOCK_SIZE bytes, a multiple of the programming unit
+    char block[BLOCK_SIZE];
+    for (size_t offset = 0; offset < size; offset += BLOCK_SIZE) {
+        const int length = MIN((size_t)BLOCK_SIZE, size - offset);
+        const int padded = (int)((length + align - 1) & ~(align - 1));
+        memset(block, 0xff, padded);
+        memcpy(block, &data[offset], length);
+
+        if (internal::writeMemory(address + offset, block, padded, _config.uart_num) != ESP_OK) {
+            return ERROR_WRITE_FAILED;
+        }
+    }
+    return SUCCESS;
+}
+
+FlashStatus Session::read(uint32_t address, uint8_t* data, size_t size) {
+    if (!_connected) {
+        return ERROR_NOT_CONNECTED;
+    }
+    if (data == NULL) {
+        return ERROR_INVALID_RANGE;
+    }
+    if (!_info.supports(CMD_READ)) {
+        return ERROR_STM_COMMAND_UNSUPPORTED;
+    }
+
+    for (size_t offset = 0; offset < size; offset += BLOCK_SIZE) {
+        const int length = MIN((size_t)BLOCK_SIZE, size - offset);
+        if (internal::readMemory(address + offset, (char *)&data[offset], length, _config.uart_num) != ESP_OK) {
+            return ERROR_READ_FAILED;
+        }
+    }
+    return SUCCESS;
+}
+
+FlashStatus Session::verify(uint32_t address, const uint8_t* data, size_t size) {
+    if (data == NULL) {
+        return ERROR_INVALID_RANGE;
+    }
+
+    char block[BLOCK_SIZE];
+    for (size_t offset = 0; offset < size; offset += BLOCK_SIZE) {
+        const int length = MIN((size_t)BLOCK_SIZE, size - offset);
+        FlashStatus status = read(address + offset, (uint8_t *)block, length);
+        if (status != SUCCESS) {
+            return status;
+        }
+        if (!internal::blocksEqual(block, (const char *)&data[offset], length)) {
+            return ERROR_VERIFY_FAILED;
+        }
+    }
+    return SUCCESS;
+}
+
+FlashStatus Session::go(uint32_t address) {
+    if (!_connected) {
+        return ERROR_NOT_CONNECTED;
+    }
+    if (!_info.supports(CMD_GO)) {
+        return ERROR_STM_COMMAND_UNSUPPORTED;
+    }
+
+    FlashStatus status = internal::goSTM(_config.boot0_pin, _config.uart_num, _config.isBoot0Shared(), address);
+    if (status != SUCCESS) {
+        return status;
+    }
+    _connected = false;
+    return SUCCESS;
 }
 
 } // namespace stm32flash
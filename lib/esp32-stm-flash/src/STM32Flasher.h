@@ -6,6 +6,126 @@
 
 namespace stm32flash {
 
+// Start of the main flash memory in the STM32 address space
+static constexpr uint32_t STM32_FLASH_BASE = 0x08000000;
+
+/**
+ * @brief Read-back verification after writing
+ */
+enum VerifyMode {
+    VERIFY_NONE = 0, // No read-back
+    VERIFY_CRC,      // Compare a CRC32 of the read-back data with the image
+    VERIFY_FULL,     // Compare every block with the image
+};
+
+/**
+ * @brief Bootloader baud rate selection
+ */
+enum BaudMode {
+    BAUD_FIXED = 0, // Use baud_rate as-is
+    BAUD_PROBE,     // Try standard rates from baud_rate downwards, keep the fastest that syncs
+};
+
+/**
+ * @brief Flash erase strategy
+ */
+enum EraseMode {
+    ERASE_MASS = 0, // Erase the whole flash memory
+    ERASE_PAGES,    // Erase only the pages covered by the image (needs a known device or page_size)
+};
+
+/**
+ * @brief How the STM32 leaves the bootloader after a successful flash
+ */
+enum ExitMode {
+    EXIT_RESET = 0, // Drop BOOT0 and reset the STM32
+    EXIT_GO,        // Drop BOOT0 and jump to the new firmware with the GO command (falls back to a reset)
+};
+
+/**
+ * @brief Pre-check skipping the flash when the target already holds the image
+ */
+enum FingerprintMode {
+    FINGERPRINT_NONE = 0, // Always flash
+    FINGERPRINT_BLOCK,    // Compare the block (256 bytes) holding fingerprint_address, e.g. a version or build hash block
+    // Compare a CRC32 of the first and last blocks of the image (of each segment for HEX/ELF).
+    // Edges only: a build that changes neither of them, e.g. a fix in the middle of the code that
+    // keeps the image size, goes unnoticed and is not flashed. Prefer FINGERPRINT_BLOCK on a build ID.
+    FINGERPRINT_EDGES,
+};
+
+/**
+ * @brief Step of a flash, as reported to the progress callback
+ */
+enum FlashPhase {
+    PHASE_CONNECT = 0, // Entering flash mode and identifying the device
+    PHASE_COMPARE,     // Reading the target back (delta mode)
+    PHASE_ERASE,
+    PHASE_WRITE,
+    PHASE_VERIFY,
+    PHASE_DONE,        // Finished, successfully or not
+};
+
+/**
+ * @brief Progress of the current phase of a flash
+ */
+struct FlashProgress {
+    FlashPhase phase = PHASE_CONNECT;
+    uint32_t bytes_done = 0;       // Image bytes processed in this phase (written, skipped or compared)
+    uint32_t bytes_total = 0;      // Bytes the phase will process
+    uint32_t bytes_per_second = 0; // Average throughput since the start of the phase
+};
+
+/**
+ * @brief Progress callback, called from the task running the flash after every block
+ *
+ * Must return quickly: the UART waits for it
+ */
+typedef void (*ProgressCallback)(const FlashProgress& progress, void* arg);
+
+/**
+ * @brief STM32 USART bootloader command codes (AN3155)
+ */
+enum BootloaderCommand : uint8_t {
+    CMD_GET         = 0x00,
+    CMD_GET_VERSION = 0x01,
+    CMD_GET_ID      = 0x02,
+    CMD_READ        = 0x11,
+    CMD_GO          = 0x21,
+    CMD_WRITE       = 0x31,
+    CMD_ERASE       = 0x43,
+    CMD_EXT_ERASE   = 0x44,
+};
+
+/**
+ * @brief Bootloader capabilities, parsed from the GET, GET VERSION and GET ID replies
+ */
+struct DeviceInfo {
+
+    // GET
+    uint8_t bootloader_version = 0; // Protocol version, e.g. 0x31 for v3.1
+    uint8_t command_count = 0;
+    uint8_t commands[32] = {0};     // Supported command codes
+
+    // GET VERSION
+    uint8_t version = 0;
+    uint8_t option_bytes[2] = {0};
+
+    // GET ID
+    uint16_t product_id = 0;        // e.g. 0x444 for STM32F03x
+
+    // Device table
+    const char* name = NULL;        // Device line, NULL if the product ID is unknown
+    uint32_t flash_size = 0;        // Flash memory in bytes, 0 if unknown
+
+    bool supports(uint8_t command) const {
+        for (int i = 0; i < command_count; i++) {
+            if (commands[i] == command) return true;
+        }
+        return false;
+    }
+};
+
 /**
  * @brief Configuration structure for the flasher
  */
@@ -20,6 +140,47 @@ struct FlashConfig {
     gpio_num_t uart_rx = GPIO_NUM_NC; // ESP32 RX <-> STM32 TX
     uart_port_t uart_num = UART_NUM_MAX;
 
+    // Bootloader baud rate (the STM32 autobauds on the first 0x7F sync byte)
+    uint32_t baud_rate = 115200;
+    BaudMode baud_mode = BAUD_FIXED;
+
+    // Reset timings: NRST low pulse, then delay before the first sync byte (sync is retried with backoff)
+    uint32_t reset_pulse_ms = 5;
+    uint32_t reset_settle_ms = 20;
+
+    // Erase strategy, and size of one erasable flash page of the target
+    // (0: page or sector layout from the device table, looked up by product ID)
+    EraseMode erase_mode = ERASE_MASS;
+    uint32_t page_size = 0;
+
+    // Delta reflash: read back the target first, then only erase and rewrite the pages that differ
+    bool delta = false;
+
+    // Read-back verification after writing
+    VerifyMode verify_mode = VERIFY_FULL;
+
+    // Retries of a block write or read after a NACK or a timeout, before giving up
+    uint8_t retries = 3;
+
+    // Keep a progress journal in NVS, so that an interrupted flash of the same image resumes where it stopped
+    bool resume = false;
+
+    // Start of the new firmware
+    ExitMode exit_mode = EXIT_RESET;
+
+    // Skip the erase and write if the target already holds the image (flash() then returns ALREADY_UP_TO_DATE)
+    FingerprintMode fingerprint = FINGERPRINT_NONE;
+    uint32_t fingerprint_address = 0; // Absolute address, for FINGERPRINT_BLOCK
+
+    // Progress reporting, NULL for none
+    ProgressCallback progress_callback = NULL;
+    void* progress_arg = NULL;
+
+    //BOOT0 wired to one of the UART pins (see "Pin Optimization Trick")
+    bool isBoot0Shared() const {
+        return boot0_pin == uart_tx || boot0_pin == uart_rx;
+    }
+
     bool isValid() const {
         return (uart_tx != GPIO_NUM_NC &&
                 uart_rx != GPIO_NUM_NC &&
@@ -27,16 +188,65 @@ struct FlashConfig {
                 boot0_pin != GPIO_NUM_NC &&
                 uart_tx != uart_rx && 
                 reset_pin != boot0_pin &&
-                uart_num != UART_NUM_MAX);
+                uart_num != UART_NUM_MAX &&
+                baud_rate > 0);
+    }
+};
+
+
+/**
+ * @brief Firmware image descriptor, for flashing without going through a filesystem
+ *
+ * Either a raw data partition (mapped in place with esp_partition_mmap) or a buffer
+ * already in memory. Set exactly one of partition_label or data.
+ */
+struct FlashImage {
+    const char* partition_label = NULL; // Label of a data partition holding the image
+    const uint8_t* data = NULL;         // Image in RAM or in mapped flash
+    size_t size = 0;                    // Image size in bytes (0 = whole partition)
+
+    bool isValid() const {
+        return (partition_label != NULL) != (data != NULL) &&
+               (partition_label != NULL || size > 0);
     }
 };
 
+/**
+ * @brief Statistics of a flash session (pages are 256-byte write blocks)
+ */
+struct FlashReport {
+    uint32_t pages_written = 0;
+    uint32_t pages_skipped = 0; // Already matching the image (delta mode)
+    uint32_t blank_bytes_skipped = 0; // All-0xFF blocks, left as erased instead of written & read back
+    uint32_t image_crc = 0;           // CRC32 of the image, padded to a whole block with 0xFF
+    uint32_t setup_time_ms = 0;       // From entering flash mode to the bootloader being ready to erase
+    uint32_t resumed_from = 0;        // Image offset the write resumed from, 0 for a full write
+    uint32_t retries = 0;             // Block writes & reads retried after a NACK or a timeout
+    uint32_t pages_retried = 0;       // Blocks that needed at least one retry
+    uint32_t bytes_written = 0;       // Image bytes sent with WRITE MEMORY
+
+    // Timings (us). PHASE_CONNECT covers flash mode entry, sync and device setup, sync_us being its sync part.
+    uint32_t mount_us = 0;              // SPIFFS mount and file open, or partition mapping
+    uint32_t phase_us[PHASE_DONE] = {}; // Time spent in each phase, indexed by FlashPhase
+    uint32_t sync_us = 0;               // Presence check: sync and GET, with the resets of a baud rate probe
+    uint32_t exit_us = 0;               // GO or reset out of flash mode
+    uint32_t total_us = 0;              // From entering flash mode to exit (mount_us excluded)
+    uint32_t bytes_per_second = 0;      // Effective throughput: image size over total_us
+
+    // Link
+    uint32_t baud_rate = 0;    // Rate the bootloader was synced at
+    uint32_t ack_count = 0;    // Command ACKs timed (erase and write ACKs wait for the flash and are left out)
+    uint32_t ack_min_us = 0;
+    uint32_t ack_avg_us = 0;
+    uint32_t ack_max_us = 0;
+};
 
 /**
  * @brief Enumeration of flash operation status
  */
 enum FlashStatus {
     SUCCESS = 0,
+    ALREADY_UP_TO_DATE, // Nothing written: the target already holds the image (see FlashConfig::fingerprint)
     
     // Initialization errors
     ERROR_CONFIG_INVALID,
@@ -50,18 +260,27 @@ enum FlashStatus {
     ERROR_STM_GET_COMMANDS_FAILED,
     ERROR_STM_GET_VERSION_FAILED,
     ERROR_STM_GET_ID_FAILED,
+    ERROR_STM_COMMAND_UNSUPPORTED,
+    ERROR_NOT_CONNECTED,
+    ERROR_GO_FAILED,
     
     // Flash errors
     ERROR_FILE_NOT_FOUND,
     ERROR_FILE_EMPTY,
     ERROR_FILE_TOO_LARGE,
     ERROR_CANNOT_OPEN_FILE,
+    ERROR_PARTITION_NOT_FOUND,
+    ERROR_PARTITION_MAP_FAILED,
     ERROR_ERASE_FAILED,
     ERROR_EXT_ERASE_FAILED,
     ERROR_WRITE_FAILED,
     ERROR_READ_FAILED,
+    ERROR_VERIFY_FAILED,
+    ERROR_INVALID_RANGE,
+    ERROR_IMAGE_CORRUPTED, // Compressed image whose decoded data fails the CRC32 of its header
     
     // Other errors
+    ERROR_CANCELLED,
     ERROR_UNKNOWN
 };
 
@@ -73,6 +292,7 @@ enum FlashStatus {
 static constexpr const char* toString(FlashStatus status) {
     switch(status) {
         case SUCCESS:              return "success";
+        case ALREADY_UP_TO_DATE:   return "already_up_to_date";
             
         // Initialization errors
         case ERROR_CONFIG_INVALID: return "invalid_configuration";
@@ -86,30 +306,258 @@ static constexpr const char* toString(FlashStatus status) {
         case ERROR_STM_GET_COMMANDS_FAILED: return "failed_to_get_commands_from_stm32";
         case ERROR_STM_GET_ID_FAILED:     return "failed_to_get_stm32_chip_id";
         case ERROR_STM_GET_VERSION_FAILED: return "failed_to_get_bootloader_version";
+        case ERROR_STM_COMMAND_UNSUPPORTED: return "bootloader_command_not_supported";
+        case ERROR_NOT_CONNECTED:         return "session_not_connected";
+        case ERROR_GO_FAILED:             return "failed_to_start_application";
         
         // Flash errors
         case ERROR_FILE_NOT_FOUND:  return "file_not_found";
         case ERROR_FILE_EMPTY:      return "file_empty";
         case ERROR_FILE_TOO_LARGE:  return "file_too_large_for_flash_memory";
         case ERROR_CANNOT_OPEN_FILE: return "cannot_open_file";
+        case ERROR_PARTITION_NOT_FOUND: return "partition_not_found";
+        case ERROR_PARTITION_MAP_FAILED: return "cannot_map_partition";
         case ERROR_ERASE_FAILED:    return "flash_erase_failed";
         case ERROR_EXT_ERASE_FAILED: return "flash_extended_erase_failed";
         case ERROR_WRITE_FAILED:    return "flash_write_failed";
         case ERROR_READ_FAILED:     return "flash_read_failed";
+        case ERROR_VERIFY_FAILED:   return "flash_verification_failed";
+        case ERROR_INVALID_RANGE:   return "invalid_address_range";
+        case ERROR_IMAGE_CORRUPTED: return "image_corrupted";
         
         // Other errors
+        case ERROR_CANCELLED:       return "flash_cancelled";
         case ERROR_UNKNOWN:
         default:                    return "unknown_error";
         }
 }
 
+/**
+ * @brief One STM32 of a multi-target flash, with its result
+ */
+struct FlashTarget {
+    FlashConfig config;          // Each target must have its own UART
+    FlashStatus status = SUCCESS;
+    FlashReport report;
+};
+
 /**
  * @brief Flash STM32 with binary file
  * @param config Flasher configuration
  * @param filename Name of the binary file to flash
- * @return FlashStatus indicating success or specific error
+ * @param report Optional session statistics, filled even if the flash fails
+ * @return SUCCESS, ALREADY_UP_TO_DATE if the fingerprint matched, or the specific error
+ */
+FlashStatus flash(const FlashConfig& config, const char* filename, FlashReport* report = NULL);
+
+/**
+ * @brief Flash STM32 with an image from a data partition or from memory
+ * @param config Flasher configuration
+ * @param image Image descriptor
+ * @param report Optional session statistics, filled even if the flash fails
+ * @return SUCCESS, ALREADY_UP_TO_DATE if the fingerprint matched, or the specific error
+ */
+FlashStatus flash(const FlashConfig& config, const FlashImage& image, FlashReport* report = NULL);
+
+/**
+ * @brief Flash several STM32 in parallel (one task per UART) with the same binary file
+ * @param targets Targets to flash, their status and report are filled
+ * @param count Number of targets
+ * @param filename Name of the binary file to flash, loaded once and shared by all targets
+ * @return SUCCESS if all targets were flashed (ALREADY_UP_TO_DATE if none needed it), the first error otherwise
+ */
+FlashStatus flashAll(FlashTarget* targets, size_t count, const char* filename);
+
+/**
+ * @brief Flash several STM32 in parallel (one task per UART) with an image from a data partition or from memory
+ * @param targets Targets to flash, their status and report are filled
+ * @param count Number of targets
+ * @param image Image descriptor, shared by all targets
+ * @return SUCCESS if all targets were flashed (ALREADY_UP_TO_DATE if none needed it), the first error otherwise
+ */
+FlashStatus flashAll(FlashTarget* targets, size_t count, const FlashImage& image);
+
+namespace internal {
+struct AsyncJob;
+}
+
+/**
+ * @brief Task settings of an asynchronous flash
+ */
+struct AsyncOptions {
+    uint8_t priority = 5;       // FreeRTOS priority of the flash task
+    int core = -1;              // Core the task is pinned to, -1 for any core
+    uint32_t stack_size = 8192;
+};
+
+/**
+ * @brief Flash running in its own task, returned by flashAsync()
+ *
+ * The handle owns the flash: destroying it cancels a flash still running and waits for its task to end.
+ */
+class FlashHandle {
+public:
+    FlashHandle() {}
+    explicit FlashHandle(internal::AsyncJob* job) : _job(job) {} // See flashAsync()
+    ~FlashHandle();
+
+    FlashHandle(FlashHandle&& other) : _job(other._job) { other._job = NULL; }
+    FlashHandle& operator=(FlashHandle&& other);
+    FlashHandle(const FlashHandle&) = delete;
+    FlashHandle& operator=(const FlashHandle&) = delete;
+
+    /**
+     * @brief Check if the flash has finished (a handle that could not be started is done)
+     */
+    bool isDone() const;
+
+    /**
+     * @brief Wait for the flash to finish
+     * @param timeout_ms Maximum wait, UINT32_MAX to wait forever (as does any wait beyond
+     *                   UINT32_MAX / configTICK_RATE_HZ ms, about 71 minutes at 1000 Hz)
+     * @return true if the flash has finished
+     */
+    bool wait(uint32_t timeout_ms = UINT32_MAX);
+
+    /**
+     * @brief Ask the flash to stop after the current block, it then ends with ERROR_CANCELLED
+     *
+     * A cancelled write can be resumed later with FlashConfig::resume
+     */
+    void cancel();
+
+    /**
+     * @brief Result of the flash, valid once done
+     */
+    FlashStatus status() const;
+
+    /**
+     * @brief Latest progress of the flash
+     */
+    FlashProgress progress() const;
+
+    /**
+     * @brief Session statistics, valid once done
+     */
+    FlashReport report() const;
+
+private:
+    internal::AsyncJob* _job = NULL;
+};
+
+/**
+ * @brief Flash STM32 with binary file, in a task of its own
+ * @param config Flasher configuration
+ * @param filename Name of the binary file to flash (copied)
+ * @param options Priority, core and stack of the flash task
+ * @return Handle to poll, wait on or cancel the flash
+ */
+FlashHandle flashAsync(const FlashConfig& config, const char* filename, const AsyncOptions& options = AsyncOptions());
+
+/**
+ * @brief Flash STM32 with an image from a data partition or from memory, in a task of its own
+ * @param config Flasher configuration
+ * @param image Image descriptor (in-memory data must stay valid until the flash is done)
+ * @param options Priority, core and stack of the flash task
+ * @return Handle to poll, wait on or cancel the flash
  */
-FlashStatus flash(const FlashConfig& config, const char* filename);
+FlashHandle flashAsync(const FlashConfig& config, const FlashImage& image, const AsyncOptions& options = AsyncOptions());
+
+/**
+ * @brief Bootloader session, for several operations in a single bootloader entry
+ *
+ * connect() enters flash mode and keeps the UART driver, the control pins and the
+ * device info until disconnect() (reset into the application) or go() (jump to it).
+ * Addresses are absolute STM32 addresses, e.g. STM32_FLASH_BASE + offset.
+ *
+ * @code
+ * Session session(config);
+ * session.connect();
+ * session.erase(STM32_FLASH_BASE + 0x7C00, 1024);
+ * session.write(STM32_FLASH_BASE + 0x7C00, settings, sizeof(settings));
+ * session.read(0x1FFFF7B8, calibration, sizeof(calibration));
+ * session.disconnect();
+ * @endcode
+ */
+class Session {
+public:
+    Session(const FlashConfig& config) : _config(config) {}
+    ~Session() { disconnect(); }
+
+    Session(const Session&) = delete;
+    Session& operator=(const Session&) = delete;
+
+    /**
+     * @brief Enter flash mode and open the bootloader session
+     * @return FlashStatus indicating success or specific error
+     */
+    FlashStatus connect();
+
+    /**
+     * @brief Leave flash mode, resetting the STM32 into its application
+     */
+    void disconnect();
+
+    bool isConnected() const { return _connected; }
+
+    /**
+     * @brief Device capabilities, valid once connected
+     */
+    const DeviceInfo& deviceInfo() const { return _info; }
+
+    /**
+     * @brief Erase the flash pages (or sectors) overlapping a range
+     * @param address Start of the range, from STM32_FLASH_BASE
+     * @param size Size of the range in bytes
+     * @return FlashStatus indicating success or specific error
+     */
+    FlashStatus erase(uint32_t address, size_t size);
+
+    /**
+     * @brief Erase the whole flash memory
+     * @return FlashStatus indicating success or specific error
+     */
+    FlashStatus eraseAll();
+
+    /**
+     * @brief Write data, the range must already be erased
+     * @param address Destination address, aligned to the programming unit of the device (4 or 8 bytes)
+     * @param data Data to write (the last unit is padded with 0xFF)
+     * @param size Size of the data in bytes
+     * @return FlashStatus indicating success or specific error
+     */
+    FlashStatus write(uint32_t address, const uint8_t* data, size_t size);
+
+    /**
+     * @brief Read memory (flash, system memory, option bytes, RAM...)
+     * @param address Source address
+     * @param data Destination buffer
+     * @param size Number of bytes to read
+     * @return FlashStatus indicating success or specific error
+     */
+    FlashStatus read(uint32_t address, uint8_t* data, size_t size);
+
+    /**
+     * @brief Read memory back and compare it with data
+     * @param address Address of the range
+     * @param data Expected contents
+     * @param size Size of the range in bytes
+     * @return SUCCESS, ERROR_VERIFY_FAILED on mismatch or a read error
+     */
+    FlashStatus verify(uint32_t address, const uint8_t* data, size_t size);
+
+    /**
+     * @brief Start the application with the GO command (no reset), closing the session
+     * @param address Start of the application vector table
+     * @return FlashStatus indicating success or specific error
+     */
+    FlashStatus go(uint32_t address = STM32_FLASH_BASE);
+
+private:
+    FlashConfig _config;
+    DeviceInfo _info;
+    bool _connected = false;
+};
 
 } // namespace stm32flash
 
@@ -39,7 +39,6 @@ void writelogToFile(esp_log_level_t level, const char *log_print_buffer)
 void logger(esp_log_level_t level, const char *TAG, int line, const char *func, const char *fmt, ...)
 {
     char log_print_buffer[LOG_BUFFER_SIZE];
-    memset(log_print_buffer, '\0', LOG_BUFFER_SIZE);
     sprintf(log_print_buffer, "%s (%s:%d) ", TAG, func, line);
 
     va_list args;
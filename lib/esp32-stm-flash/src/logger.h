@@ -14,12 +14,26 @@ namespace internal {
 #define LOG_BUFFER_SIZE 512
 #define LOG_FILE_PATH "/spiffs/log.txt"
 
+// Most verbose level built in, same numbering as esp_log_level_t (CORE_DEBUG_LEVEL on Arduino-ESP32)
+#ifndef STM_LOG_LEVEL
+#if defined(CORE_DEBUG_LEVEL)
+#define STM_LOG_LEVEL CORE_DEBUG_LEVEL
+#elif defined(LOG_LOCAL_LEVEL)
+#define STM_LOG_LEVEL LOG_LOCAL_LEVEL
+#else
+#define STM_LOG_LEVEL ESP_LOG_VERBOSE
+#endif
+#endif
+
 // Macros pour faciliter l'utilisation du logger
-#define logE(tag, format, ...) logger(ESP_LOG_ERROR, tag, __LINE__, __FUNCTION__, format, ##__VA_ARGS__)
-#define logW(tag, format, ...) logger(ESP_LOG_WARN, tag, __LINE__, __FUNCTION__, format, ##__VA_ARGS__)
-#define logI(tag, format, ...) logger(ESP_LOG_INFO, tag, __LINE__, __FUNCTION__, format, ##__VA_ARGS__)
-#define logD(tag, format, ...) logger(ESP_LOG_DEBUG, tag, __LINE__, __FUNCTION__, format, ##__VA_ARGS__)
-#define logV(tag, format, ...) logger(ESP_LOG_VERBOSE, tag, __LINE__, __FUNCTION__, format, ##__VA_ARGS__)
+// Messages above STM_LOG_LEVEL are dropped before the call: no formatting cost on the per-block path
+#define logAt(level, tag, format, ...) \
+    do { if ((level) <= STM_LOG_LEVEL) logger(level, tag, __LINE__, __FUNCTION__, format, ##__VA_ARGS__); } while (0)
+#define logE(tag, format, ...) logAt(ESP_LOG_ERROR, tag, format, ##__VA_ARGS__)
+#define logW(tag, format, ...) logAt(ESP_LOG_WARN, tag, format, ##__VA_ARGS__)
+#define logI(tag, format, ...) logAt(ESP_LOG_INFO, tag, format, ##__VA_ARGS__)
+#define logD(tag, format, ...) logAt(ESP_LOG_DEBUG, tag, format, ##__VA_ARGS__)
+#define logV(tag, format, ...) logAt(ESP_LOG_VERBOSE, tag, format, ##__VA_ARGS__)
 
 void logger(esp_log_level_t level, const char *TAG, int line, const char *func, const char *fmt, ...);
 bool setLogToFile(void);
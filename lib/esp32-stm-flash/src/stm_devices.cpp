@@ -0,0 +1,128 @@
+#include "stm_devices.h"
+
+namespace stm32flash {
+namespace internal {
+
+#define KB(n) ((n) * 1024)
+
+// Flash size registers
+#define F0_FLASH_SIZE_ADDRESS 0x1FFFF7CC
+#define F1_FLASH_SIZE_ADDRESS 0x1FFFF7E0
+#define F4_FLASH_SIZE_ADDRESS 0x1FFF7A22
+#define G0_L4_FLASH_SIZE_ADDRESS 0x1FFF75E0
+
+// Unique device ID registers (96 bits)
+#define F0_UID_ADDRESS 0x1FFFF7AC
+#define F1_UID_ADDRESS 0x1FFFF7E8
+#define F4_UID_ADDRESS 0x1FFF7A10
+#define G0_L4_UID_ADDRESS 0x1FFF7590
+
+// Sector layouts of the F4 (4 x 16KB, 64KB, then 128KB sectors; dual bank parts repeat it in bank 2)
+static constexpr FlashLayout F4_LAYOUT_128K = {{{4, KB(16)}, {1, KB(64)}}};
+static constexpr FlashLayout F4_LAYOUT_256K = {{{4, KB(16)}, {1, KB(64)}, {1, KB(128)}}};
+static constexpr FlashLayout F4_LAYOUT_512K = {{{4, KB(16)}, {1, KB(64)}, {3, KB(128)}}};
+static constexpr FlashLayout F4_LAYOUT_1M = {{{4, KB(16)}, {1, KB(64)}, {7, KB(128)}}};
+static constexpr FlashLayout F4_LAYOUT_1536K = {{{4, KB(16)}, {1, KB(64)}, {11, KB(128)}}};
+static constexpr FlashLayout F4_LAYOUT_2M = {{{4, KB(16)}, {1, KB(64)}, {7, KB(128)}, {4, KB(16)}, {1, KB(64)}, {7, KB(128)}}};
+
+// Dual bank G0B/G0C: 2KB pages in two equal banks, bank 2 numbered from page 256 whatever the size of bank 1
+static constexpr FlashLayout G0B_LAYOUT = {{{128, KB(2)}, {128, 0}, {128, KB(2)}}};
+
+// Worst-case times (ms): {write of a BLOCK_SIZE block, read, per page or sector erase, mass erase}
+static constexpr OperationTimes F0_F1_TIMES = {15, 20, 60, 200};
+static constexpr OperationTimes F4_TIMES = {15, 20, 4000, 40000};
+static constexpr OperationTimes F4_DUAL_BANK_TIMES = {15, 20, 4000, 80000};
+static constexpr OperationTimes G0_TIMES = {10, 20, 60, 200};
+static constexpr OperationTimes L4_TIMES = {10, 20, 40, 200};
+
+static constexpr DeviceSpec DEVICES[] = {
+    // F0: 1KB or 2KB pages, half-word programming, bootloader v3.x with EXTENDED ERASE
+    {0x444, "STM32F03x", KB(32), F0_FLASH_SIZE_ADDRESS, F0_UID_ADDRESS, FlashLayout::uniform(KB(1)), 2, CMD_EXT_ERASE, F0_F1_TIMES},
+    {0x445, "STM32F04x", KB(32), F0_FLASH_SIZE_ADDRESS, F0_UID_ADDRESS, FlashLayout::uniform(KB(1)), 2, CMD_EXT_ERASE, F0_F1_TIMES},
+    {0x440, "STM32F030x8/F05x", KB(64), F0_FLASH_SIZE_ADDRESS, F0_UID_ADDRESS, FlashLayout::uniform(KB(1)), 2, CMD_EXT_ERASE, F0_F1_TIMES},
+    {0x448, "STM32F070xB/F07x", KB(128), F0_FLASH_SIZE_ADDRESS, F0_UID_ADDRESS, FlashLayout::uniform(KB(2)), 2, CMD_EXT_ERASE, F0_F1_TIMES},
+    {0x442, "STM32F030xC/F09x", KB(256), F0_FLASH_SIZE_ADDRESS, F0_UID_ADDRESS, FlashLayout::uniform(KB(2)), 2, CMD_EXT_ERASE, F0_F1_TIMES},
+
+    // F1: 1KB or 2KB pages, half-word programming
+    {0x412, "STM32F10x low-density", KB(32), F1_FLASH_SIZE_ADDRESS, F1_UID_ADDRESS, FlashLayout::uniform(KB(1)), 2, CMD_ERASE, F0_F1_TIMES},
+    {0x410, "STM32F10x medium-density", KB(128), F1_FLASH_SIZE_ADDRESS, F1_UID_ADDRESS, FlashLayout::uniform(KB(1)), 2, CMD_ERASE, F0_F1_TIMES},
+    {0x414, "STM32F10x high-density", KB(512), F1_FLASH_SIZE_ADDRESS, F1_UID_ADDRESS, FlashLayout::uniform(KB(2)), 2, CMD_ERASE, F0_F1_TIMES},
+    {0x430, "STM32F10x XL-density", KB(1024), F1_FLASH_SIZE_ADDRESS, F1_UID_ADDRESS, FlashLayout::uniform(KB(2)), 2, CMD_EXT_ERASE, F0_F1_TIMES},
+    {0x418, "STM32F105/F107", KB(256), F1_FLASH_SIZE_ADDRESS, F1_UID_ADDRESS, FlashLayout::uniform(KB(2)), 2, CMD_ERASE, F0_F1_TIMES},
+    {0x420, "STM32F100 medium-density", KB(128), F1_FLASH_SIZE_ADDRESS, F1_UID_ADDRESS, FlashLayout::uniform(KB(1)), 2, CMD_ERASE, F0_F1_TIMES},
+    {0x428, "STM32F100 high-density", KB(512), F1_FLASH_SIZE_ADDRESS, F1_UID_ADDRESS, FlashLayout::uniform(KB(2)), 2, CMD_ERASE, F0_F1_TIMES},
+
+    // F4: 16KB to 128KB sectors, word programming
+    {0x413, "STM32F405/F407", KB(1024), F4_FLASH_SIZE_ADDRESS, F4_UID_ADDRESS, F4_LAYOUT_1M, 4, CMD_EXT_ERASE, F4_TIMES},
+    {0x419, "STM32F42x/F43x", KB(2048), F4_FLASH_SIZE_ADDRESS, F4_UID_ADDRESS, F4_LAYOUT_2M, 4, CMD_EXT_ERASE, F4_DUAL_BANK_TIMES},
+    {0x423, "STM32F401xB/C", KB(256), F4_FLASH_SIZE_ADDRESS, F4_UID_ADDRESS, F4_LAYOUT_256K, 4, CMD_EXT_ERASE, F4_TIMES},
+    {0x433, "STM32F401xD/E", KB(512), F4_FLASH_SIZE_ADDRESS, F4_UID_ADDRESS, F4_LAYOUT_512K, 4, CMD_EXT_ERASE, F4_TIMES},
+    {0x431, "STM32F411", KB(512), F4_FLASH_SIZE_ADDRESS, F4_UID_ADDRESS, F4_LAYOUT_512K, 4, CMD_EXT_ERASE, F4_TIMES},
+    {0x421, "STM32F446", KB(512), F4_FLASH_SIZE_ADDRESS, F4_UID_ADDRESS, F4_LAYOUT_512K, 4, CMD_EXT_ERASE, F4_TIMES},
+    {0x458, "STM32F410", KB(128), F4_FLASH_SIZE_ADDRESS, F4_UID_ADDRESS, F4_LAYOUT_128K, 4, CMD_EXT_ERASE, F4_TIMES},
+    {0x441, "STM32F412", KB(1024), F4_FLASH_SIZE_ADDRESS, F4_UID_ADDRESS, F4_LAYOUT_1M, 4, CMD_EXT_ERASE, F4_TIMES},
+    {0x463, "STM32F413/F423", KB(1536), F4_FLASH_SIZE_ADDRESS, F4_UID_ADDRESS, F4_LAYOUT_1536K, 4, CMD_EXT_ERASE, F4_TIMES},
+
+    // G0: 2KB pages, double-word programming
+    {0x466, "STM32G03x/G04x", KB(64), G0_L4_FLASH_SIZE_ADDRESS, G0_L4_UID_ADDRESS, FlashLayout::uniform(KB(2)), 8, CMD_EXT_ERASE, G0_TIMES},
+    {0x456, "STM32G05x/G06x", KB(64), G0_L4_FLASH_SIZE_ADDRESS, G0_L4_UID_ADDRESS, FlashLayout::uniform(KB(2)), 8, CMD_EXT_ERASE, G0_TIMES},
+    {0x460, "STM32G07x/G08x", KB(128), G0_L4_FLASH_SIZE_ADDRESS, G0_L4_UID_ADDRESS, FlashLayout::uniform(KB(2)), 8, CMD_EXT_ERASE, G0_TIMES},
+    {0x467, "STM32G0Bx/G0Cx", KB(512), G0_L4_FLASH_SIZE_ADDRESS, G0_L4_UID_ADDRESS, G0B_LAYOUT, 8, CMD_EXT_ERASE, G0_TIMES},
+
+    // L4: 2KB pages, double-word programming
+    {0x464, "STM32L41x/L42x", KB(128), G0_L4_FLASH_SIZE_ADDRESS, G0_L4_UID_ADDRESS, FlashLayout::uniform(KB(2)), 8, CMD_EXT_ERASE, L4_TIMES},
+    {0x435, "STM32L43x/L44x", KB(256), G0_L4_FLASH_SIZE_ADDRESS, G0_L4_UID_ADDRESS, FlashLayout::uniform(KB(2)), 8, CMD_EXT_ERASE, L4_TIMES},
+    {0x462, "STM32L45x/L46x", KB(512), G0_L4_FLASH_SIZE_ADDRESS, G0_L4_UID_ADDRESS, FlashLayout::uniform(KB(2)), 8, CMD_EXT_ERASE, L4_TIMES},
+    {0x415, "STM32L47x/L48x", KB(1024), G0_L4_FLASH_SIZE_ADDRESS, G0_L4_UID_ADDRESS, FlashLayout::uniform(KB(2)), 8, CMD_EXT_ERASE, L4_TIMES},
+    {0x461, "STM32L496/L4A6", KB(1024), G0_L4_FLASH_SIZE_ADDRESS, G0_L4_UID_ADDRESS, FlashLayout::uniform(KB(2)), 8, CMD_EXT_ERASE, L4_TIMES},
+};
+
+const DeviceSpec *findDevice(uint16_t product_id)
+{
+    for (size_t i = 0; i < sizeof(DEVICES) / sizeof(DEVICES[0]); i++)
+    {
+        if (DEVICES[i].product_id == product_id)
+        {
+            return &DEVICES[i];
+        }
+    }
+    return NULL;
+}
+
+FlashLayout flashLayout(const FlashConfig &config, const DeviceInfo &info)
+{
+    if (config.page_size > 0)
+    {
+        return FlashLayout::uniform(config.page_size);
+    }
+
+    const DeviceSpec *device = findDevice(info.product_id);
+    if (device == NULL)
+    {
+        return FlashLayout{};
+    }
+
+    // Banks numbered apart (bank 1, skipped page numbers, bank 2): smaller parts have smaller banks,
+    // but the first page number of bank 2 stays the same
+    FlashLayout layout = device->layout;
+    const FlashLayout::Region &bank = layout.regions[0];
+    if (layout.regions[1].size == 0 && layout.regions[1].count > 0 &&
+        info.flash_size > 0 && info.flash_size < device->flash_size)
+    {
+        const uint32_t bank_pages = info.flash_size / 2 / bank.size;
+        const uint32_t bank2_page = bank.count + layout.regions[1].count;
+        layout.regions[0].count = bank_pages;
+        layout.regions[1].count = bank2_page - bank_pages;
+        layout.regions[2].count = bank_pages;
+    }
+    return layout;
+}
+
+uint32_t writeAlignment(const DeviceInfo &info)
+{
+    const DeviceSpec *device = findDevice(info.product_id);
+    return (device != NULL) ? MAX(4, device->write_align) : 4;
+}
+
+} // namespace internal
+} // namespace stm32flash
@@ -0,0 +1,48 @@
+#ifndef _STM_DEVICES_H
+#define _STM_DEVICES_H
+
+#include "stm_pro_mode.h"
+
+namespace stm32flash {
+namespace internal {
+
+//Flash memory of an STM32 line, identified by the product ID of GET ID
+struct DeviceSpec {
+    uint16_t product_id;
+    const char *name;
+    uint32_t flash_size;         // Largest flash memory of the line (bytes)
+    uint32_t flash_size_address; // Flash size register (16 bits, KB) giving the size of the actual part
+    uint32_t uid_address;        // 96-bit unique device ID
+    FlashLayout layout;          // Pages or sectors of the largest part, as numbered by the erase commands
+    uint8_t write_align;         // Programming unit (bytes): half-word, word or double word
+    uint8_t erase_command;       // Erase command of the bootloader (CMD_ERASE or CMD_EXT_ERASE)
+    OperationTimes times;        // Worst-case write and erase times, from the datasheets
+};
+
+/**
+ * @brief Look up a device in the device table
+ *
+ * @param product_id Product ID from GET ID
+ *
+ * @return The device, or NULL if the product ID is unknown
+ */
+const DeviceSpec *findDevice(uint16_t product_id);
+
+/**
+ * @brief Get the erase geometry used for a device
+ *
+ * An explicit config.page_size overrides the device table (uniform pages of that size)
+ *
+ * @return The layout, invalid (see FlashLayout::isValid) if the device is unknown and no page size is set
+ */
+FlashLayout flashLayout(const FlashConfig &config, const DeviceInfo &info);
+
+/**
+ * @brief Get the WRITE MEMORY alignment of a device (4 bytes, 8 on families programmed by double words)
+ */
+uint32_t writeAlignment(const DeviceInfo &info);
+
+} // namespace internal
+} // namespace stm32flash
+
+#endif
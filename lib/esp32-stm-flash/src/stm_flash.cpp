@@ -1,14 +1,13 @@
 #include "stm_flash.h"
+#include "stm_devices.h"
 
 namespace stm32flash {
 namespace internal {
 
 static const char *TAG_STM_FLASH = "stm_flash";
 
-FlashStatus flashSTM(const char *file_name, gpio_num_t reset_pin, gpio_num_t boot0_pin, gpio_num_t uart_tx, gpio_num_t uart_rx, uart_port_t uart_num)
+FlashStatus openImageFile(const char *file_name, FILE **file, uint32_t *size)
 {
-    FILE *flash_file = NULL;
-
     // Initialize SPIFFS
     if (initSPIFFS() != stm32flash::SUCCESS) {
         logE(TAG_STM_FLASH, "Failed to initialize SPIFFS, aborting flash!");
@@ -35,144 +34,1282 @@ FlashStatus flashSTM(const char *file_name, gpio_num_t reset_pin, gpio_num_t boo
     }
     logI(TAG_STM_FLASH, "Found file, size: %ld bytes", st.st_size);
 
-    // Check file size
-    if (st.st_size == 0) {
-        logE(TAG_STM_FLASH, "File is empty, aborting flash!");
+    // Open file
+    *file = fopen(file_path, "rb");
+    if (*file == NULL) {
+        logE(TAG_STM_FLASH, "Failed to open file, aborting flash!");
+        return stm32flash::ERROR_CANNOT_OPEN_FILE;
+    }
+    *size = st.st_size;
+    return stm32flash::SUCCESS;
+}
+
+FlashStatus flashSTM(const char *file_name, const FlashConfig& config, FlashReport* report)
+{
+    FILE *flash_file = NULL;
+    uint32_t file_size = 0;
+    const int64_t mount_start = esp_timer_get_time();
+    stm32flash::FlashStatus status = openImageFile(file_name, &flash_file, &file_size);
+    const uint32_t mount_us = esp_timer_get_time() - mount_start;
+    if (status != stm32flash::SUCCESS) {
+        return status;
+    }
+
+    // Compressed images are detected by their header and decompressed on the fly
+    FileImageSource source(flash_file, file_size);
+    status = flashAnyImage(source, config, report);
+    if (report != NULL) {
+        report->mount_us = mount_us;
+    }
+
+    // Close file
+    fclose(flash_file);
+    return status;
+}
+
+FlashStatus flashSTM(const FlashImage& image, const FlashConfig& config, FlashReport* report)
+{
+    if (image.data != NULL) {
+        MemoryImageSource source(image.data, image.size);
+        return flashAnyImage(source, config, report);
+    }
+
+    // Pages are read straight from the mapped partition, without VFS or intermediate copies
+    PartitionImageSource source;
+    const int64_t map_start = esp_timer_get_time();
+    stm32flash::FlashStatus status = source.map(image.partition_label, image.size);
+    const uint32_t map_us = esp_timer_get_time() - map_start;
+    if (status != stm32flash::SUCCESS) {
+        logE(TAG_STM_FLASH, "Failed to map image partition, aborting flash!");
+        return status;
+    }
+    status = flashAnyImage(source, config, report);
+    if (report != NULL) {
+        report->mount_us = map_us;
+    }
+    return status;
+}
+
+struct TargetJob {
+    ImageSource *source;
+    FlashTarget *target;
+    SemaphoreHandle_t finished;
+};
+
+static void flashTargetTask(void *arg)
+{
+    TargetJob *job = (TargetJob *)arg;
+    FlashTarget *target = job->target;
+
+    target->status = flashImage(*job->source, target->config, &target->report);
+    logI(TAG_STM_FLASH, "UART%d: %s", target->config.uart_num, toString(target->status));
+
+    xSemaphoreGive(job->finished);
+    vTaskDelete(NULL);
+}
+
+FlashStatus flashTargets(ImageSource &source, FlashTarget *targets, size_t count)
+{
+    if (count == 0 || count > MAX_FLASH_TARGETS) {
+        return stm32flash::ERROR_CONFIG_INVALID;
+    }
+
+    // Broadcast: every page is read, decompressed and checksummed once, the workers only share the result
+    PreparedImageSource prepared;
+    stm32flash::FlashStatus status;
+    if (CompressedImageSource::isCompressed(source)) {
+        CompressedImageSource compressed(source);
+        status = compressed.open();
+        if (status == stm32flash::SUCCESS) {
+            status = prepared.prepare(compressed);
+        }
+    } else if (HexImageSource::isHex(source)) {
+        HexImageSource hex(source);
+        status = hex.open();
+        if (status == stm32flash::SUCCESS) {
+            status = prepared.prepare(hex);
+        }
+    } else if (ElfImageSource::isElf(source)) {
+        ElfImageSource elf(source);
+        status = elf.open();
+        if (status == stm32flash::SUCCESS) {
+            status = prepared.prepare(elf);
+        }
+    } else {
+        status = prepared.prepare(source);
+    }
+    if (status != stm32flash::SUCCESS) {
+        logE(TAG_STM_FLASH, "Failed to prepare image, aborting flash!");
+        return status;
+    }
+
+    SemaphoreHandle_t finished = xSemaphoreCreateCounting(count, 0);
+    if (finished == NULL) {
+        logE(TAG_STM_FLASH, "Failed to create multi-target semaphore");
+        return stm32flash::ERROR_UNKNOWN;
+    }
+
+    TargetJob jobs[MAX_FLASH_TARGETS];
+    size_t started = 0;
+    for (size_t i = 0; i < count; i++) {
+        jobs[i] = {&prepared, &targets[i], finished};
+        targets[i].report = FlashReport();
+
+        // One worker per UART, at the caller's priority
+        if (xTaskCreate(flashTargetTask, "stm_flash_tgt", FLASH_TARGET_STACK_SIZE, &jobs[i],
+                        uxTaskPriorityGet(NULL), NULL) != pdPASS) {
+            logE(TAG_STM_FLASH, "Failed to create worker for UART%d", targets[i].config.uart_num);
+            targets[i].status = stm32flash::ERROR_UNKNOWN;
+            continue;
+        }
+        started++;
+    }
+
+    for (size_t i = 0; i < started; i++) {
+        xSemaphoreTake(finished, portMAX_DELAY);
+    }
+    vSemaphoreDelete(finished);
+
+    bool flashed = false;
+    for (size_t i = 0; i < count; i++) {
+        if (targets[i].status != stm32flash::SUCCESS && targets[i].status != stm32flash::ALREADY_UP_TO_DATE) {
+            return targets[i].status;
+        }
+        flashed |= (targets[i].status == stm32flash::SUCCESS);
+    }
+    return flashed ? stm32flash::SUCCESS : stm32flash::ALREADY_UP_TO_DATE;
+}
+
+FlashStatus flashTargets(const char *file_name, FlashTarget *targets, size_t count)
+{
+    FILE *flash_file = NULL;
+    uint32_t file_size = 0;
+    stm32flash::FlashStatus status = openImageFile(file_name, &flash_file, &file_size);
+    if (status != stm32flash::SUCCESS) {
+        return status;
+    }
+    if (file_size == 0) {
+        fclose(flash_file);
         return stm32flash::ERROR_FILE_EMPTY;
     }
-    if (st.st_size > MAX_FLASH_SIZE) {
-        logE(TAG_STM_FLASH, "File too large: %ld bytes (max: %d), aborting flash!", st.st_size, MAX_FLASH_SIZE);
-        return stm32flash::ERROR_FILE_TOO_LARGE;
+
+    // The file is read only once, while preparing the shared pages
+    FileImageSource source(flash_file, file_size);
+    status = flashTargets(source, targets, count);
+    fclose(flash_file);
+    return status;
+}
+
+FlashStatus flashTargets(const FlashImage& image, FlashTarget *targets, size_t count)
+{
+    if (image.data != NULL) {
+        MemoryImageSource source(image.data, image.size);
+        return flashTargets(source, targets, count);
     }
 
-    // Enter flash mode
-    if (setFlashMode(reset_pin, boot0_pin, uart_num, true) != stm32flash::SUCCESS) {
-        logE(TAG_STM_FLASH, "Failed to set flash mode, aborting flash!");
-        return stm32flash::ERROR_GPIO_INIT;
+    PartitionImageSource source;
+    stm32flash::FlashStatus status = source.map(image.partition_label, image.size);
+    if (status != stm32flash::SUCCESS) {
+        logE(TAG_STM_FLASH, "Failed to map image partition, aborting flash!");
+        return status;
     }
+    return flashTargets(source, targets, count);
+}
 
-    // Initialize UART
-    if (initFlashUART(uart_num, uart_tx, uart_rx) != stm32flash::SUCCESS) {
-        logE(TAG_STM_FLASH, "Failed to initialize UART, aborting flash!");
-        return stm32flash::ERROR_UART_INIT;
+FlashStatus flashAnyImage(ImageSource &source, const FlashConfig& config, FlashReport* report)
+{
+    // Intel HEX and ELF images are flashed segment by segment, leaving the gaps untouched
+    if (HexImageSource::isHex(source)) {
+        HexImageSource hex(source);
+        stm32flash::FlashStatus status = hex.open();
+        if (status != stm32flash::SUCCESS) {
+            logE(TAG_STM_FLASH, "Invalid HEX image, aborting flash!");
+            return status;
+        }
+        return flashImage(hex, config, report);
     }
-    
-    // Check if STM32 is present
-    if (isSTMPresent(reset_pin, uart_num) != stm32flash::SUCCESS) {
-        logE(TAG_STM_FLASH, "STM32 not detected, aborting flash!");
-        return stm32flash::ERROR_STM_NOT_FOUND;
+    if (ElfImageSource::isElf(source)) {
+        ElfImageSource elf(source);
+        stm32flash::FlashStatus status = elf.open();
+        if (status != stm32flash::SUCCESS) {
+            logE(TAG_STM_FLASH, "Invalid ELF image, aborting flash!");
+            return status;
+        }
+        return flashImage(elf, config, report);
     }
-    
-    // Open file
-    flash_file = fopen(file_path, "rb");
-    if (flash_file == NULL) {
-        logE(TAG_STM_FLASH, "Failed to open file, aborting flash!");
-        return stm32flash::ERROR_CANNOT_OPEN_FILE;
+
+    if (!CompressedImageSource::isCompressed(source)) {
+        return flashImage(source, config, report);
     }
 
-    // Execute flash sequence
-    do {
+    CompressedImageSource compressed(source);
+    stm32flash::FlashStatus status = compressed.open();
+    if (status != stm32flash::SUCCESS) {
+        logE(TAG_STM_FLASH, "Invalid compressed image, aborting flash!");
+        return status;
+    }
+    return flashImage(compressed, config, report);
+}
+
+// Erase, write and verify steps of flashSession. With resuming set, the write continues from journal->next_offset.
+// The journal (NULL if not journaling) is cleared once the write completes, so a failed verification starts over.
+static FlashStatus writeImage(ImageSource &source, const FlashConfig& config, const DeviceInfo &info, const FlashLayout &layout,
+                              FlashReport *report, FlashJournal *journal, bool resuming)
+{
+    const uart_port_t uart_num = config.uart_num;
+    stm32flash::FlashStatus status = stm32flash::SUCCESS;
+
+    // Erase only the pages covered by the image if requested (always in delta mode), mass erase otherwise
+    ErasePlan erase_plan;
+    const ErasePlan *plan = NULL;
+    if (config.erase_mode == ERASE_PAGES || config.delta) {
+        if (!layout.isValid()) {
+            logW(TAG_STM_FLASH, "Flash layout of PID 0x%03X unknown (set page_size), using mass erase", info.product_id);
+        } else if (planErase(erase_plan, source, layout)) {
+            plan = &erase_plan;
+        }
+    }
+
+    // Resume: the pages before the journal offset are done, the rest of the image is still erased, except the
+    // pages written since the journal was last saved: up to JOURNAL_INTERVAL bytes, the last page maybe partly.
+    // Those are erased again, unless they lie in a gap of the image.
+    if (resuming) {
+        ErasePlan resume_plan;
+        planErase(resume_plan, journal->next_offset,
+                  MIN((uint32_t)JOURNAL_INTERVAL, source.size() - journal->next_offset), layout);
+        for (int i = resume_plan.count - 1; i >= 0; i--) {
+            if (!pageHoldsData(source, layout, resume_plan.pages[i])) {
+                resume_plan.remove(resume_plan.pages[i]);
+            }
+        }
+        if (resume_plan.count > 0) {
+            startPhase(uart_num, PHASE_ERASE, resume_plan.size());
+            status = eraseSTM(uart_num, info, &resume_plan);
+            if (status != stm32flash::SUCCESS) {
+                logE(TAG_STM_FLASH, "Erase failed, aborting flash!");
+                return status;
+            }
+            addProgress(uart_num, resume_plan.size());
+        }
+
+        report->resumed_from = journal->next_offset;
+        status = writeTask(source, uart_num, NULL, config.retries, report, journal, journal->next_offset);
+        if (status != stm32flash::SUCCESS) {
+            logE(TAG_STM_FLASH, "Write failed, aborting flash!");
+            return status;
+        }
+        plan = NULL;
+    } else {
+        // Delta mode: drop the pages that already hold the right data
+        if (config.delta && plan != NULL) {
+            if (!info.supports(CMD_READ)) {
+                logW(TAG_STM_FLASH, "Bootloader does not support READ MEMORY, rewriting all pages");
+            } else if (!layout.isBlockAligned()) {
+                logW(TAG_STM_FLASH, "Page size is not a multiple of %d bytes, rewriting all pages", BLOCK_SIZE);
+            } else {
+                logI(TAG_STM_FLASH, "%s", "Comparing STM32 Memory");
+                status = diffTask(source, uart_num, erase_plan, config.retries, report);
+                if (status != stm32flash::SUCCESS) {
+                    logE(TAG_STM_FLASH, "Read back failed, aborting flash!");
+                    return status;
+                }
+            }
+        }
+
+        if (plan != NULL) {
+            logI(TAG_STM_FLASH, "Page erase: %d pages", plan->count);
+        }
+        const uint32_t erase_size = (plan != NULL) ? plan->size() : info.flash_size;
+        startPhase(uart_num, PHASE_ERASE, erase_size);
+        status = eraseSTM(uart_num, info, plan);
+        if (status != stm32flash::SUCCESS) {
+            logE(TAG_STM_FLASH, "Erase failed, aborting flash!");
+            return status;
+        }
+        addProgress(uart_num, erase_size);
+
+        // From now on an interrupted write can be resumed
+        if (journal != NULL) {
+            journal->erased_size = (plan != NULL) ? layout.pageEnd(plan->pages[plan->count - 1]) : UINT32_MAX;
+            journal->next_offset = 0;
+            saveJournal(uart_num, *journal);
+        }
+
         logI(TAG_STM_FLASH, "%s", "Writing STM32 Memory");
-        stm32flash::FlashStatus status = writeTask(flash_file, reset_pin, uart_num);
+        status = writeTask(source, uart_num, plan, config.retries, report, journal);
         if (status != stm32flash::SUCCESS) {
             logE(TAG_STM_FLASH, "Write failed, aborting flash!");
             return status;
         }
+    }
+
+    // The whole image is written: there is nothing left to resume. Its last page end is below the image size
+    // when the image is not page-aligned, so a journal kept past this point would resume a finished write forever.
+    if (journal != NULL) {
+        clearJournal(uart_num);
+    }
+
+    logI(TAG_STM_FLASH, "Pages written: %lu, skipped: %lu, blank bytes skipped: %lu, retried: %lu",
+         (unsigned long)report->pages_written, (unsigned long)report->pages_skipped,
+         (unsigned long)report->blank_bytes_skipped, (unsigned long)report->pages_retried);
 
+    if (config.verify_mode == VERIFY_NONE) {
+        logI(TAG_STM_FLASH, "%s", "Verification disabled");
+    } else if (!info.supports(CMD_READ)) {
+        logW(TAG_STM_FLASH, "Bootloader does not support READ MEMORY, skipping verification");
+    } else {
         logI(TAG_STM_FLASH, "%s", "Reading STM32 Memory");
-        status = readTask(flash_file, uart_num);
+        status = readTask(source, uart_num, plan, config.verify_mode, config.retries, report);
         if (status != stm32flash::SUCCESS) {
             logE(TAG_STM_FLASH, "Read & Verification failed, aborting flash!");
             return status;
         }
+    }
+    return stm32flash::SUCCESS;
+}
+
+// Flash sequence of flashImage, reporting to the monitor of the UART (report is never NULL)
+static FlashStatus flashSession(ImageSource &source, const FlashConfig& config, FlashReport* report)
+{
+    const gpio_num_t reset_pin = config.reset_pin;
+    const gpio_num_t boot0_pin = config.boot0_pin;
+    const uart_port_t uart_num = config.uart_num;
+
+    // Check image size
+    const uint32_t image_size = source.size();
+    if (image_size == 0) {
+        logE(TAG_STM_FLASH, "Image is empty, aborting flash!");
+        return stm32flash::ERROR_FILE_EMPTY;
+    }
+
+    // Enter flash mode: this is the only reset of the session, the bootloader is kept from presence check to exit
+    const int64_t setup_start = esp_timer_get_time();
+    startPhase(uart_num, PHASE_CONNECT, 0);
+    if (setFlashMode(reset_pin, boot0_pin, uart_num, true, config.reset_pulse_ms, config.reset_settle_ms) != stm32flash::SUCCESS) {
+        logE(TAG_STM_FLASH, "Failed to set flash mode, aborting flash!");
+        return stm32flash::ERROR_GPIO_INIT;
+    }
 
+    // Execute flash sequence
+    stm32flash::FlashStatus status = stm32flash::SUCCESS;
+    DeviceInfo info;
+    const bool journaling = config.resume && !config.delta;
+    FlashJournal journal = {};
+    bool resuming = false;
+    do {
+        // Initialize UART
+        if (initFlashUART(uart_num, config.uart_tx, config.uart_rx, config.baud_rate) != stm32flash::SUCCESS) {
+            logE(TAG_STM_FLASH, "Failed to initialize UART, aborting flash!");
+            status = stm32flash::ERROR_UART_INIT;
+            break;
+        }
+
+        // Check if STM32 is present
+        const int64_t sync_start = esp_timer_get_time();
+        status = isSTMPresent(reset_pin, uart_num, config, &info);
+        report->sync_us = esp_timer_get_time() - sync_start;
+        if (status != stm32flash::SUCCESS) {
+            logE(TAG_STM_FLASH, "STM32 not detected, aborting flash!");
+            status = stm32flash::ERROR_STM_NOT_FOUND;
+            break;
+        }
+        uart_get_baudrate(uart_num, &report->baud_rate);
+
+        // Setup STM32 to receive the image
+        status = setupSTM(uart_num, info);
+        if (status != stm32flash::SUCCESS) {
+            logE(TAG_STM_FLASH, "Setup failed, aborting flash!");
+            break;
+        }
+        report->setup_time_ms = (esp_timer_get_time() - setup_start) / 1000;
+        logI(TAG_STM_FLASH, "Session setup took %lu ms", (unsigned long)report->setup_time_ms);
+
+        // The device table knows the flash size, the default limit only applies to unknown devices
+        const uint32_t flash_size = (info.flash_size > 0) ? info.flash_size : MAX_FLASH_SIZE;
+        if (image_size > flash_size) {
+            logE(TAG_STM_FLASH, "Image too large: %lu bytes (max: %lu), aborting flash!", (unsigned long)image_size, (unsigned long)flash_size);
+            status = stm32flash::ERROR_FILE_TOO_LARGE;
+            break;
+        }
+        const FlashLayout layout = flashLayout(config, info);
+
+        // Resume an interrupted flash of the same image. Delta mode needs no journal: it already skips the pages written before.
+        if (journaling) {
+            journal.version = JOURNAL_VERSION;
+            journal.image_size = image_size;
+            journal.product_id = info.product_id;
+            readDeviceUid(uart_num, info, journal.uid);
+            journal.layout = layout;
+            if (imageCrc(source, &journal.image_crc) != stm32flash::SUCCESS) {
+                logE(TAG_STM_FLASH, "Failed to read image, aborting flash!");
+                status = stm32flash::ERROR_CANNOT_OPEN_FILE;
+                break;
+            }
+
+            FlashJournal saved;
+            resuming = layout.isValid() && loadJournal(uart_num, saved) &&
+                       saved.image_crc == journal.image_crc && saved.image_size == image_size &&
+                       saved.product_id == journal.product_id && memcmp(saved.uid, journal.uid, DEVICE_UID_SIZE) == 0 &&
+                       saved.layout == layout && saved.erased_size >= image_size &&
+                       saved.next_offset > 0 && saved.next_offset < image_size;
+            if (resuming) {
+                journal = saved;
+                logI(TAG_STM_FLASH, "Resuming interrupted flash at offset %lu", (unsigned long)journal.next_offset);
+            }
+        }
+
+        // Nothing to erase or write if the target already holds the image (unless a flash of it was interrupted)
+        if (config.fingerprint != FINGERPRINT_NONE && !resuming) {
+            bool matches = false;
+            if (!info.supports(CMD_READ)) {
+                logW(TAG_STM_FLASH, "Bootloader does not support READ MEMORY, skipping fingerprint check");
+            } else {
+                status = checkFingerprint(source, uart_num, config, report, &matches);
+                if (status != stm32flash::SUCCESS) {
+                    logE(TAG_STM_FLASH, "Fingerprint read failed, aborting flash!");
+                    break;
+                }
+            }
+            if (matches) {
+                logI(TAG_STM_FLASH, "%s", "STM32 already up to date, nothing to flash");
+                status = stm32flash::ALREADY_UP_TO_DATE;
+                break;
+            }
+        }
+
+        if (isCancelled(uart_num)) {
+            status = stm32flash::ERROR_CANCELLED;
+            break;
+        }
+
+        status = writeImage(source, config, info, layout, report, journaling ? &journal : NULL, resuming);
+
+        // A resumed flash that fails may not have matched what the target holds: start over in this session,
+        // with a full erase and write (the journal was cleared if the write had completed, clear it anyway)
+        if (resuming && status != stm32flash::SUCCESS && status != stm32flash::ERROR_CANCELLED) {
+            logW(TAG_STM_FLASH, "%s", "Resumed flash failed, starting over with a full erase and write");
+            clearJournal(uart_num);
+            report->resumed_from = 0;
+            status = writeImage(source, config, info, layout, report, &journal, false);
+        }
+        if (status != stm32flash::SUCCESS) {
+            break;
+        }
         logI(TAG_STM_FLASH, "%s", "STM32 Flashed Successfully!!!");
     } while (0);
 
-    // Close file
-    if (flash_file != NULL) {
-        fclose(flash_file);
+    // Start the new firmware right away with GO, saving the reset cycle
+    endPhase(uart_num);
+    const int64_t exit_start = esp_timer_get_time();
+    bool started = false;
+    if ((status == stm32flash::SUCCESS || status == stm32flash::ALREADY_UP_TO_DATE) && config.exit_mode == EXIT_GO) {
+        if (!info.supports(CMD_GO)) {
+            logW(TAG_STM_FLASH, "Bootloader does not support GO, resetting instead");
+        } else {
+            started = (goSTM(boot0_pin, uart_num, config.isBoot0Shared(), FLASH_BASE_ADDRESS) == stm32flash::SUCCESS);
+        }
     }
-    
+
     // Disable flash mode and reboot STM32
-    setFlashMode(reset_pin, boot0_pin, uart_num, false);
+    if (!started) {
+        setFlashMode(reset_pin, boot0_pin, uart_num, false, config.reset_pulse_ms, config.reset_settle_ms);
+    }
+    report->exit_us = esp_timer_get_time() - exit_start;
+
+    return status;
+}
+
+FlashStatus flashImage(ImageSource &source, const FlashConfig& config, FlashReport* report)
+{
+    const uart_port_t uart_num = config.uart_num;
+    FlashReport local_report;
+    if (report == NULL) {
+        report = &local_report;
+    }
+    *report = FlashReport();
+
+    // A flash started by flashAsync already has its monitor, the others report to the callback of their config
+    FlashMonitor local_monitor;
+    const bool own_monitor = (monitor(uart_num) == NULL);
+    if (own_monitor) {
+        local_monitor.callback = config.progress_callback;
+        local_monitor.callback_arg = config.progress_arg;
+        setMonitor(uart_num, &local_monitor);
+    }
+    FlashMonitor *session_monitor = monitor(uart_num);
+    session_monitor->report = report;
+    session_monitor->phase_start = 0;
+    resetAckStats(uart_num);
+
+    const int64_t start = esp_timer_get_time();
+    const stm32flash::FlashStatus status = flashSession(source, config, report);
+    report->total_us = esp_timer_get_time() - start;
+
+    startPhase(uart_num, PHASE_DONE, 0);
+    session_monitor->report = NULL;
+    if (own_monitor) {
+        setMonitor(uart_num, NULL);
+    }
+
+    // Effective throughput and link statistics, cheap enough to be always collected
+    if (report->total_us > 0) {
+        report->bytes_per_second = (uint64_t)source.size() * 1000000 / report->total_us;
+    }
+    const AckStats &acks = ackStats(uart_num);
+    if (acks.count > 0) {
+        report->ack_count = acks.count;
+        report->ack_min_us = acks.min_us;
+        report->ack_avg_us = acks.total_us / acks.count;
+        report->ack_max_us = acks.max_us;
+    }
+    logI(TAG_STM_FLASH, "Flash took %lu ms (%lu B/s), ACK latency %lu/%lu/%lu us at %lu baud",
+         (unsigned long)(report->total_us / 1000), (unsigned long)report->bytes_per_second,
+         (unsigned long)report->ack_min_us, (unsigned long)report->ack_avg_us,
+         (unsigned long)report->ack_max_us, (unsigned long)report->baud_rate);
+    return status;
+}
+
+// Monitor of the flash running on each UART, NULL when idle
+static FlashMonitor *s_monitors[UART_NUM_MAX] = {};
+
+void setMonitor(uart_port_t uart_num, FlashMonitor *monitor)
+{
+    s_monitors[uart_num] = monitor;
+}
+
+FlashMonitor *monitor(uart_port_t uart_num)
+{
+    return s_monitors[uart_num];
+}
+
+void endPhase(uart_port_t uart_num)
+{
+    FlashMonitor *monitor = s_monitors[uart_num];
+    if (monitor == NULL || monitor->phase_start == 0) {
+        return;
+    }
+
+    const FlashPhase phase = monitor->progress.phase;
+    if (monitor->report != NULL && phase < PHASE_DONE) {
+        monitor->report->phase_us[phase] += esp_timer_get_time() - monitor->phase_start;
+    }
+    monitor->phase_start = 0;
+}
+
+void startPhase(uart_port_t uart_num, FlashPhase phase, uint32_t bytes_total)
+{
+    FlashMonitor *monitor = s_monitors[uart_num];
+    if (monitor == NULL) {
+        return;
+    }
+
+    endPhase(uart_num);
+    monitor->phase_start = esp_timer_get_time();
+    FlashProgress progress;
+    progress.phase = phase;
+    progress.bytes_total = bytes_total;
+    portENTER_CRITICAL(&monitor->lock);
+    monitor->progress = progress;
+    portEXIT_CRITICAL(&monitor->lock);
+    if (monitor->callback != NULL) {
+        monitor->callback(progress, monitor->callback_arg);
+    }
+}
+
+void addProgress(uart_port_t uart_num, uint32_t bytes)
+{
+    FlashMonitor *monitor = s_monitors[uart_num];
+    if (monitor == NULL) {
+        return;
+    }
+
+    // Only this task writes the progress, it can read it without the lock
+    FlashProgress progress = monitor->progress;
+    progress.bytes_done = MIN(progress.bytes_done + bytes, progress.bytes_total);
+    const int64_t elapsed = esp_timer_get_time() - monitor->phase_start;
+    progress.bytes_per_second = (elapsed > 0) ? (uint32_t)((uint64_t)progress.bytes_done * 1000000 / elapsed) : 0;
+    portENTER_CRITICAL(&monitor->lock);
+    monitor->progress = progress;
+    portEXIT_CRITICAL(&monitor->lock);
+    if (monitor->callback != NULL) {
+        monitor->callback(progress, monitor->callback_arg);
+    }
+}
+
+FlashProgress progressOf(FlashMonitor &monitor)
+{
+    portENTER_CRITICAL(&monitor.lock);
+    const FlashProgress progress = monitor.progress;
+    portEXIT_CRITICAL(&monitor.lock);
+    return progress;
+}
+
+bool isCancelled(uart_port_t uart_num)
+{
+    FlashMonitor *monitor = s_monitors[uart_num];
+    return monitor != NULL && monitor->cancelled;
+}
+
+static void asyncFlashTask(void *arg)
+{
+    AsyncJob *job = (AsyncJob *)arg;
+    const uart_port_t uart_num = job->config.uart_num;
+
+    setMonitor(uart_num, &job->monitor);
+    const stm32flash::FlashStatus status = (job->file_name[0] != '\0') ?
+        flashSTM(job->file_name, job->config, &job->report) :
+        flashSTM(job->image, job->config, &job->report);
+    setMonitor(uart_num, NULL);
+    logI(TAG_STM_FLASH, "UART%d: %s", uart_num, toString(status));
+
+    job->status = status;
+    job->finished = true;
+    xSemaphoreGive(job->done);
+    vTaskDelete(NULL);
+}
 
+FlashStatus startAsyncJob(AsyncJob *job, const AsyncOptions &options)
+{
+    job->monitor.callback = job->config.progress_callback;
+    job->monitor.callback_arg = job->config.progress_arg;
+
+    const BaseType_t core = (options.core < 0) ? tskNO_AFFINITY : options.core;
+    if (xTaskCreatePinnedToCore(asyncFlashTask, "stm_flash_async", options.stack_size, job,
+                                options.priority, NULL, core) != pdPASS) {
+        logE(TAG_STM_FLASH, "Failed to create flash task");
+        job->status = stm32flash::ERROR_UNKNOWN;
+        job->finished = true;
+        xSemaphoreGive(job->done);
+        return stm32flash::ERROR_UNKNOWN;
+    }
     return stm32flash::SUCCESS;
 }
 
-FlashStatus writeTask(FILE *flash_file, gpio_num_t reset_pin, uart_port_t uart_num)
+static void journalKey(uart_port_t uart_num, char *key, size_t size)
 {
-    logI(TAG_STM_FLASH, "%s", "Starting Write Task");
+    snprintf(key, size, "uart%d", (int)uart_num);
+}
+
+static bool openJournal(nvs_open_mode_t mode, nvs_handle_t *handle)
+{
+    // Initializing twice is harmless, the application may not use NVS itself
+    esp_err_t err = nvs_flash_init();
+    if (err == ESP_OK) {
+        err = nvs_open(JOURNAL_NAMESPACE, mode, handle);
+    }
+    if (err != ESP_OK && !(mode == NVS_READONLY && err == ESP_ERR_NVS_NOT_FOUND)) {
+        logW(TAG_STM_FLASH, "Cannot open flash journal (%s)", esp_err_to_name(err));
+    }
+    return err == ESP_OK;
+}
 
-    char loadAddress[4] = {0x08, 0x00, 0x00, 0x00};
-    char block[256] = {0};
-    int curr_block = 0, bytes_read = 0;
+bool loadJournal(uart_port_t uart_num, FlashJournal &journal)
+{
+    nvs_handle_t handle;
+    if (!openJournal(NVS_READONLY, &handle)) {
+        return false;
+    }
 
-    // Start at the beginning of the file
-    fseek(flash_file, 0, SEEK_SET);
+    char key[16];
+    journalKey(uart_num, key, sizeof(key));
+    size_t size = sizeof(journal);
+    esp_err_t err = nvs_get_blob(handle, key, &journal, &size);
+    nvs_close(handle);
 
-    // Setup STM32 to receive the .bin file
-    stm32flash::FlashStatus status = setupSTM(reset_pin, uart_num);
-    if (status != stm32flash::SUCCESS) {
-        return status;
+    return err == ESP_OK && size == sizeof(journal) && journal.version == JOURNAL_VERSION;
+}
+
+void saveJournal(uart_port_t uart_num, const FlashJournal &journal)
+{
+    nvs_handle_t handle;
+    if (!openJournal(NVS_READWRITE, &handle)) {
+        return;
     }
 
-    // Write the .bin file to the STM32
-    while ((bytes_read = fread(block, 1, 256, flash_file)) > 0)
+    char key[16];
+    journalKey(uart_num, key, sizeof(key));
+    if (nvs_set_blob(handle, key, &journal, sizeof(journal)) != ESP_OK || nvs_commit(handle) != ESP_OK) {
+        logW(TAG_STM_FLASH, "Failed to save flash journal");
+    }
+    nvs_close(handle);
+}
+
+void clearJournal(uart_port_t uart_num)
+{
+    nvs_handle_t handle;
+    if (!openJournal(NVS_READWRITE, &handle)) {
+        return;
+    }
+
+    char key[16];
+    journalKey(uart_num, key, sizeof(key));
+    nvs_erase_key(handle, key);
+    nvs_commit(handle);
+    nvs_close(handle);
+}
+
+FlashStatus imageCrc(ImageSource &source, uint32_t *crc)
+{
+    char scratch[BLOCK_SIZE];
+    *crc = 0;
+    for (uint32_t offset = 0; offset < source.size(); offset += BLOCK_SIZE) {
+        const char *block = source.block(offset, scratch);
+        if (block == NULL) {
+            return stm32flash::ERROR_CANNOT_OPEN_FILE;
+        }
+        *crc = esp_rom_crc32_le(*crc, (const uint8_t *)block, BLOCK_SIZE);
+    }
+    return stm32flash::SUCCESS;
+}
+
+esp_err_t writeBlock(uint32_t address, const char *data, uint8_t checksum, int retries, uart_port_t uart_num, FlashReport *report)
+{
+    for (int attempt = 0; attempt <= retries; attempt++)
+    {
+        if (attempt > 0)
+        {
+            if (report != NULL)
+            {
+                report->retries++;
+                report->pages_retried += (attempt == 1);
+            }
+            logW(TAG_STM_FLASH, "Retrying write at 0x%08lX (%d/%d)", (unsigned long)address, attempt, retries);
+            if (resyncSTM(uart_num) != 1)
+            {
+                continue;
+            }
+
+            // Only the ACK may have been lost: flash cannot be programmed twice without an erase
+            char target[BLOCK_SIZE];
+            if (readPage(address, target, uart_num) == ESP_OK && blocksEqual(data, target, BLOCK_SIZE))
+            {
+                return ESP_OK;
+            }
+        }
+
+        if (flashPage(address, data, checksum, uart_num) == ESP_OK)
+        {
+            return ESP_OK;
+        }
+    }
+    return ESP_FAIL;
+}
+
+esp_err_t readBlock(uint32_t address, char *data, int retries, uart_port_t uart_num, FlashReport *report)
+{
+    for (int attempt = 0; attempt <= retries; attempt++)
+    {
+        if (attempt > 0)
+        {
+            if (report != NULL)
+            {
+                report->retries++;
+                report->pages_retried += (attempt == 1);
+            }
+            logW(TAG_STM_FLASH, "Retrying read at 0x%08lX (%d/%d)", (unsigned long)address, attempt, retries);
+            if (resyncSTM(uart_num) != 1)
+            {
+                continue;
+            }
+        }
+
+        if (readPage(address, data, uart_num) == ESP_OK)
+        {
+            return ESP_OK;
+        }
+    }
+    return ESP_FAIL;
+}
+
+FlashStatus checkFingerprint(ImageSource &source, uart_port_t uart_num, const FlashConfig &config, FlashReport *report, bool *matches)
+{
+    *matches = false;
+
+    // Blocks making up the fingerprint, as offsets in the image
+    uint32_t offsets[2 * MAX_IMAGE_SEGMENTS];
+    size_t count = 0;
+    if (config.fingerprint == FINGERPRINT_BLOCK) {
+        if (config.fingerprint_address < FLASH_BASE_ADDRESS || config.fingerprint_address - FLASH_BASE_ADDRESS >= source.size()) {
+            logW(TAG_STM_FLASH, "Fingerprint address 0x%08lX lies outside the image, flashing", (unsigned long)config.fingerprint_address);
+            return stm32flash::SUCCESS;
+        }
+        offsets[count++] = (config.fingerprint_address - FLASH_BASE_ADDRESS) & ~(BLOCK_SIZE - 1);
+    } else {
+        for (size_t i = 0; i < source.segmentCount() && i < MAX_IMAGE_SEGMENTS; i++) {
+            const ImageSegment range = source.segment(i);
+            const uint32_t first = range.offset & ~(BLOCK_SIZE - 1);
+            const uint32_t last = (range.offset + range.length - 1) & ~(BLOCK_SIZE - 1);
+            if (count == 0 || offsets[count - 1] != first) {
+                offsets[count++] = first;
+            }
+            if (last != first) {
+                offsets[count++] = last;
+            }
+        }
+    }
+
+    // CRC32 of the same blocks in the image and in the target
+    char scratch[BLOCK_SIZE];
+    char target[BLOCK_SIZE];
+    uint32_t image_crc = 0, target_crc = 0;
+    for (size_t i = 0; i < count; i++) {
+        const char *block = source.block(offsets[i], scratch);
+        if (block == NULL) {
+            return stm32flash::ERROR_CANNOT_OPEN_FILE;
+        }
+        image_crc = esp_rom_crc32_le(image_crc, (const uint8_t *)block, BLOCK_SIZE);
+
+        if (readBlock(FLASH_BASE_ADDRESS + offsets[i], target, config.retries, uart_num, report) == ESP_FAIL) {
+            return stm32flash::ERROR_READ_FAILED;
+        }
+        target_crc = esp_rom_crc32_le(target_crc, (const uint8_t *)target, BLOCK_SIZE);
+    }
+
+    logI(TAG_STM_FLASH, "Fingerprint: image 0x%08lX, target 0x%08lX", (unsigned long)image_crc, (unsigned long)target_crc);
+    *matches = (count > 0 && image_crc == target_crc);
+    return stm32flash::SUCCESS;
+}
+
+bool planErase(ErasePlan &plan, ImageSource &source, const FlashLayout &layout)
+{
+    plan.count = 0;
+    plan.layout = layout;
+    for (size_t i = 0; i < source.segmentCount(); i++)
     {
-        curr_block++;
-        logI(TAG_STM_FLASH, "Writing block: %d", curr_block);
-        // ESP_LOG_BUFFER_HEXDUMP("Block:  ", block, sizeof(block), ESP_LOG_DEBUG);
+        const ImageSegment range = source.segment(i);
+        const int first_page = layout.pageOf(range.offset);
+        const int last_page = layout.pageOf(range.offset + range.length - 1);
+        if (range.length == 0 || first_page < 0 || last_page < 0)
+        {
+            logW(TAG_STM_FLASH, "Segment at offset %lu lies outside the flash layout", (unsigned long)range.offset);
+            return false;
+        }
 
-        esp_err_t ret = flashPage(loadAddress, block, uart_num);
-        if (ret == ESP_FAIL)
+        // Segments are sorted, only the first page may be shared with the previous one
+        for (int page = first_page; page <= last_page; page++)
         {
-            return stm32flash::ERROR_WRITE_FAILED;
+            if ((plan.count > 0 && plan.pages[plan.count - 1] == page) || !layout.isPage(page))
+            {
+                continue;
+            }
+            if (!plan.add((uint16_t)page))
+            {
+                logW(TAG_STM_FLASH, "Image spans too many pages for a page erase");
+                return false;
+            }
         }
+    }
+    return true;
+}
 
-        incrementLoadAddress(loadAddress);
-        printf("\n");
+bool pageHoldsData(ImageSource &source, const FlashLayout &layout, int page)
+{
+    if (page < 0)
+    {
+        return false;
+    }
+    const uint32_t end = layout.pageEnd(page);
+    for (uint32_t offset = layout.pageStart(page); offset < end; offset += BLOCK_SIZE)
+    {
+        if (source.covers(offset))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+FlashStatus diffTask(ImageSource &source, uart_port_t uart_num, ErasePlan &plan, int retries, FlashReport *report)
+{
+    logI(TAG_STM_FLASH, "%s", "Starting Compare Task");
+
+    char scratch[BLOCK_SIZE];
+    char target[BLOCK_SIZE];
+    uint32_t offset = 0;
+    int dirty_page = -1;
+
+    startPhase(uart_num, PHASE_COMPARE, source.size());
+
+    // Pages are read in order, so the first differing block marks its whole page as dirty
+    for (; offset < source.size(); offset += BLOCK_SIZE)
+    {
+        if (isCancelled(uart_num))
+        {
+            return stm32flash::ERROR_CANCELLED;
+        }
+
+        const int page = plan.layout.pageOf(offset);
+        if (page != dirty_page)
+        {
+            // Blocks in the gaps of a segmented image are not compared, they keep their contents unless the page is erased
+            bool equal = true;
+            if (source.covers(offset))
+            {
+                const char *block = source.block(offset, scratch);
+                if (block == NULL)
+                {
+                    return stm32flash::ERROR_CANNOT_OPEN_FILE;
+                }
+                if (readBlock(FLASH_BASE_ADDRESS + offset, target, retries, uart_num, report) == ESP_FAIL)
+                {
+                    return stm32flash::ERROR_READ_FAILED;
+                }
+                equal = blocksEqual(block, target, BLOCK_SIZE);
+            }
+
+            if (!equal)
+            {
+                dirty_page = page;
+            }
+            else if (plan.layout.isPageEnd(offset + BLOCK_SIZE))
+            {
+                // Last block of the page and still identical
+                logD(TAG_STM_FLASH, "Page %d unchanged", page);
+                plan.remove(page);
+            }
+        }
+        addProgress(uart_num, MIN((uint32_t)BLOCK_SIZE, source.size() - offset));
+    }
 
-        memset(block, 0xff, 256);
+    // The file may end in the middle of a page, which is unchanged if no block differed
+    const int last_page = plan.layout.pageOf(offset - 1);
+    if (!plan.layout.isPageEnd(offset) && last_page != dirty_page)
+    {
+        plan.remove(last_page);
     }
 
-    logI(TAG_STM_FLASH, "%s", "Write Task Completed");
+    logI(TAG_STM_FLASH, "Compare Task Completed, %d pages differ", plan.count);
     return stm32flash::SUCCESS;
 }
 
-FlashStatus readTask(FILE *flash_file, uart_port_t uart_num)
+FlashStatus writeTask(ImageSource &source, uart_port_t uart_num, const ErasePlan *plan, int retries, FlashReport *report,
+                      FlashJournal *journal, uint32_t start_offset)
+{
+    logI(TAG_STM_FLASH, "%s", "Starting Write Task");
+    startPhase(uart_num, PHASE_WRITE, source.size());
+
+    // The next pages are read from the image while the current one is on the wire
+    PagePipeline pipeline;
+    if (startPipeline(pipeline, source) != stm32flash::SUCCESS) {
+        return stm32flash::ERROR_UNKNOWN;
+    }
+
+    // Write the .bin file to the STM32
+    stm32flash::FlashStatus status = stm32flash::SUCCESS;
+    uint32_t saved_offset = (journal != NULL) ? journal->next_offset : 0;
+    PipelinePage *page;
+    while ((page = nextPage(pipeline))->length > 0)
+    {
+        if (isCancelled(uart_num))
+        {
+            status = stm32flash::ERROR_CANCELLED;
+            break;
+        }
+        const uint32_t address = FLASH_BASE_ADDRESS + page->offset;
+
+        if (!source.covers(page->offset))
+        {
+            // Gap between the segments of the image
+        }
+        else if (page->offset < start_offset || (plan != NULL && !plan->covers(page->offset)))
+        {
+            report->pages_skipped++;
+        }
+        else if (page->blank)
+        {
+            // The page was just erased, so it already reads 0xFF
+            report->blank_bytes_skipped += page->length;
+        }
+        else
+        {
+            logD(TAG_STM_FLASH, "Writing block at 0x%08lX", (unsigned long)address);
+            // ESP_LOG_BUFFER_HEXDUMP("Block:  ", page->data, BLOCK_SIZE, ESP_LOG_DEBUG);
+
+            esp_err_t ret = writeBlock(address, page->data, page->checksum, retries, uart_num, report);
+            if (ret == ESP_FAIL)
+            {
+                status = stm32flash::ERROR_WRITE_FAILED;
+                break;
+            }
+            report->pages_written++;
+            report->bytes_written += page->length;
+        }
+
+        // Track every completed page, a resumed session restarts from the next one. Each save wears the
+        // NVS flash, so the journal is only saved at the first page end every JOURNAL_INTERVAL bytes,
+        // and when the write stops early: a reset of the ESP32 itself redoes at most that much.
+        const uint32_t end = page->offset + BLOCK_SIZE;
+        if (journal != NULL && end > start_offset && journal->layout.isPageEnd(end))
+        {
+            journal->next_offset = end;
+            if (end - saved_offset >= JOURNAL_INTERVAL)
+            {
+                saveJournal(uart_num, *journal);
+                saved_offset = end;
+            }
+        }
+
+        addProgress(uart_num, page->length);
+        releasePage(pipeline, page);
+    }
+    if (status == stm32flash::SUCCESS && page->length < 0)
+    {
+        status = stm32flash::ERROR_CANNOT_OPEN_FILE;
+    }
+    stopPipeline(pipeline);
+
+    if (status != stm32flash::SUCCESS && journal != NULL && journal->next_offset != saved_offset)
+    {
+        saveJournal(uart_num, *journal);
+    }
+
+    if (status == stm32flash::SUCCESS) {
+        logI(TAG_STM_FLASH, "%s", "Write Task Completed");
+    }
+    return status;
+}
+
+FlashStatus readTask(ImageSource &source, uart_port_t uart_num, const ErasePlan *plan, VerifyMode verify_mode, int retries, FlashReport *report)
 {
     logI(TAG_STM_FLASH, "%s", "Starting Read & Verification Task");
-    char readAddress[4] = {0x08, 0x00, 0x00, 0x00};
 
-    char block[257] = {0};
-    int curr_block = 0, bytes_read = 0;
+    char target[BLOCK_SIZE];
+    startPhase(uart_num, PHASE_VERIFY, source.size());
+
+    // Running CRC32 of the whole image, and of the expected & actual contents of the blocks read back
+    uint32_t image_crc = 0, expected_crc = 0, actual_crc = 0;
 
-    // Start at the beginning of the file
-    fseek(flash_file, 0, SEEK_SET);
+    PagePipeline pipeline;
+    if (startPipeline(pipeline, source) != stm32flash::SUCCESS) {
+        return stm32flash::ERROR_UNKNOWN;
+    }
 
     // Read the .bin file from the STM32
-    while ((bytes_read = fread(block, 1, 256, flash_file)) > 0)
+    stm32flash::FlashStatus status = stm32flash::SUCCESS;
+    PipelinePage *page;
+    while ((page = nextPage(pipeline))->length > 0)
     {
-        curr_block++;
-        logI(TAG_STM_FLASH, "Reading block: %d", curr_block);
-        // ESP_LOG_BUFFER_HEXDUMP("Block:  ", block, sizeof(block), ESP_LOG_DEBUG);
+        if (isCancelled(uart_num))
+        {
+            status = stm32flash::ERROR_CANCELLED;
+            break;
+        }
+        const uint32_t address = FLASH_BASE_ADDRESS + page->offset;
+        const char *block = page->data;
+        image_crc = esp_rom_crc32_le(image_crc, (const uint8_t *)block, BLOCK_SIZE);
 
-        esp_err_t ret = readPage(readAddress, block, uart_num);
-        if (ret == ESP_FAIL)
+        // Blank blocks were skipped by writeTask and are left as erased
+        if ((plan == NULL || plan->covers(page->offset)) && source.covers(page->offset) && !page->blank)
         {
-            return stm32flash::ERROR_READ_FAILED;
+            logD(TAG_STM_FLASH, "Reading block at 0x%08lX", (unsigned long)address);
+            // ESP_LOG_BUFFER_HEXDUMP("Block:  ", block, BLOCK_SIZE, ESP_LOG_DEBUG);
+
+            esp_err_t ret = readBlock(address, target, retries, uart_num, report);
+            if (ret == ESP_FAIL)
+            {
+                status = stm32flash::ERROR_READ_FAILED;
+                break;
+            }
+
+            if (verify_mode == VERIFY_FULL)
+            {
+                if (!blocksEqual(block, target, BLOCK_SIZE))
+                {
+                    logE(TAG_STM_FLASH, "Verification failed at 0x%08lX", (unsigned long)address);
+                    status = stm32flash::ERROR_VERIFY_FAILED;
+                    break;
+                }
+            }
+            else
+            {
+                expected_crc = esp_rom_crc32_le(expected_crc, (const uint8_t *)block, BLOCK_SIZE);
+                actual_crc = esp_rom_crc32_le(actual_crc, (const uint8_t *)target, BLOCK_SIZE);
+            }
         }
 
-        incrementLoadAddress(readAddress);
-        printf("\n");
+        addProgress(uart_num, page->length);
+        releasePage(pipeline, page);
+    }
+    if (status == stm32flash::SUCCESS && page->length < 0)
+    {
+        status = stm32flash::ERROR_CANNOT_OPEN_FILE;
+    }
+    stopPipeline(pipeline);
 
-        memset(block, 0xff, 256);
+    if (status != stm32flash::SUCCESS)
+    {
+        return status;
+    }
+
+    report->image_crc = image_crc;
+    logI(TAG_STM_FLASH, "Image CRC32: 0x%08lX", (unsigned long)image_crc);
+
+    if (verify_mode == VERIFY_CRC && expected_crc != actual_crc)
+    {
+        logE(TAG_STM_FLASH, "Verification failed, CRC32 0x%08lX (expected 0x%08lX)",
+             (unsigned long)actual_crc, (unsigned long)expected_crc);
+        return stm32flash::ERROR_VERIFY_FAILED;
     }
 
     logI(TAG_STM_FLASH, "%s", "Read & Verification Task Completed");
     return stm32flash::SUCCESS;
 }
 
+static void fillPage(PagePipeline &pipeline, PipelinePage &page)
+{
+    page.offset = pipeline.next_offset;
+    page.length = 0;
+    page.data = NULL;
+
+    // Blocks of a shared prepared image come with their checksum
+    const PreparedBlock *prepared = pipeline.source->prepared(page.offset);
+    if (prepared != NULL)
+    {
+        page.data = prepared->data;
+        page.length = MIN((uint32_t)BLOCK_SIZE, pipeline.source->size() - page.offset);
+        page.blank = prepared->blank;
+        page.checksum = prepared->checksum;
+        pipeline.next_offset += BLOCK_SIZE;
+        return;
+    }
+
+    if (page.offset < pipeline.source->size())
+    {
+        page.data = pipeline.source->block(page.offset, page.buffer);
+    }
+
+    if (page.data == NULL && page.offset < pipeline.source->size())
+    {
+        page.length = -1;
+    }
+    else if (page.data != NULL)
+    {
+        page.length = MIN((uint32_t)BLOCK_SIZE, pipeline.source->size() - page.offset);
+        page.blank = isBlockBlank(page.data, BLOCK_SIZE);
+        page.checksum = xorChecksum(page.data, BLOCK_SIZE, (uint8_t)(BLOCK_SIZE - 1));
+    }
+    pipeline.next_offset += BLOCK_SIZE;
+}
+
+static void pipelineReaderTask(void *arg)
+{
+    PagePipeline *pipeline = (PagePipeline *)arg;
+    int index;
+
+    while (xQueueReceive(pipeline->free_pages, &index, portMAX_DELAY) == pdTRUE && !pipeline->stop)
+    {
+        PipelinePage &page = pipeline->pages[index];
+        fillPage(*pipeline, page);
+
+        xQueueSend(pipeline->ready_pages, &index, portMAX_DELAY);
+        if (page.length <= 0)
+        {
+            break;
+        }
+    }
+
+    xSemaphoreGive(pipeline->done);
+    vTaskDelete(NULL);
+}
+
+FlashStatus startPipeline(PagePipeline &pipeline, ImageSource &source)
+{
+    pipeline.source = &source;
+    pipeline.next_offset = 0;
+    pipeline.stop = false;
+    pipeline.free_pages = NULL;
+    pipeline.ready_pages = NULL;
+    pipeline.done = NULL;
+
+    // A mapped image is already in memory, pages are prepared inline with no reader task
+    if (source.isMapped())
+    {
+        return stm32flash::SUCCESS;
+    }
+
+    pipeline.free_pages = xQueueCreate(PIPELINE_DEPTH, sizeof(int));
+    pipeline.ready_pages = xQueueCreate(PIPELINE_DEPTH, sizeof(int));
+    pipeline.done = xSemaphoreCreateBinary();
+
+    if (pipeline.free_pages == NULL || pipeline.ready_pages == NULL || pipeline.done == NULL)
+    {
+        logE(TAG_STM_FLASH, "Failed to create pipeline queues");
+        if (pipeline.done != NULL)
+        {
+            // No reader task to wait for
+            xSemaphoreGive(pipeline.done);
+        }
+        stopPipeline(pipeline);
+        return stm32flash::ERROR_UNKNOWN;
+    }
+
+    for (int i = 0; i < PIPELINE_DEPTH; i++)
+    {
+        xQueueSend(pipeline.free_pages, &i, 0);
+    }
+
+    // Same priority as the caller, so neither side starves the other
+    if (xTaskCreate(pipelineReaderTask, "stm_flash_rd", PIPELINE_STACK_SIZE, &pipeline,
+                    uxTaskPriorityGet(NULL), NULL) != pdPASS)
+    {
+        logE(TAG_STM_FLASH, "Failed to create pipeline reader task");
+        xSemaphoreGive(pipeline.done);
+        stopPipeline(pipeline);
+        return stm32flash::ERROR_UNKNOWN;
+    }
+    return stm32flash::SUCCESS;
+}
+
+PipelinePage *nextPage(PagePipeline &pipeline)
+{
+    if (pipeline.ready_pages == NULL)
+    {
+        fillPage(pipeline, pipeline.pages[0]);
+        return &pipeline.pages[0];
+    }
+
+    int index;
+    xQueueReceive(pipeline.ready_pages, &index, portMAX_DELAY);
+    return &pipeline.pages[index];
+}
+
+void releasePage(PagePipeline &pipeline, PipelinePage *page)
+{
+    if (pipeline.free_pages == NULL)
+    {
+        return;
+    }
+
+    int index = page - pipeline.pages;
+    xQueueSend(pipeline.free_pages, &index, portMAX_DELAY);
+}
+
+void stopPipeline(PagePipeline &pipeline)
+{
+    if (pipeline.done != NULL)
+    {
+        // Wake the reader if it waits for a free buffer, it exits on the stop flag
+        pipeline.stop = true;
+        int index = 0;
+        if (pipeline.free_pages != NULL)
+        {
+            xQueueSend(pipeline.free_pages, &index, 0);
+        }
+        xSemaphoreTake(pipeline.done, portMAX_DELAY);
+        vSemaphoreDelete(pipeline.done);
+        pipeline.done = NULL;
+    }
+    if (pipeline.free_pages != NULL)
+    {
+        vQueueDelete(pipeline.free_pages);
+        pipeline.free_pages = NULL;
+    }
+    if (pipeline.ready_pages != NULL)
+    {
+        vQueueDelete(pipeline.ready_pages);
+        pipeline.ready_pages = NULL;
+    }
+}
+
 } // namespace internal
 } // namespace stm32flash
\ No newline at end of file
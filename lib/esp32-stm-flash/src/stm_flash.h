@@ -2,49 +2,343 @@
 #define _STM_FLASH_H
 
 #include "stm_pro_mode.h"
+#include "stm_image.h"
 
 namespace stm32flash {
 namespace internal {
 
+#define PIPELINE_DEPTH 4 // Page buffers shared by the image reader task and the UART transfers
+#define PIPELINE_STACK_SIZE 4096
+#define FLASH_TARGET_STACK_SIZE 8192 // Worker task of a multi-target flash (runs a whole flashImage)
+#define MAX_FLASH_TARGETS UART_NUM_MAX // One UART per target
+
+//Page buffer of the read-ahead pipeline
+struct PipelinePage {
+    uint32_t offset;  // From the start of the image
+    int length;       // Bytes of image data, 0 marks the end of the image, -1 a read error
+    bool blank;       // All 0xFF after padding
+    uint8_t checksum; // XOR checksum of the WRITE MEMORY frame
+    const char *data; // BLOCK_SIZE bytes, in buffer or directly in a mapped image
+    char buffer[BLOCK_SIZE];
+};
+
+#define JOURNAL_NAMESPACE "stm32flash"
+#define JOURNAL_VERSION 3
+#define JOURNAL_INTERVAL (4 * 1024) // Image bytes written between two journal saves, at the next page end
+
+//Progress of an interrupted flash, kept in NVS (one per UART)
+struct FlashJournal {
+    uint32_t version;
+    uint32_t image_crc;   // CRC32 of the image being flashed
+    uint32_t image_size;
+    uint16_t product_id;  // Target being flashed: another board on the same UART must not be resumed
+    uint8_t uid[DEVICE_UID_SIZE]; // Unique ID of the target, all 0 if it has none or cannot be read
+    FlashLayout layout;   // Pages the offsets refer to
+    uint32_t erased_size; // Flash erased from the start of flash memory when the write began
+    uint32_t next_offset; // End of the last page whose blocks were all acknowledged
+};
+
+//Progress reporting and cancellation of the flash running on a UART
+struct FlashMonitor {
+    ProgressCallback callback = NULL;
+    void *callback_arg = NULL;
+    volatile bool cancelled = false;
+    FlashProgress progress;     // Written by the flash task under lock, read by others with progressOf()
+    portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+    int64_t phase_start = 0; // us, 0 outside of a phase
+    FlashReport *report = NULL; // Phase timings to fill, set by flashImage
+};
+
+//Flash running in its own task (see flashAsync)
+struct AsyncJob {
+    FlashConfig config;
+    char file_name[FILE_PATH_MAX] = {0};      // Empty for a partition or memory image
+    char partition_label[FILE_PATH_MAX] = {0};
+    FlashImage image;
+    FlashMonitor monitor;
+    FlashReport report;
+    volatile FlashStatus status = stm32flash::ERROR_UNKNOWN;
+    volatile bool finished = false;
+    SemaphoreHandle_t done = NULL; // Given when finished
+};
+
+//Read-ahead pipeline: a reader task fills page buffers from the image while the caller drives the UART
+struct PagePipeline {
+    ImageSource *source;
+    uint32_t next_offset;
+    PipelinePage pages[PIPELINE_DEPTH];
+    QueueHandle_t free_pages;
+    QueueHandle_t ready_pages;
+    SemaphoreHandle_t done;
+    volatile bool stop;
+};
+
+/**
+ * @brief Start the reader task of a pipeline, from the beginning of the image
+ * 
+ * Mapped images need no read-ahead: their pages are prepared inline by nextPage()
+ * 
+ * @return SUCCESS, or ERROR_UNKNOWN if the task or its queues cannot be created
+ */
+FlashStatus startPipeline(PagePipeline &pipeline, ImageSource &source);
+
+/**
+ * @brief Wait for the next page of the image (length 0 at the end of the image)
+ */
+PipelinePage *nextPage(PagePipeline &pipeline);
+
+/**
+ * @brief Hand a page buffer back to the reader task once it has been sent
+ */
+void releasePage(PagePipeline &pipeline, PipelinePage *page);
+
+/**
+ * @brief Stop the reader task (if still running) and free the pipeline resources
+ */
+void stopPipeline(PagePipeline &pipeline);
+
+/**
+ * @brief Set the monitor of the flash running on a UART (NULL for none), it must outlive the flash
+ */
+void setMonitor(uart_port_t uart_num, FlashMonitor *monitor);
+FlashMonitor *monitor(uart_port_t uart_num);
+
+/**
+ * @brief Start a new phase of the flash running on a UART, and report it
+ */
+void startPhase(uart_port_t uart_num, FlashPhase phase, uint32_t bytes_total);
+
+/**
+ * @brief Get a consistent copy of the progress of a monitor, from any task
+ */
+FlashProgress progressOf(FlashMonitor &monitor);
+
+/**
+ * @brief End the current phase of the flash running on a UART, adding its time to the report
+ */
+void endPhase(uart_port_t uart_num);
+
+/**
+ * @brief Add processed bytes to the current phase, and report the progress
+ */
+void addProgress(uart_port_t uart_num, uint32_t bytes);
+
+/**
+ * @brief Check if the flash running on a UART has been asked to stop
+ */
+bool isCancelled(uart_port_t uart_num);
+
+/**
+ * @brief Run a flash job in a task of its own, the job is marked finished when it ends
+ * 
+ * @return SUCCESS, or ERROR_UNKNOWN if the task cannot be created (the job is then finished)
+ */
+FlashStatus startAsyncJob(AsyncJob *job, const AsyncOptions &options);
+
+/**
+ * @brief Load the progress journal of a UART from NVS
+ * 
+ * @return true if a journal was found
+ */
+bool loadJournal(uart_port_t uart_num, FlashJournal &journal);
+
+/**
+ * @brief Save the progress journal of a UART to NVS
+ */
+void saveJournal(uart_port_t uart_num, const FlashJournal &journal);
+
+/**
+ * @brief Remove the progress journal of a UART, once its image is fully flashed
+ */
+void clearJournal(uart_port_t uart_num);
+
+/**
+ * @brief Compute the CRC32 of a whole image, with the last block padded with 0xFF (as in FlashReport::image_crc)
+ */
+FlashStatus imageCrc(ImageSource &source, uint32_t *crc);
+
+/**
+ * @brief Write a block, recovering from a failed command (resync, then retry)
+ * 
+ * Before a retry the block is read back: if the previous write went through and only its ACK
+ * was lost, the block is not written twice
+ * 
+ * @param retries Maximum number of retries
+ * @param report Retry statistics to update, may be NULL
+ *   
+ * @return ESP_OK - success, ESP_FAIL - failed
+ */
+esp_err_t writeBlock(uint32_t address, const char *data, uint8_t checksum, int retries, uart_port_t uart_num, FlashReport *report);
+
+/**
+ * @brief Read a block, recovering from a failed command (resync, then retry)
+ * 
+ * @param retries Maximum number of retries
+ * @param report Retry statistics to update, may be NULL
+ *   
+ * @return ESP_OK - success, ESP_FAIL - failed
+ */
+esp_err_t readBlock(uint32_t address, char *data, int retries, uart_port_t uart_num, FlashReport *report);
+
+/**
+ * @brief Build an erase plan covering the pages of every segment of an image
+ * 
+ * Pages only partly covered by a segment are erased as a whole, the gaps
+ * between segments that span whole pages are left untouched
+ * 
+ * @return false if a segment lies outside the layout or the image spans too many pages
+ */
+bool planErase(ErasePlan &plan, ImageSource &source, const FlashLayout &layout);
+
+/**
+ * @brief Check if a page holds any data of an image (and not only a gap between its segments)
+ */
+bool pageHoldsData(ImageSource &source, const FlashLayout &layout, int page);
+
+/**
+ * @brief Compare the fingerprint of the image with the flash memory of STM32Fxx
+ * 
+ * Only reads the blocks selected by config.fingerprint: the block holding
+ * config.fingerprint_address, or the first and last blocks of every segment
+ * 
+ * @param source Image to compare against
+ * @param matches Set if the target already holds the image
+ *   
+ * @return SUCCESS, or the read error
+ */
+FlashStatus checkFingerprint(ImageSource &source, uart_port_t uart_num, const FlashConfig &config, FlashReport *report, bool *matches);
+
+/**
+ * @brief Compare the flash memory of STM32Fxx with the image, page-by-page
+ * 
+ * Every page of the plan is read back block-by-block, pages whose
+ * contents already match the image are removed from the plan
+ * 
+ * @param source Image to compare against
+ * @param plan Pages covered by the image, reduced to the pages that differ
+ * @param retries Retries of a failed block read
+ * @param report Session statistics to update
+ *   
+ * @return ESP_OK - success, ESP_FAIL - failed
+ */
+FlashStatus diffTask(ImageSource &source, uart_port_t uart_num, ErasePlan &plan, int retries, FlashReport *report);
+
 /**
  * @brief Write the code into the flash memory of STM32Fxx
  * 
- * The data from the .bin file is written into the flash memory 
+ * The data from the image is written into the flash memory 
  * of the client, block-by-block 
  * 
- * @param flash_file File pointer of the .bin file to be flashed
+ * The STM32 must already be set up and erased (see setupSTM)
+ * 
+ * @param source Image to be flashed
+ * @param plan Only write the blocks lying in these pages, or NULL for all blocks
+ * @param retries Retries of a failed block write
+ * @param report Session statistics to update
+ * @param journal Progress journal, updated in NVS at the end of every page (NULL for none)
+ * @param start_offset Skip the blocks before this offset, already written by an earlier session
  *   
  * @return ESP_OK - success, ESP_FAIL - failed
  */
-FlashStatus writeTask(FILE *flash_file, gpio_num_t reset_pin, uart_port_t uart_num);
+FlashStatus writeTask(ImageSource &source, uart_port_t uart_num, const ErasePlan *plan, int retries, FlashReport *report,
+                      FlashJournal *journal = NULL, uint32_t start_offset = 0);
 
 /**
  * @brief Read the flash memory of the STM32Fxx, for verification
  * 
  * It reads the flash memory of the STM32 block-by-block and 
- * checks it with the data from the file (with pointer passed)
+ * checks it with the data from the image
  * 
- * @param flash_file File pointer of the .bin file to be verified against
+ * @param source Image to be verified against
+ * @param plan Only read the blocks lying in these pages, or NULL for all blocks
+ * @param verify_mode Compare each block (VERIFY_FULL) or a CRC32 of all read blocks (VERIFY_CRC)
+ * @param retries Retries of a failed block read
+ * @param report Session statistics to update (image CRC)
  *   
  * @return ESP_OK - success, ESP_FAIL - failed
  */
-FlashStatus readTask(FILE *flash_file, uart_port_t uart_num);
+FlashStatus readTask(ImageSource &source, uart_port_t uart_num, const ErasePlan *plan, VerifyMode verify_mode, int retries, FlashReport *report);
+
+/**
+ * @brief Mount SPIFFS and open an image file
+ * 
+ * @param file_name name of the image in SPIFFS
+ * @param file Open file, to be closed by the caller
+ * @param size Size of the file in bytes
+ *   
+ * @return SUCCESS, or the SPIFFS / file error
+ */
+FlashStatus openImageFile(const char *file_name, FILE **file, uint32_t *size);
 
 /**
  * @brief Flash the .bin file passed, to STM32Fxx, with read verification
  * 
  * @param file_name name of the .bin to be flashed
+ * @param config Flasher configuration (pins, UART, baud rate)
+ * @param report Session statistics, may be NULL
+ *   
+ * @return ESP_OK - success, ESP_FAIL - failed
+ */
+FlashStatus flashSTM(const char* filename, const FlashConfig& config, FlashReport* report);
+
+/**
+ * @brief Flash an image from a data partition or from memory, to STM32Fxx, with read verification
+ * 
+ * @param image Image descriptor
+ * @param config Flasher configuration (pins, UART, baud rate)
+ * @param report Session statistics, may be NULL
+ *   
+ * @return ESP_OK - success, ESP_FAIL - failed
+ */
+FlashStatus flashSTM(const FlashImage& image, const FlashConfig& config, FlashReport* report);
+
+/**
+ * @brief Flash several STM32Fxx in parallel, one worker task per target
+ * 
+ * The source is read (and decompressed) only once into a PreparedImageSource,
+ * whose blocks and checksums are then shared read-only by all the workers
+ * 
+ * @param source Raw or compressed image to be flashed
+ * @param targets Targets, each on its own UART, their status and report are filled
+ * @param count Number of targets (up to MAX_FLASH_TARGETS)
+ *   
+ * @return SUCCESS if all targets were flashed (ALREADY_UP_TO_DATE if none needed it), the status of the first failing target otherwise
+ */
+FlashStatus flashTargets(ImageSource &source, FlashTarget *targets, size_t count);
+
+/**
+ * @brief Flash several STM32Fxx in parallel, with a .bin file read only once
+ */
+FlashStatus flashTargets(const char *file_name, FlashTarget *targets, size_t count);
+
+/**
+ * @brief Flash several STM32Fxx in parallel, with an image from a data partition or from memory
+ */
+FlashStatus flashTargets(const FlashImage& image, FlashTarget *targets, size_t count);
+
+/**
+ * @brief Flash an image source to STM32Fxx, decompressing it first if it is a compressed image
+ * 
+ * @param source Raw or compressed image to be flashed
+ * @param config Flasher configuration (pins, UART, baud rate)
+ * @param report Session statistics, may be NULL
+ *   
+ * @return ESP_OK - success, ESP_FAIL - failed
+ */
+FlashStatus flashAnyImage(ImageSource &source, const FlashConfig& config, FlashReport* report);
+
+/**
+ * @brief Flash an image source to STM32Fxx: enter flash mode, erase, write, verify and exit
+ * 
+ * The report is reset, then filled with the counters, phase timings and ACK latencies of the session
+ * 
+ * @param source Image to be flashed
+ * @param config Flasher configuration (pins, UART, baud rate)
+ * @param report Session statistics, may be NULL
  *   
  * @return ESP_OK - success, ESP_FAIL - failed
  */
-FlashStatus flashSTM(
-    const char* filename,
-    gpio_num_t reset_pin,
-    gpio_num_t boot0_pin,
-    gpio_num_t uart_tx,
-    gpio_num_t uart_rx,
-    uart_port_t uart_num
-);
+FlashStatus flashImage(ImageSource &source, const FlashConfig& config, FlashReport* report);
 
 } // namespace internal
 } // namespace stm32flash
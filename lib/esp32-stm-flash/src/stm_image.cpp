@@ -0,0 +1,727 @@
+#include "stm_image.h"
+
+namespace stm32flash {
+namespace internal {
+
+static const char *TAG_STM_IMAGE = "stm_image";
+
+bool ImageSource::covers(uint32_t offset) const
+{
+    for (size_t i = 0; i < segmentCount(); i++)
+    {
+        const ImageSegment range = segment(i);
+        if (offset < range.offset + range.length && range.offset < offset + BLOCK_SIZE)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+const char *FileImageSource::block(uint32_t offset, char *scratch)
+{
+    if (offset >= _size || fseek(_file, offset, SEEK_SET) != 0)
+    {
+        return NULL;
+    }
+
+    // Short last block is padded with 0xFF, like erased flash
+    memset(scratch, 0xff, BLOCK_SIZE);
+    const size_t length = MIN((uint32_t)BLOCK_SIZE, _size - offset);
+    if (fread(scratch, 1, length, _file) != length)
+    {
+        logE(TAG_STM_IMAGE, "Failed to read image at offset %lu", (unsigned long)offset);
+        return NULL;
+    }
+    return scratch;
+}
+
+const char *MemoryImageSource::block(uint32_t offset, char *scratch)
+{
+    if (offset >= _size)
+    {
+        return NULL;
+    }
+
+    // Full blocks are used in place, only the last one needs padding
+    if (_size - offset >= BLOCK_SIZE)
+    {
+        return &_data[offset];
+    }
+    memset(scratch, 0xff, BLOCK_SIZE);
+    memcpy(scratch, &_data[offset], _size - offset);
+    return scratch;
+}
+
+stm32flash::FlashStatus PartitionImageSource::map(const char *label, uint32_t size)
+{
+    unmap();
+
+    const esp_partition_t *partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label);
+    if (partition == NULL)
+    {
+        logE(TAG_STM_IMAGE, "Partition not found: %s", label);
+        return stm32flash::ERROR_PARTITION_NOT_FOUND;
+    }
+
+    if (size == 0)
+    {
+        size = partition->size;
+    }
+    if (size > partition->size)
+    {
+        logE(TAG_STM_IMAGE, "Image size %lu exceeds partition size %lu", (unsigned long)size, (unsigned long)partition->size);
+        return stm32flash::ERROR_FILE_TOO_LARGE;
+    }
+
+    const void *data = NULL;
+    esp_err_t err = esp_partition_mmap(partition, 0, size, ESP_PARTITION_MMAP_DATA, &data, &_handle);
+    if (err != ESP_OK)
+    {
+        logE(TAG_STM_IMAGE, "Failed to map partition %s (%s)", label, esp_err_to_name(err));
+        return stm32flash::ERROR_PARTITION_MAP_FAILED;
+    }
+
+    _data = (const char *)data;
+    _size = size;
+    _mapped = true;
+    logI(TAG_STM_IMAGE, "Mapped partition %s, %lu bytes", label, (unsigned long)size);
+    return stm32flash::SUCCESS;
+}
+
+void PartitionImageSource::unmap()
+{
+    if (_mapped)
+    {
+        esp_partition_munmap(_handle);
+        _mapped = false;
+    }
+    _data = NULL;
+    _size = 0;
+}
+
+stm32flash::FlashStatus PreparedImageSource::prepare(ImageSource &input)
+{
+    release();
+
+    const uint32_t count = (input.size() + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    uint32_t covered = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        covered += input.covers(i * BLOCK_SIZE);
+    }
+
+    _blocks = (PreparedBlock *)malloc(count * sizeof(PreparedBlock));
+    // Blocks of a mapped input are used in place, except its padded last block.
+    // The blocks in the gaps of a segmented input all share one blank block (the first one).
+    _buffer = (char *)malloc((1 + (input.isMapped() ? 1 : covered)) * BLOCK_SIZE);
+    if (_blocks == NULL || _buffer == NULL)
+    {
+        logE(TAG_STM_IMAGE, "Not enough memory to prepare %lu blocks", (unsigned long)count);
+        release();
+        return stm32flash::ERROR_UNKNOWN;
+    }
+
+    memset(_buffer, 0xff, BLOCK_SIZE);
+    const PreparedBlock blank_block = {_buffer, xorChecksum(_buffer, BLOCK_SIZE, (uint8_t)(BLOCK_SIZE - 1)), true};
+    char *next_buffer = &_buffer[BLOCK_SIZE];
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (!input.covers(i * BLOCK_SIZE))
+        {
+            _blocks[i] = blank_block;
+            continue;
+        }
+
+        char *scratch = next_buffer;
+        const char *data = input.block(i * BLOCK_SIZE, scratch);
+        if (data == NULL)
+        {
+            logE(TAG_STM_IMAGE, "Failed to read image at offset %lu", (unsigned long)(i * BLOCK_SIZE));
+            release();
+            return stm32flash::ERROR_CANNOT_OPEN_FILE;
+        }
+        if (!input.isMapped())
+        {
+            next_buffer += BLOCK_SIZE;
+        }
+
+        _blocks[i].data = data;
+        _blocks[i].checksum = xorChecksum(data, BLOCK_SIZE, (uint8_t)(BLOCK_SIZE - 1));
+        _blocks[i].blank = isBlockBlank(data, BLOCK_SIZE);
+    }
+
+    _segment_count = MIN(input.segmentCount(), (size_t)MAX_IMAGE_SEGMENTS);
+    for (size_t i = 0; i < _segment_count; i++)
+    {
+        _segments[i] = input.segment(i);
+    }
+    _size = input.size();
+    logI(TAG_STM_IMAGE, "Prepared %lu blocks (%lu with data)", (unsigned long)count, (unsigned long)covered);
+    return stm32flash::SUCCESS;
+}
+
+void PreparedImageSource::release()
+{
+    free(_blocks);
+    free(_buffer);
+    _blocks = NULL;
+    _buffer = NULL;
+    _size = 0;
+    _segment_count = 0;
+}
+
+const char *PreparedImageSource::block(uint32_t offset, char *scratch)
+{
+    const PreparedBlock *prepared_block = prepared(offset);
+    return (prepared_block != NULL) ? prepared_block->data : NULL;
+}
+
+const PreparedBlock *PreparedImageSource::prepared(uint32_t offset) const
+{
+    // Flash tasks always read whole blocks
+    if (offset >= _size || offset % BLOCK_SIZE != 0)
+    {
+        return NULL;
+    }
+    return &_blocks[offset / BLOCK_SIZE];
+}
+
+bool CompressedImageSource::isCompressed(ImageSource &input)
+{
+    char scratch[BLOCK_SIZE];
+    const char *header = (input.size() >= LZ_HEADER_SIZE) ? input.block(0, scratch) : NULL;
+    return header != NULL && memcmp(header, LZ_MAGIC, 4) == 0;
+}
+
+stm32flash::FlashStatus CompressedImageSource::open()
+{
+    if (!isCompressed(_input))
+    {
+        logE(TAG_STM_IMAGE, "Not a compressed image");
+        return stm32flash::ERROR_CANNOT_OPEN_FILE;
+    }
+
+    // "STZ1", uint32 raw size, uint32 raw CRC32 (little-endian)
+    char scratch[BLOCK_SIZE];
+    const uint8_t *header = (const uint8_t *)_input.block(0, scratch);
+    _size = header[4] | (header[5] << 8) | (header[6] << 16) | ((uint32_t)header[7] << 24);
+    _crc = header[8] | (header[9] << 8) | (header[10] << 16) | ((uint32_t)header[11] << 24);
+
+    logI(TAG_STM_IMAGE, "Compressed image: %lu -> %lu bytes", (unsigned long)_input.size(), (unsigned long)_size);
+    rewind();
+
+    // Decode the whole stream once before anything is erased: a corrupted or truncated stream decodes
+    // to garbage, which would still pass verification since it is compared with the same decoded bytes
+    uint32_t crc = 0;
+    for (uint32_t offset = 0; offset < _size; offset += BLOCK_SIZE)
+    {
+        const char *data = block(offset, scratch);
+        if (data == NULL)
+        {
+            return stm32flash::ERROR_IMAGE_CORRUPTED;
+        }
+        crc = esp_rom_crc32_le(crc, (const uint8_t *)data, MIN((uint32_t)BLOCK_SIZE, _size - offset));
+    }
+    if (crc != _crc)
+    {
+        logE(TAG_STM_IMAGE, "Compressed image CRC mismatch: %08lX, expected %08lX", (unsigned long)crc, (unsigned long)_crc);
+        return stm32flash::ERROR_IMAGE_CORRUPTED;
+    }
+    rewind();
+    return stm32flash::SUCCESS;
+}
+
+void CompressedImageSource::rewind()
+{
+    _in_pos = LZ_HEADER_SIZE;
+    _in_block = NULL;
+    _out_pos = 0;
+    _flag_bits = 0;
+    _match_left = 0;
+}
+
+int CompressedImageSource::readByte()
+{
+    if (_in_pos >= _input.size())
+    {
+        return -1;
+    }
+
+    // Input is fetched a block at a time, in place for mapped sources
+    if (_in_block == NULL || _in_pos - _in_block_offset >= BLOCK_SIZE)
+    {
+        _in_block_offset = _in_pos - (_in_pos % BLOCK_SIZE);
+        _in_block = _input.block(_in_block_offset, _in_buffer);
+        if (_in_block == NULL)
+        {
+            return -1;
+        }
+    }
+    return (uint8_t)_in_block[_in_pos++ - _in_block_offset];
+}
+
+int CompressedImageSource::decodeByte()
+{
+    if (_match_left == 0)
+    {
+        // Each flag byte describes the next 8 tokens, LSB first: 1 = literal, 0 = match
+        if (_flag_bits == 0)
+        {
+            const int flags = readByte();
+            if (flags < 0) return -1;
+            _flags = flags;
+            _flag_bits = 8;
+        }
+        const bool literal = _flags & 1;
+        _flags >>= 1;
+        _flag_bits--;
+
+        if (literal)
+        {
+            const int c = readByte();
+            if (c < 0) return -1;
+            _window[_out_pos++ % LZ_WINDOW_SIZE] = (char)c;
+            return c;
+        }
+
+        const int hi = readByte();
+        const int lo = readByte();
+        if (hi < 0 || lo < 0) return -1;
+        const uint16_t token = (hi << 8) | lo;
+        _match_distance = (token >> LZ_LENGTH_BITS) + 1;
+        _match_left = (token & ((1 << LZ_LENGTH_BITS) - 1)) + LZ_MIN_MATCH;
+        if (_match_distance > _out_pos)
+        {
+            logE(TAG_STM_IMAGE, "Corrupted compressed image at %lu", (unsigned long)_out_pos);
+            return -1;
+        }
+    }
+
+    // Matches are copied byte-by-byte, so they may overlap the bytes they produce
+    const char c = _window[(_out_pos - _match_distance) % LZ_WINDOW_SIZE];
+    _window[_out_pos++ % LZ_WINDOW_SIZE] = c;
+    _match_left--;
+    return (uint8_t)c;
+}
+
+const char *CompressedImageSource::block(uint32_t offset, char *scratch)
+{
+    if (offset >= _size)
+    {
+        return NULL;
+    }
+
+    // Only forward reads are cheap: going back means decompressing again from the start
+    if (offset < _out_pos)
+    {
+        rewind();
+    }
+    while (_out_pos < offset)
+    {
+        if (decodeByte() < 0) return NULL;
+    }
+
+    memset(scratch, 0xff, BLOCK_SIZE);
+    const uint32_t length = MIN((uint32_t)BLOCK_SIZE, _size - offset);
+    for (uint32_t i = 0; i < length; i++)
+    {
+        const int c = decodeByte();
+        if (c < 0)
+        {
+            logE(TAG_STM_IMAGE, "Truncated compressed image at %lu", (unsigned long)_out_pos);
+            return NULL;
+        }
+        scratch[i] = (char)c;
+    }
+    return scratch;
+}
+
+uint32_t SegmentedImageSource::size() const
+{
+    if (_segment_count == 0)
+    {
+        return 0;
+    }
+    const ImageSegment &last = _segments[_segment_count - 1].range;
+    return last.offset + last.length;
+}
+
+bool SegmentedImageSource::addSegment(uint32_t address, uint32_t length, uint32_t position, uint32_t base)
+{
+    // e.g. option bytes at 0x1FFFxxxx or initialized data linked at its RAM address
+    if (address < FLASH_BASE_ADDRESS || address >= FLASH_END_ADDRESS || length > FLASH_END_ADDRESS - address)
+    {
+        logE(TAG_STM_IMAGE, "Segment at 0x%08lX (%lu bytes) lies outside main flash memory",
+             (unsigned long)address, (unsigned long)length);
+        return false;
+    }
+
+    const uint32_t offset = address - FLASH_BASE_ADDRESS;
+    if (_segment_count > 0)
+    {
+        const ImageSegment &last = _segments[_segment_count - 1].range;
+        if (offset < last.offset + last.length)
+        {
+            logE(TAG_STM_IMAGE, "Segment at 0x%08lX overlaps or precedes the previous one", (unsigned long)address);
+            return false;
+        }
+    }
+    if (_segment_count >= MAX_IMAGE_SEGMENTS)
+    {
+        logE(TAG_STM_IMAGE, "Too many segments (max: %d)", MAX_IMAGE_SEGMENTS);
+        return false;
+    }
+
+    _segments[_segment_count++] = {{offset, length}, position, base};
+    return true;
+}
+
+bool SegmentedImageSource::readInput(uint32_t position, char *data, uint32_t count)
+{
+    if (position > _input.size() || count > _input.size() - position)
+    {
+        return false;
+    }
+
+    while (count > 0)
+    {
+        const uint32_t block_offset = position - position % BLOCK_SIZE;
+        if (_in_block == NULL || _in_block_offset != block_offset)
+        {
+            _in_block = _input.block(block_offset, _in_buffer);
+            _in_block_offset = block_offset;
+            if (_in_block == NULL)
+            {
+                return false;
+            }
+        }
+
+        const uint32_t skip = position - block_offset;
+        const uint32_t length = MIN(count, (uint32_t)BLOCK_SIZE - skip);
+        memcpy(data, &_in_block[skip], length);
+        data += length;
+        position += length;
+        count -= length;
+    }
+    return true;
+}
+
+static int hexDigit(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+static bool parseHexBytes(const char *text, uint8_t *bytes, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        const int hi = hexDigit(text[2 * i]);
+        const int lo = hexDigit(text[2 * i + 1]);
+        if (hi < 0 || lo < 0) return false;
+        bytes[i] = (hi << 4) | lo;
+    }
+    return true;
+}
+
+bool HexImageSource::isHex(ImageSource &input)
+{
+    char scratch[BLOCK_SIZE];
+    const char *header = (input.size() >= 11) ? input.block(0, scratch) : NULL;
+    return header != NULL && header[0] == ':';
+}
+
+bool HexImageSource::readRecord(uint32_t position, uint32_t base, Record &record)
+{
+    // Line endings are skipped up to the start code
+    char c = 0;
+    do
+    {
+        if (!readInput(position++, &c, 1)) return false;
+    } while (c == '\r' || c == '\n' || c == ' ' || c == '\t');
+    if (c != ':')
+    {
+        return false;
+    }
+
+    // :LLAAAATT, then LL data bytes and the checksum
+    char text[2 * (HEX_MAX_RECORD + 1)];
+    uint8_t header[4];
+    if (!readInput(position, text, 8) || !parseHexBytes(text, header, 4))
+    {
+        return false;
+    }
+    record.length = header[0];
+    record.type = header[3];
+    if (!readInput(position + 8, text, 2 * (record.length + 1)) || !parseHexBytes(text, record.data, record.length + 1))
+    {
+        return false;
+    }
+
+    uint8_t sum = header[0] + header[1] + header[2] + header[3];
+    for (int i = 0; i <= record.length; i++)
+    {
+        sum += record.data[i];
+    }
+    if (sum != 0)
+    {
+        logE(TAG_STM_IMAGE, "Bad HEX record checksum at %lu", (unsigned long)(position - 1));
+        return false;
+    }
+
+    record.address = base + ((header[1] << 8) | header[2]);
+    record.next = position + 8 + 2 * (record.length + 1);
+    return true;
+}
+
+stm32flash::FlashStatus HexImageSource::open()
+{
+    if (!isHex(_input))
+    {
+        logE(TAG_STM_IMAGE, "Not an Intel HEX image");
+        return stm32flash::ERROR_CANNOT_OPEN_FILE;
+    }
+
+    _segment_count = 0;
+    uint32_t position = 0;
+    uint32_t base = 0;
+    bool end = false;
+    while (!end)
+    {
+        if (!readRecord(position, base, _record))
+        {
+            logE(TAG_STM_IMAGE, "Invalid HEX record at %lu", (unsigned long)position);
+            return stm32flash::ERROR_CANNOT_OPEN_FILE;
+        }
+
+        switch (_record.type)
+        {
+        case 0x00: // Data, merged with the previous record if contiguous
+            if (_record.length == 0)
+            {
+                break;
+            }
+            if (_segment_count > 0 && _record.address >= FLASH_BASE_ADDRESS &&
+                _record.address - FLASH_BASE_ADDRESS == size() &&
+                _record.address + _record.length <= FLASH_END_ADDRESS)
+            {
+                _segments[_segment_count - 1].range.length += _record.length;
+            }
+            else if (!addSegment(_record.address, _record.length, position, base))
+            {
+                return stm32flash::ERROR_INVALID_RANGE;
+            }
+            break;
+        case 0x01: // End of file
+            end = true;
+            break;
+        case 0x02: // Extended segment address
+            base = ((_record.data[0] << 8) | _record.data[1]) << 4;
+            break;
+        case 0x04: // Extended linear address
+            base = ((_record.data[0] << 8) | _record.data[1]) << 16;
+            break;
+        case 0x03: // Start addresses, not needed to flash
+        case 0x05:
+            break;
+        default:
+            logE(TAG_STM_IMAGE, "Unsupported HEX record type %d", _record.type);
+            return stm32flash::ERROR_CANNOT_OPEN_FILE;
+        }
+        position = _record.next;
+    }
+
+    if (_segment_count == 0)
+    {
+        logE(TAG_STM_IMAGE, "HEX image holds no data");
+        return stm32flash::ERROR_FILE_EMPTY;
+    }
+
+    _cursor = _segments[0].position;
+    _cursor_base = _segments[0].base;
+    _last_offset = 0;
+    logI(TAG_STM_IMAGE, "Intel HEX image: %d segments, up to 0x%08lX",
+         (int)_segment_count, (unsigned long)(FLASH_BASE_ADDRESS + size()));
+    return stm32flash::SUCCESS;
+}
+
+const char *HexImageSource::block(uint32_t offset, char *scratch)
+{
+    if (offset >= size())
+    {
+        return NULL;
+    }
+
+    // Records are in address order: the same or an earlier block, or a later segment, is found from the start of its segment
+    size_t index = 0;
+    while (_segments[index].range.offset + _segments[index].range.length <= offset)
+    {
+        index++;
+    }
+    if (offset <= _last_offset || _segments[index].position > _cursor)
+    {
+        _cursor = _segments[index].position;
+        _cursor_base = _segments[index].base;
+    }
+    _last_offset = offset;
+
+    memset(scratch, 0xff, BLOCK_SIZE);
+    const uint32_t start = FLASH_BASE_ADDRESS + offset;
+    const uint32_t end = start + BLOCK_SIZE;
+    while (true)
+    {
+        if (!readRecord(_cursor, _cursor_base, _record))
+        {
+            logE(TAG_STM_IMAGE, "Invalid HEX record at %lu", (unsigned long)_cursor);
+            return NULL;
+        }
+
+        if (_record.type == 0x01)
+        {
+            break;
+        }
+        if (_record.type == 0x02 || _record.type == 0x04)
+        {
+            _cursor_base = ((_record.data[0] << 8) | _record.data[1]) << ((_record.type == 0x02) ? 4 : 16);
+        }
+        else if (_record.type == 0x00 && _record.length > 0)
+        {
+            // A record of a later block is kept for the next call
+            if (_record.address >= end)
+            {
+                break;
+            }
+
+            const uint32_t from = MAX(start, _record.address);
+            const uint32_t to = MIN(end, _record.address + _record.length);
+            if (from < to)
+            {
+                memcpy(&scratch[from - start], &_record.data[from - _record.address], to - from);
+            }
+
+            // So is a record running into the next block
+            if (_record.address + _record.length > end)
+            {
+                break;
+            }
+        }
+        _cursor = _record.next;
+    }
+    return scratch;
+}
+
+static uint32_t readLE32(const uint8_t *data)
+{
+    return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+bool ElfImageSource::isElf(ImageSource &input)
+{
+    char scratch[BLOCK_SIZE];
+    const char *header = (input.size() >= 52) ? input.block(0, scratch) : NULL;
+    return header != NULL && memcmp(header, "\x7F" "ELF", 4) == 0;
+}
+
+stm32flash::FlashStatus ElfImageSource::open()
+{
+    // ELF32 header: class, data encoding, then the program header table at e_phoff
+    uint8_t header[52];
+    if (!isElf(_input) || !readInput(0, (char *)header, sizeof(header)) || header[4] != 1 || header[5] != 1)
+    {
+        logE(TAG_STM_IMAGE, "Not a 32-bit little-endian ELF file");
+        return stm32flash::ERROR_CANNOT_OPEN_FILE;
+    }
+    const uint32_t ph_offset = readLE32(&header[28]);
+    const uint16_t ph_size = header[42] | (header[43] << 8);
+    const uint16_t ph_count = header[44] | (header[45] << 8);
+    if (ph_size < 32)
+    {
+        logE(TAG_STM_IMAGE, "Invalid ELF program header size %d", ph_size);
+        return stm32flash::ERROR_CANNOT_OPEN_FILE;
+    }
+
+    // Loadable segments with file contents, sorted by physical (load) address
+    Segment found[MAX_IMAGE_SEGMENTS];
+    size_t found_count = 0;
+    for (uint16_t i = 0; i < ph_count; i++)
+    {
+        uint8_t ph[32];
+        if (!readInput(ph_offset + i * ph_size, (char *)ph, sizeof(ph)))
+        {
+            logE(TAG_STM_IMAGE, "Truncated ELF program header %d", i);
+            return stm32flash::ERROR_CANNOT_OPEN_FILE;
+        }
+
+        const uint32_t type = readLE32(&ph[0]);
+        const uint32_t file_offset = readLE32(&ph[4]);
+        const uint32_t address = readLE32(&ph[12]);
+        const uint32_t file_size = readLE32(&ph[16]);
+        if (type != 1 || file_size == 0) // PT_LOAD
+        {
+            continue;
+        }
+        if (file_offset > _input.size() || file_size > _input.size() - file_offset)
+        {
+            logE(TAG_STM_IMAGE, "ELF segment %d lies outside the file", i);
+            return stm32flash::ERROR_CANNOT_OPEN_FILE;
+        }
+        if (found_count >= MAX_IMAGE_SEGMENTS)
+        {
+            logE(TAG_STM_IMAGE, "Too many segments (max: %d)", MAX_IMAGE_SEGMENTS);
+            return stm32flash::ERROR_INVALID_RANGE;
+        }
+
+        size_t j = found_count++;
+        for (; j > 0 && found[j - 1].range.offset > address; j--)
+        {
+            found[j] = found[j - 1];
+        }
+        found[j] = {{address, file_size}, file_offset, 0};
+    }
+
+    _segment_count = 0;
+    for (size_t i = 0; i < found_count; i++)
+    {
+        if (!addSegment(found[i].range.offset, found[i].range.length, found[i].position, 0))
+        {
+            return stm32flash::ERROR_INVALID_RANGE;
+        }
+    }
+    if (_segment_count == 0)
+    {
+        logE(TAG_STM_IMAGE, "ELF file has no loadable segment");
+        return stm32flash::ERROR_FILE_EMPTY;
+    }
+
+    logI(TAG_STM_IMAGE, "ELF image: %d segments, up to 0x%08lX",
+         (int)_segment_count, (unsigned long)(FLASH_BASE_ADDRESS + size()));
+    return stm32flash::SUCCESS;
+}
+
+const char *ElfImageSource::block(uint32_t offset, char *scratch)
+{
+    if (offset >= size())
+    {
+        return NULL;
+    }
+
+    memset(scratch, 0xff, BLOCK_SIZE);
+    for (size_t i = 0; i < _segment_count; i++)
+    {
+        const ImageSegment &range = _segments[i].range;
+        const uint32_t from = MAX(offset, range.offset);
+        const uint32_t to = MIN(offset + BLOCK_SIZE, range.offset + range.length);
+        if (from < to && !readInput(_segments[i].position + (from - range.offset), &scratch[from - offset], to - from))
+        {
+            logE(TAG_STM_IMAGE, "Failed to read ELF segment at offset %lu", (unsigned long)from);
+            return NULL;
+        }
+    }
+    return scratch;
+}
+
+} // namespace internal
+} // namespace stm32flash
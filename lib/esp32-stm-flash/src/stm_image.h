@@ -0,0 +1,281 @@
+#ifndef _STM_IMAGE_H
+#define _STM_IMAGE_H
+
+#include "stm_pro_mode.h"
+
+#include "esp_partition.h"
+
+namespace stm32flash {
+namespace internal {
+
+// Compressed image format, see tools/stm32_pack.py
+#define LZ_MAGIC "STZ1"
+#define LZ_HEADER_SIZE 12
+#define LZ_WINDOW_BITS 10
+#define LZ_LENGTH_BITS 6
+#define LZ_WINDOW_SIZE (1 << LZ_WINDOW_BITS)
+#define LZ_MIN_MATCH 3
+
+#define MAX_IMAGE_SEGMENTS 16 // Ranges of a segmented (Intel HEX or ELF) image
+#define HEX_MAX_RECORD 255    // Data bytes in an Intel HEX record
+
+//Range of an image holding data, as offsets from FLASH_BASE_ADDRESS
+struct ImageSegment {
+    uint32_t offset;
+    uint32_t length;
+};
+
+//Block of an image prepared for WRITE MEMORY
+struct PreparedBlock {
+    const char *data; // BLOCK_SIZE bytes, padded with 0xFF
+    uint8_t checksum; // XOR checksum of the WRITE MEMORY frame
+    bool blank;       // All 0xFF, nothing to write
+};
+
+/**
+ * @brief Firmware image, read block-by-block by the flash tasks
+ */
+class ImageSource {
+public:
+    virtual ~ImageSource() {}
+
+    //Size of the image in bytes
+    virtual uint32_t size() const = 0;
+
+    //True if block() never copies (the whole image is addressable in memory)
+    virtual bool isMapped() const = 0;
+
+    //Get the BLOCK_SIZE bytes at offset, the last block being padded with 0xFF.
+    //Returns a pointer either into the image itself or to scratch, NULL on read error.
+    virtual const char *block(uint32_t offset, char *scratch) = 0;
+
+    //Get the block at offset with its checksum if already prepared, NULL if it has to be prepared by the caller
+    virtual const PreparedBlock *prepared(uint32_t offset) const { return NULL; }
+
+    //Ranges holding data, in ascending order. A raw image is a single segment from offset 0.
+    virtual size_t segmentCount() const { return 1; }
+    virtual ImageSegment segment(size_t index) const { return {0, size()}; }
+
+    //Check if the block at offset holds image data: blocks in the gaps between segments are neither erased, written nor verified
+    bool covers(uint32_t offset) const;
+};
+
+/**
+ * @brief Image read from an open file (e.g. on SPIFFS)
+ */
+class FileImageSource : public ImageSource {
+public:
+    FileImageSource(FILE *file, uint32_t size) : _file(file), _size(size) {}
+
+    uint32_t size() const override { return _size; }
+    bool isMapped() const override { return false; }
+    const char *block(uint32_t offset, char *scratch) override;
+
+private:
+    FILE *_file;
+    uint32_t _size;
+};
+
+/**
+ * @brief Image already in the address space (RAM, or flash mapped by the MMU)
+ */
+class MemoryImageSource : public ImageSource {
+public:
+    MemoryImageSource(const uint8_t *data = NULL, uint32_t size = 0) : _data((const char *)data), _size(size) {}
+
+    uint32_t size() const override { return _size; }
+    bool isMapped() const override { return true; }
+    const char *block(uint32_t offset, char *scratch) override;
+
+protected:
+    const char *_data;
+    uint32_t _size;
+};
+
+/**
+ * @brief Image stored in a raw data partition, mapped with esp_partition_mmap (no VFS, no copy)
+ */
+class PartitionImageSource : public MemoryImageSource {
+public:
+    ~PartitionImageSource() { unmap(); }
+
+    //Map the first size bytes of the partition (the whole partition if size is 0)
+    stm32flash::FlashStatus map(const char *label, uint32_t size);
+    void unmap();
+
+private:
+    esp_partition_mmap_handle_t _handle = 0;
+    bool _mapped = false;
+};
+
+/**
+ * @brief Image whose blocks are read, decompressed and checksummed once, then shared read-only
+ *
+ * Used to broadcast one image to several targets: the flash tasks only look up the prepared
+ * blocks, so any number of them can read the same PreparedImageSource concurrently
+ */
+class PreparedImageSource : public ImageSource {
+public:
+    ~PreparedImageSource() { release(); }
+
+    //Read and prepare every block of input (a mapped input is referenced in place, other inputs are copied)
+    stm32flash::FlashStatus prepare(ImageSource &input);
+    void release();
+
+    uint32_t size() const override { return _size; }
+    bool isMapped() const override { return true; }
+    const char *block(uint32_t offset, char *scratch) override;
+    const PreparedBlock *prepared(uint32_t offset) const override;
+    size_t segmentCount() const override { return _segment_count; }
+    ImageSegment segment(size_t index) const override { return _segments[index]; }
+
+private:
+    uint32_t _size = 0;
+    PreparedBlock *_blocks = NULL;
+    char *_buffer = NULL;
+    ImageSegment _segments[MAX_IMAGE_SEGMENTS];
+    size_t _segment_count = 0;
+};
+
+/**
+ * @brief Image made of separate address ranges, read from another source (Intel HEX or ELF file)
+ *
+ * Offsets are relative to FLASH_BASE_ADDRESS, the size spans up to the end of the last segment.
+ * Blocks are padded with 0xFF around and between the segments.
+ */
+class SegmentedImageSource : public ImageSource {
+public:
+    SegmentedImageSource(ImageSource &input) : _input(input) {}
+
+    uint32_t size() const override;
+    bool isMapped() const override { return false; }
+    size_t segmentCount() const override { return _segment_count; }
+    ImageSegment segment(size_t index) const override { return _segments[index].range; }
+
+protected:
+    struct Segment {
+        ImageSegment range;
+        uint32_t position; // Where the data starts in the input: file offset (ELF) or first record (HEX)
+        uint32_t base;     // Upper address of the first record (HEX)
+    };
+
+    //Append the range at address (absolute), merged with the last segment if contiguous; false if out of order or out of flash
+    bool addSegment(uint32_t address, uint32_t length, uint32_t position, uint32_t base);
+
+    //Read count bytes of the input at position
+    bool readInput(uint32_t position, char *data, uint32_t count);
+
+    ImageSource &_input;
+    Segment _segments[MAX_IMAGE_SEGMENTS];
+    size_t _segment_count = 0;
+
+private:
+    // Last input block read, most reads are small and sequential
+    uint32_t _in_block_offset = 0;
+    const char *_in_block = NULL;
+    char _in_buffer[BLOCK_SIZE];
+};
+
+/**
+ * @brief Intel HEX image (data, extended segment and extended linear address records)
+ *
+ * Records must be in ascending address order, as written by objcopy. Blocks are decoded from the
+ * text on demand, reading forward from the last record used.
+ */
+class HexImageSource : public SegmentedImageSource {
+public:
+    HexImageSource(ImageSource &input) : SegmentedImageSource(input) {}
+
+    //Check if a source holds an Intel HEX image
+    static bool isHex(ImageSource &input);
+
+    //Parse all the records and build the segments, SUCCESS if the file is a valid HEX image
+    stm32flash::FlashStatus open();
+
+    const char *block(uint32_t offset, char *scratch) override;
+
+private:
+    struct Record {
+        uint8_t type;
+        uint8_t length;
+        uint32_t address; // Absolute, with the upper address applied
+        uint32_t next;    // Position of the next record
+        uint8_t data[HEX_MAX_RECORD + 1]; // Followed by the checksum
+    };
+
+    //Read the record at position, with base as the current upper address
+    bool readRecord(uint32_t position, uint32_t base, Record &record);
+
+    uint32_t _cursor = 0;      // Next record to decode
+    uint32_t _cursor_base = 0; // Upper address at the cursor
+    uint32_t _last_offset = 0; // Last block decoded, reading it again or an earlier one restarts from its segment
+    Record _record;
+};
+
+/**
+ * @brief ELF executable, flashed from its loadable program headers (at their physical address)
+ */
+class ElfImageSource : public SegmentedImageSource {
+public:
+    ElfImageSource(ImageSource &input) : SegmentedImageSource(input) {}
+
+    //Check if a source holds an ELF file
+    static bool isElf(ImageSource &input);
+
+    //Parse the program headers and build the segments, SUCCESS if the file is a valid 32-bit little-endian ELF
+    stm32flash::FlashStatus open();
+
+    const char *block(uint32_t offset, char *scratch) override;
+};
+
+/**
+ * @brief Compressed image (STZ1 LZSS stream), decompressed on the fly from another source
+ *
+ * Decompression is sequential with a fixed LZ_WINDOW_SIZE history window; reading
+ * an earlier block restarts from the beginning of the stream
+ */
+class CompressedImageSource : public ImageSource {
+public:
+    CompressedImageSource(ImageSource &input) : _input(input) {}
+
+    //Check if a source holds a compressed image
+    static bool isCompressed(ImageSource &input);
+
+    //Parse the header and check the CRC32 of the decoded stream, SUCCESS if it is a valid compressed image
+    stm32flash::FlashStatus open();
+
+    uint32_t size() const override { return _size; }
+    bool isMapped() const override { return false; }
+    const char *block(uint32_t offset, char *scratch) override;
+
+    //CRC32 of the decompressed image, from the header (checked by open)
+    uint32_t crc() const { return _crc; }
+
+private:
+    void rewind();
+    int readByte();
+    int decodeByte();
+
+    ImageSource &_input;
+    uint32_t _size = 0;
+    uint32_t _crc = 0;
+
+    // Input side
+    uint32_t _in_pos = 0;
+    uint32_t _in_block_offset = 0;
+    const char *_in_block = NULL;
+    char _in_buffer[BLOCK_SIZE];
+
+    // Output side
+    uint32_t _out_pos = 0;
+    uint8_t _flags = 0;
+    uint8_t _flag_bits = 0;
+    uint16_t _match_distance = 0;
+    uint16_t _match_left = 0;
+    char _window[LZ_WINDOW_SIZE];
+};
+
+} // namespace internal
+} // namespace stm32flash
+
+#endif
@@ -1,22 +1,79 @@
 #include "stm_pro_mode.h"
+#include "stm_devices.h"
 
 namespace stm32flash {
 namespace internal {
 
 static const char *TAG_STM_PRO = "stm_pro_mode";
 
+// Candidate rates for BAUD_PROBE, fastest first
+static const uint32_t PROBE_BAUD_RATES[] = {921600, 460800, 230400, 115200, 57600, 38400, 19200, 9600};
+
+// Operation allowances of the device on each UART, NULL until it is identified
+static const OperationTimes *s_operation_times[UART_NUM_MAX] = {};
+
+void setOperationTimes(uart_port_t uart_num, const OperationTimes *times)
+{
+    s_operation_times[uart_num] = times;
+}
+
+const OperationTimes &operationTimes(uart_port_t uart_num)
+{
+    const OperationTimes *times = s_operation_times[uart_num];
+    return (times != NULL) ? *times : DEFAULT_OPERATION_TIMES;
+}
+
+// Command ACK latencies on each UART
+static AckStats s_ack_stats[UART_NUM_MAX] = {};
+
+void resetAckStats(uart_port_t uart_num)
+{
+    s_ack_stats[uart_num] = AckStats{0, UINT32_MAX, 0, 0};
+}
+
+const AckStats &ackStats(uart_port_t uart_num)
+{
+    return s_ack_stats[uart_num];
+}
+
+static void recordAck(uart_port_t uart_num, int64_t sent_at)
+{
+    const uint32_t latency = esp_timer_get_time() - sent_at;
+    AckStats &stats = s_ack_stats[uart_num];
+    stats.count++;
+    stats.min_us = MIN(stats.min_us, latency);
+    stats.max_us = MAX(stats.max_us, latency);
+    stats.total_us += latency;
+}
+
+int replyTimeout(uart_port_t uart_num, int bytes, uint32_t allowance_ms)
+{
+    uint32_t baud_rate = UART_BAUD_RATE;
+    uart_get_baudrate(uart_num, &baud_rate);
+
+    // 11 bits per byte (start, 8 data, even parity, stop). uart_write_bytes() returns once the data
+    // is queued, so the bytes sent are still on the wire when the wait for the reply starts.
+    const uint32_t wire_ms = ((uint64_t)bytes * 11 * 1000 + baud_rate - 1) / baud_rate;
+    return wire_ms + allowance_ms + TIMEOUT_MARGIN;
+}
+
 //Functions for custom adjustments
-stm32flash::FlashStatus initFlashUART(uart_port_t uart_num, gpio_num_t tx, gpio_num_t rx)
+stm32flash::FlashStatus initFlashUART(uart_port_t uart_num, gpio_num_t tx, gpio_num_t rx, uint32_t baud_rate)
 {
     const uart_config_t uart_config = {
-        .baud_rate = UART_BAUD_RATE,
+        .baud_rate = (int)baud_rate,
         .data_bits = UART_DATA_8_BITS,
         .parity = UART_PARITY_EVEN,
         .stop_bits = UART_STOP_BITS_1,
         .flow_ctrl = UART_HW_FLOWCTRL_DISABLE
     };
 
-    esp_err_t err = uart_driver_install(uart_num, UART_BUF_SIZE * 2, 0, 0, NULL, 0);
+    // New session, the device is not identified yet
+    setOperationTimes(uart_num, NULL);
+    resetAckStats(uart_num);
+
+    // TX ring buffer lets a whole frame be queued in one call instead of blocking on the FIFO
+    esp_err_t err = uart_driver_install(uart_num, UART_BUF_SIZE * 2, UART_BUF_SIZE, 0, NULL, 0);
     if (err != ESP_OK) {
         logE(TAG_STM_PRO, "Failed to install UART driver");
         return stm32flash::ERROR_UART_INIT;
@@ -34,12 +91,18 @@ stm32flash::FlashStatus initFlashUART(uart_port_t uart_num, gpio_num_t tx, gpio_
         return stm32flash::ERROR_UART_INIT;
     }
 
-    logI(TAG_STM_PRO, "Initialized Flash UART successfully");
+    logI(TAG_STM_PRO, "Initialized Flash UART successfully (%lu baud)", (unsigned long)baud_rate);
     return stm32flash::SUCCESS;
 }
 
 stm32flash::FlashStatus initSPIFFS(void)
 {
+    // Already mounted, e.g. by the application or by another flash session
+    if (esp_spiffs_mounted(NULL))
+    {
+        return stm32flash::SUCCESS;
+    }
+
     logI(TAG_STM_PRO, "%s", "Initializing SPIFFS");
 
     esp_vfs_spiffs_conf_t conf =
@@ -85,67 +148,284 @@ stm32flash::FlashStatus initSPIFFS(void)
     return stm32flash::ERROR_SPIFFS_INIT;
 }
 
-void resetSTM(gpio_num_t reset_pin)
+void resetSTM(gpio_num_t reset_pin, uint32_t pulse_ms, uint32_t settle_ms)
 {
     logI(TAG_STM_PRO, "%s", "Starting RESET Procedure");
 
     gpio_set_level(reset_pin, LOW);
-    vTaskDelay(100 / portTICK_PERIOD_MS);
+    vTaskDelay(pdMS_TO_TICKS(pulse_ms) + 1);
     gpio_set_level(reset_pin, HIGH);
-    vTaskDelay(500 / portTICK_PERIOD_MS);
+    vTaskDelay(pdMS_TO_TICKS(settle_ms) + 1);
 
     logI(TAG_STM_PRO, "%s", "Finished RESET Procedure");
 }
 
-stm32flash::FlashStatus setupSTM(gpio_num_t reset_pin, uart_port_t uart_num)
+int resyncSTM(uart_port_t uart_num)
+{
+    logW(TAG_STM_PRO, "%s", "Resynchronizing with the bootloader");
+
+    // Filler bytes are sent until a NACK. The filler must never complete a valid frame, or the
+    // bootloader would ACK and act on it (0xFF fillers form a valid WRITE MEMORY frame of 0xFF bytes,
+    // which then gets programmed). An even, non-zero filler F that is not the complement of a command
+    // is rejected in every state:
+    // - command: [F][F] fails the complement check, and [cmd][F] does too since F is no ~cmd
+    // - address: four F bytes XOR to 0, which differs from the F checksum
+    // - READ count: [F][F] fails the complement check
+    // - WRITE data or ERASE pages: N = F is followed by N + 1 (odd) F bytes, EXTENDED ERASE
+    //   N = (F << 8) | F by 2 * (N + 1) of them, so the frame XORs to 0 and again differs from the F checksum
+    // The longest of these is the EXTENDED ERASE list: RESYNC_MAX_FRAME bytes (1033 with F = 02). One of
+    // our page lists cut short needs fewer, it holds at most MAX_ERASE_PAGES page numbers.
+    char fillers[RESYNC_CHUNK];
+    memset(fillers, RESYNC_FILLER, sizeof(fillers));
+    uart_flush_input(uart_num);
+
+    // Chunks until the first NACK: the fillers after it only pair up into rejected commands
+    const int chunk_timeout = replyTimeout(uart_num, RESYNC_CHUNK, RESYNC_TIMEOUT);
+    bool answered = false;
+    for (int sent = 0; sent < RESYNC_MAX_FRAME + RESYNC_CHUNK && !answered; sent += RESYNC_CHUNK)
+    {
+        sendData(TAG_STM_PRO, fillers, RESYNC_CHUNK, uart_num);
+
+        uint8_t resp = 0;
+        answered = waitForSerialData(&resp, 1, chunk_timeout, uart_num) > 0 && resp == NACK;
+    }
+
+    if (answered)
+    {
+        // Drop the NACKs of those pairs, then at most two single fillers complete a pending command
+        uart_wait_tx_done(uart_num, pdMS_TO_TICKS(chunk_timeout) + 1);
+        vTaskDelay(pdMS_TO_TICKS(RESYNC_TIMEOUT) + 1);
+        uart_flush_input(uart_num);
+        for (int i = 0; i < 2; i++)
+        {
+            sendData(TAG_STM_PRO, fillers, 1, uart_num);
+
+            uint8_t resp = 0;
+            if (waitForSerialData(&resp, 1, RESYNC_TIMEOUT, uart_num) > 0 && resp == NACK)
+            {
+                uart_flush_input(uart_num);
+                return 1;
+            }
+        }
+    }
+
+    logE(TAG_STM_PRO, "%s", "Resynchronization failed");
+    return 0;
+}
+
+// Size of the actual part from its flash size register, the largest size of its line if the register cannot be read
+static uint32_t readFlashSize(uart_port_t uart_num, const DeviceInfo &info, const DeviceSpec &device)
+{
+    char size_kb[2];
+    if (!info.supports(CMD_READ))
+    {
+        return device.flash_size;
+    }
+    if (readMemory(device.flash_size_address, size_kb, sizeof(size_kb), uart_num) != ESP_OK)
+    {
+        // e.g. read protection: the system memory is not readable either
+        resyncSTM(uart_num);
+        return device.flash_size;
+    }
+
+    const uint32_t size = ((uint8_t)size_kb[0] | ((uint8_t)size_kb[1] << 8)) * 1024;
+    return (size > 0 && size <= device.flash_size) ? size : device.flash_size;
+}
+
+bool readDeviceUid(uart_port_t uart_num, const DeviceInfo &info, uint8_t uid[DEVICE_UID_SIZE])
+{
+    const DeviceSpec *device = findDevice(info.product_id);
+    if (device == NULL || !info.supports(CMD_READ))
+    {
+        return false;
+    }
+    char id[DEVICE_UID_SIZE];
+    if (readMemory(device->uid_address, id, sizeof(id), uart_num) != ESP_OK)
+    {
+        resyncSTM(uart_num);
+        return false;
+    }
+    memcpy(uid, id, sizeof(id));
+    return true;
+}
+
+stm32flash::FlashStatus setupSTM(uart_port_t uart_num, DeviceInfo &info)
 {
     logI(TAG_STM_PRO, "%s", "Starting STM32 Setup Procedure");
 
-    resetSTM(reset_pin);
-    if (!cmdSync(uart_num)) return stm32flash::ERROR_STM_SYNC_FAILED;
-    if (!cmdGet(uart_num)) return stm32flash::ERROR_STM_GET_COMMANDS_FAILED;
-    if (!cmdVersion(uart_num)) return stm32flash::ERROR_STM_GET_VERSION_FAILED;
-    if (!cmdId(uart_num)) return stm32flash::ERROR_STM_GET_ID_FAILED;
-    cmdErase(uart_num);
-    cmdExtErase(uart_num);
+    // Already synced by isSTMPresent, only fetch what GET did not tell
+    if (info.command_count == 0 && !cmdGet(uart_num, &info)) return stm32flash::ERROR_STM_GET_COMMANDS_FAILED;
+    if (!cmdVersion(uart_num, &info)) return stm32flash::ERROR_STM_GET_VERSION_FAILED;
+    if (!cmdId(uart_num, &info)) return stm32flash::ERROR_STM_GET_ID_FAILED;
+
+    logI(TAG_STM_PRO, "Bootloader v%d.%d, PID 0x%03X, %d commands",
+         info.bootloader_version >> 4, info.bootloader_version & 0x0F, info.product_id, info.command_count);
+
+    // Known devices get their flash size and the timings of their flash memory
+    const DeviceSpec *device = findDevice(info.product_id);
+    if (device != NULL) {
+        info.name = device->name;
+        info.flash_size = readFlashSize(uart_num, info, *device);
+        setOperationTimes(uart_num, &device->times);
+        logI(TAG_STM_PRO, "Device: %s, %lu KB flash", device->name, (unsigned long)(info.flash_size / 1024));
+
+        if (!info.supports(device->erase_command)) {
+            logW(TAG_STM_PRO, "Bootloader does not report the %s command of this device",
+                 (device->erase_command == CMD_EXT_ERASE) ? "EXTENDED ERASE" : "ERASE");
+        }
+    } else {
+        logW(TAG_STM_PRO, "Unknown device PID 0x%03X, using default flash size and timings", info.product_id);
+    }
+
+    if (!info.supports(CMD_WRITE)) {
+        logE(TAG_STM_PRO, "Bootloader does not support WRITE MEMORY (read protection active?)");
+        return stm32flash::ERROR_STM_COMMAND_UNSUPPORTED;
+    }
 
     logI(TAG_STM_PRO, "%s", "STM32 Setup Procedure Completed");
     return stm32flash::SUCCESS;
 }
 
+stm32flash::FlashStatus eraseSTM(uart_port_t uart_num, const DeviceInfo &info, const ErasePlan *plan)
+{
+    // Pick the erase variant the bootloader reports, instead of trying both
+    const bool extended = info.supports(CMD_EXT_ERASE);
+    if (!extended && !info.supports(CMD_ERASE)) {
+        logE(TAG_STM_PRO, "Bootloader does not support any erase command");
+        return stm32flash::ERROR_STM_COMMAND_UNSUPPORTED;
+    }
+
+    if (plan != NULL) {
+        if (!cmdErasePages(*plan, extended, uart_num)) {
+            return extended ? stm32flash::ERROR_EXT_ERASE_FAILED : stm32flash::ERROR_ERASE_FAILED;
+        }
+    } else if (extended) {
+        if (!cmdExtErase(uart_num)) return stm32flash::ERROR_EXT_ERASE_FAILED;
+    } else {
+        if (!cmdErase(uart_num)) return stm32flash::ERROR_ERASE_FAILED;
+    }
+    return stm32flash::SUCCESS;
+}
+
 int cmdSync(uart_port_t uart_num)
 {
     logI(TAG_STM_PRO, "%s", "SYNC");
 
     char bytes[] = {0x7F};
-    int resp = 1;
-    return sendBytes(bytes, sizeof(bytes), resp, uart_num);
+    uart_flush_input(uart_num);
+    sendData(TAG_STM_PRO, bytes, sizeof(bytes), uart_num);
+
+    // Short timeout: a bootloader that is not up yet never answers, there is no point in waiting for a full command timeout
+    uint8_t resp = 0;
+    if (waitForSerialData(&resp, 1, SYNC_TIMEOUT, uart_num) <= 0)
+    {
+        logD(TAG_STM_PRO, "%s", "Sync Timeout");
+        return 0;
+    }
+
+    // NACK: the bootloader already locked its baud rate on an earlier sync byte whose ACK was lost
+    if (resp != ACK && resp != NACK)
+    {
+        logE(TAG_STM_PRO, "Sync Failure (0x%02X)", resp);
+        return 0;
+    }
+    return 1;
 }
 
-int cmdGet(uart_port_t uart_num)
+int syncSTM(uart_port_t uart_num, int attempts)
+{
+    uint32_t backoff = SYNC_BACKOFF;
+    for (int i = 0; i < attempts; i++)
+    {
+        if (cmdSync(uart_num) == 1)
+        {
+            return 1;
+        }
+        vTaskDelay(pdMS_TO_TICKS(backoff) + 1);
+        backoff *= 2;
+    }
+    return 0;
+}
+
+int cmdGet(uart_port_t uart_num, DeviceInfo *info)
 {
     logI(TAG_STM_PRO, "%s", "GET");
 
     char bytes[] = {0x00, 0xFF};
-    int resp = 15;
-    return sendBytes(bytes, sizeof(bytes), resp, uart_num);
+    int resp = 1;
+    if (sendBytes(bytes, sizeof(bytes), resp, uart_num) != 1)
+    {
+        return 0;
+    }
+
+    // [version][command codes...]
+    uint8_t reply[256];
+    int length = readReply(reply, uart_num);
+    if (length < 1)
+    {
+        return 0;
+    }
+
+    if (info != NULL)
+    {
+        info->bootloader_version = reply[0];
+        info->command_count = MIN(length - 1, (int)sizeof(info->commands));
+        memcpy(info->commands, &reply[1], info->command_count);
+    }
+    return 1;
 }
 
-int cmdVersion(uart_port_t uart_num)
+int cmdVersion(uart_port_t uart_num, DeviceInfo *info)
 {
     logI(TAG_STM_PRO, "%s", "GET VERSION & READ PROTECTION STATUS");
 
     char bytes[] = {0x01, 0xFE};
-    int resp = 5;
-    return sendBytes(bytes, sizeof(bytes), resp, uart_num);
+    int resp = 1;
+    if (sendBytes(bytes, sizeof(bytes), resp, uart_num) != 1)
+    {
+        return 0;
+    }
+
+    // [version][option byte 1][option byte 2][ACK]
+    uint8_t reply[4];
+    if (waitForSerialData(reply, sizeof(reply), replyTimeout(uart_num, sizeof(reply), COMMAND_ALLOWANCE), uart_num) <= 0 || reply[3] != ACK)
+    {
+        logE(TAG_STM_PRO, "%s", "Invalid GET VERSION reply");
+        return 0;
+    }
+
+    if (info != NULL)
+    {
+        info->version = reply[0];
+        info->option_bytes[0] = reply[1];
+        info->option_bytes[1] = reply[2];
+    }
+    return 1;
 }
 
-int cmdId(uart_port_t uart_num)
+int cmdId(uart_port_t uart_num, DeviceInfo *info)
 {
     logI(TAG_STM_PRO, "%s", "CHECK ID");
     char bytes[] = {0x02, 0xFD};
-    int resp = 5;
-    return sendBytes(bytes, sizeof(bytes), resp, uart_num);
+    int resp = 1;
+    if (sendBytes(bytes, sizeof(bytes), resp, uart_num) != 1)
+    {
+        return 0;
+    }
+
+    // [PID MSB][PID LSB]
+    uint8_t reply[256];
+    int length = readReply(reply, uart_num);
+    if (length < 2)
+    {
+        return 0;
+    }
+
+    if (info != NULL)
+    {
+        info->product_id = (reply[0] << 8) | reply[1];
+    }
+    return 1;
 }
 
 int cmdErase(uart_port_t uart_num)
@@ -160,7 +440,7 @@ int cmdErase(uart_port_t uart_num)
         char params[] = {0xFF, 0x00};
         resp = 1;
 
-        return sendBytes(params, sizeof(params), resp, uart_num);
+        return sendBytes(params, sizeof(params), resp, uart_num, operationTimes(uart_num).mass_erase_ms, false);
     }
     return 0;
 }
@@ -177,14 +457,141 @@ int cmdExtErase(uart_port_t uart_num)
         char params[] = {0xFF, 0xFF, 0x00};
         resp = 1;
 
-        return sendBytes(params, sizeof(params), resp, uart_num);
+        return sendBytes(params, sizeof(params), resp, uart_num, operationTimes(uart_num).mass_erase_ms, false);
     }
     return 0;
 }
 
+int cmdErasePages(const ErasePlan &plan, bool extended, uart_port_t uart_num)
+{
+    if (plan.count == 0)
+    {
+        return 1;
+    }
+
+    // [N-1][page numbers][XOR], with 2-byte MSB-first fields for the extended variant
+    char params[2 + 2 * MAX_ERASE_PAGES + 1];
+    int length = 0;
+
+    if (extended)
+    {
+        logI(TAG_STM_PRO, "EXTENDED ERASE %d PAGES", plan.count);
+        params[length++] = (char)((plan.count - 1) >> 8);
+        params[length++] = (char)((plan.count - 1) & 0xFF);
+        for (int i = 0; i < plan.count; i++)
+        {
+            params[length++] = (char)(plan.pages[i] >> 8);
+            params[length++] = (char)(plan.pages[i] & 0xFF);
+        }
+    }
+    else
+    {
+        logI(TAG_STM_PRO, "ERASE %d PAGES", plan.count);
+        // N = 0xFF is the global erase code, so at most 255 single-byte page numbers fit
+        if (plan.count > 255)
+        {
+            logE(TAG_STM_PRO, "Too many pages for ERASE command");
+            return 0;
+        }
+        params[length++] = (char)(plan.count - 1);
+        for (int i = 0; i < plan.count; i++)
+        {
+            if (plan.pages[i] > 0xFF)
+            {
+                logE(TAG_STM_PRO, "Page %d out of range for ERASE command", plan.pages[i]);
+                return 0;
+            }
+            params[length++] = (char)plan.pages[i];
+        }
+    }
+    params[length] = (char)xorChecksum(params, length, 0);
+    length++;
+
+    static const char erase_bytes[] = {0x43, (char)0xBC};
+    static const char ext_erase_bytes[] = {0x44, (char)0xBB};
+    if (sendBytes(extended ? ext_erase_bytes : erase_bytes, 2, 1, uart_num) != 1)
+    {
+        return 0;
+    }
+    return sendBytes(params, length, 1, uart_num, plan.count * operationTimes(uart_num).page_erase_ms, false);
+}
+
+int FlashLayout::pageOf(uint32_t offset) const
+{
+    uint32_t first_page = 0;
+    for (int i = 0; i < MAX_LAYOUT_REGIONS && regions[i].count > 0; i++)
+    {
+        const uint64_t region_size = (uint64_t)regions[i].count * regions[i].size;
+        if (offset < region_size)
+        {
+            const uint32_t page = first_page + offset / regions[i].size;
+            return (page <= 0xFFFF) ? (int)page : -1;
+        }
+        offset -= region_size;
+        first_page += regions[i].count;
+    }
+    return -1;
+}
+
+uint32_t FlashLayout::pageEnd(int page) const
+{
+    uint64_t end = 0;
+    for (int i = 0; i < MAX_LAYOUT_REGIONS && regions[i].count > 0 && page >= 0; i++)
+    {
+        if ((uint32_t)page < regions[i].count)
+        {
+            end += (uint64_t)(page + 1) * regions[i].size;
+            return (end <= UINT32_MAX) ? (uint32_t)end : 0;
+        }
+        end += (uint64_t)regions[i].count * regions[i].size;
+        page -= regions[i].count;
+    }
+    return 0;
+}
+
+bool FlashLayout::isPage(int page) const
+{
+    for (int i = 0; i < MAX_LAYOUT_REGIONS && regions[i].count > 0 && page >= 0; i++)
+    {
+        if ((uint32_t)page < regions[i].count)
+        {
+            return regions[i].size > 0;
+        }
+        page -= regions[i].count;
+    }
+    return false;
+}
+
+bool planErase(ErasePlan &plan, uint32_t offset, uint32_t size, const FlashLayout &layout)
+{
+    plan.count = 0;
+    plan.layout = layout;
+    const int first_page = (size > 0) ? layout.pageOf(offset) : -1;
+    const int last_page = (size > 0) ? layout.pageOf(offset + size - 1) : -1;
+    if (first_page < 0 || last_page < 0)
+    {
+        logW(TAG_STM_PRO, "Range %lu+%lu lies outside the flash layout", (unsigned long)offset, (unsigned long)size);
+        return false;
+    }
+
+    for (int page = first_page; page <= last_page; page++)
+    {
+        if (!layout.isPage(page))
+        {
+            continue;
+        }
+        if (!plan.add((uint16_t)page))
+        {
+            logW(TAG_STM_PRO, "Image spans too many pages (%d) for a page erase", last_page - first_page + 1);
+            return false;
+        }
+    }
+    return true;
+}
+
 int cmdWrite(uart_port_t uart_num)
 {
-    logI(TAG_STM_PRO, "%s", "WRITE MEMORY");
+    logD(TAG_STM_PRO, "%s", "WRITE MEMORY");
     char bytes[2] = {0x31, 0xCE};
     int resp = 1;
     return sendBytes(bytes, sizeof(bytes), resp, uart_num);
@@ -192,12 +599,24 @@ int cmdWrite(uart_port_t uart_num)
 
 int cmdRead(uart_port_t uart_num)
 {
-    logI(TAG_STM_PRO, "%s", "READ MEMORY");
+    logD(TAG_STM_PRO, "%s", "READ MEMORY");
     char bytes[2] = {0x11, 0xEE};
     int resp = 1;
     return sendBytes(bytes, sizeof(bytes), resp, uart_num);
 }
 
+int cmdGo(uint32_t address, uart_port_t uart_num)
+{
+    logI(TAG_STM_PRO, "GO 0x%08lX", (unsigned long)address);
+    char bytes[2] = {0x21, 0xDE};
+    int resp = 1;
+    if (sendBytes(bytes, sizeof(bytes), resp, uart_num) != 1)
+    {
+        return 0;
+    }
+    return loadAddress(address, uart_num);
+}
+
 int loadAddress(const char adrMS, const char adrMI, const char adrLI, const char adrLS, uart_port_t uart_num)
 {
     char xor_ = adrMS ^ adrMI ^ adrLI ^ adrLS;
@@ -208,35 +627,68 @@ int loadAddress(const char adrMS, const char adrMI, const char adrLI, const char
     return sendBytes(params, sizeof(params), resp, uart_num);
 }
 
-int sendBytes(const char *bytes, int count, int resp, uart_port_t uart_num)
+int sendBytes(const char *bytes, int count, int resp, uart_port_t uart_num, uint32_t allowance_ms, bool record_latency)
 {
+    // Drop any stale bytes so the reply is not mixed with a previous one
+    uart_flush_input(uart_num);
     sendData(TAG_STM_PRO, bytes, count, uart_num);
-    int length = waitForSerialData(resp, SERIAL_TIMEOUT, uart_num);
+    const int64_t sent_at = esp_timer_get_time();
 
-    if (length > 0) {
-        
-        uint8_t data[length];
-        const int rxBytes = uart_read_bytes(uart_num, data, length, 1000 / portTICK_RATE_MS);
+    uint8_t data[resp];
+    int length = waitForSerialData(data, 1, replyTimeout(uart_num, count + 1, allowance_ms), uart_num);
+    if (length <= 0)
+    {
+        logE(TAG_STM_PRO, "%s", "Serial Timeout");
+        return 0;
+    }
 
-        if (rxBytes > 0 && data[0] == ACK)
-        {
-            logI(TAG_STM_PRO, "%s", "Sync Success");
-            // ESP_LOG_BUFFER_HEXDUMP("SYNC", data, rxBytes, ESP_LOG_DEBUG);
-            return 1;
-        }
-        else
-        {
-            logE(TAG_STM_PRO, "%s", "Sync Failure");
-            return 0;
-        }
+    if (data[0] != ACK)
+    {
+        logE(TAG_STM_PRO, "%s", "Sync Failure");
+        return 0;
     }
-    else
+    if (record_latency)
+    {
+        recordAck(uart_num, sent_at);
+    }
+
+    // The rest of the reply only follows an ACK, so a NACK fails without waiting for it
+    if (resp > 1 && waitForSerialData(&data[1], resp - 1, replyTimeout(uart_num, resp - 1, COMMAND_ALLOWANCE), uart_num) <= 0)
     {
         logE(TAG_STM_PRO, "%s", "Serial Timeout");
         return 0;
     }
 
-    return 0;
+    logD(TAG_STM_PRO, "%s", "Sync Success");
+    // ESP_LOG_BUFFER_HEXDUMP("SYNC", data, resp, ESP_LOG_DEBUG);
+    return 1;
+}
+
+int readReply(uint8_t *data, uart_port_t uart_num)
+{
+    // [N][N+1 bytes][ACK]
+    uint8_t n = 0;
+    if (waitForSerialData(&n, 1, replyTimeout(uart_num, 1, COMMAND_ALLOWANCE), uart_num) <= 0)
+    {
+        logE(TAG_STM_PRO, "%s", "Serial Timeout");
+        return 0;
+    }
+
+    const int length = n + 1;
+    uint8_t ack = 0;
+    if (waitForSerialData(data, length, replyTimeout(uart_num, length, COMMAND_ALLOWANCE), uart_num) <= 0 ||
+        waitForSerialData(&ack, 1, replyTimeout(uart_num, 1, COMMAND_ALLOWANCE), uart_num) <= 0)
+    {
+        logE(TAG_STM_PRO, "%s", "Serial Timeout");
+        return 0;
+    }
+
+    if (ack != ACK)
+    {
+        logE(TAG_STM_PRO, "%s", "Reply not acknowledged");
+        return 0;
+    }
+    return length;
 }
 
 int sendData(const char *logName, const char *data, const int count, uart_port_t uart_num)
@@ -245,153 +697,283 @@ int sendData(const char *logName, const char *data, const int count, uart_port_t
     return txBytes;
 }
 
-int waitForSerialData(int dataCount, int timeout, uart_port_t uart_num)
+int sendFrame(const char *data, int count, uart_port_t uart_num)
 {
-    int timer = 0;
-    int length = 0;
-    while (timer < timeout)
+    return sendFrame(data, count, xorChecksum(data, count, (uint8_t)(count - 1)), uart_num);
+}
+
+int sendFrame(const char *data, int count, uint8_t checksum, uart_port_t uart_num)
+{
+    if (count < 1 || count > BLOCK_SIZE)
     {
-        uart_get_buffered_data_len(uart_num, (size_t *)&length);
-        if (length >= dataCount)
-        {
-            return length;
-        }
-        vTaskDelay(1 / portTICK_PERIOD_MS);
-        timer++;
+        return 0;
     }
-    return 0;
+
+    // [N-1][N bytes of payload][XOR of N-1 and payload], sent as a single transfer
+    char frame[BLOCK_SIZE + 2];
+    frame[0] = (char)(count - 1);
+    memcpy(&frame[1], data, count);
+    frame[count + 1] = (char)checksum;
+
+    return sendData(TAG_STM_PRO, frame, count + 2, uart_num);
 }
 
-void incrementLoadAddress(char *loadAddr)
+uint8_t xorChecksum(const char *data, int count, uint8_t seed)
 {
-    loadAddr[2] += 0x1;
+    // XOR whole words first, then fold the 4 lanes into a single byte
+    uint32_t acc = 0;
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        uint32_t word;
+        memcpy(&word, &data[i], sizeof(word));
+        acc ^= word;
+    }
+    acc ^= acc >> 16;
+    acc ^= acc >> 8;
 
-    if (loadAddr[2] == 0)
+    uint8_t xor_ = seed ^ (uint8_t)acc;
+    for (; i < count; i++)
     {
-        loadAddr[1] += 0x1;
+        xor_ ^= (uint8_t)data[i];
+    }
+    return xor_;
+}
 
-        if (loadAddr[1] == 0)
+bool isBlockBlank(const char *data, int count)
+{
+    // Erased flash reads as 0xFF, compare whole words first
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        uint32_t word;
+        memcpy(&word, &data[i], sizeof(word));
+        if (word != 0xFFFFFFFF)
+        {
+            return false;
+        }
+    }
+    for (; i < count; i++)
+    {
+        if ((uint8_t)data[i] != 0xFF)
         {
-            loadAddr[0] += 0x1;
+            return false;
         }
     }
+    return true;
 }
 
-esp_err_t flashPage(const char *address, const char *data, uart_port_t uart_num)
+bool blocksEqual(const char *a, const char *b, int count)
 {
-    logI(TAG_STM_PRO, "%s", "Flashing Page");
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        uint32_t word_a, word_b;
+        memcpy(&word_a, &a[i], sizeof(word_a));
+        memcpy(&word_b, &b[i], sizeof(word_b));
+        if (word_a != word_b)
+        {
+            return false;
+        }
+    }
+    for (; i < count; i++)
+    {
+        if (a[i] != b[i])
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+int waitForSerialData(uint8_t *data, int dataCount, int timeout, uart_port_t uart_num)
+{
+    // uart_read_bytes() returns as soon as dataCount bytes are in, the timeout only bounds a failure.
+    // One extra tick keeps short timeouts from rounding down to a non-blocking read.
+    const TickType_t ticks = pdMS_TO_TICKS(timeout) + 1;
+    const int rxBytes = uart_read_bytes(uart_num, data, dataCount, ticks);
+    return (rxBytes == dataCount) ? rxBytes : 0;
+}
+
+int loadAddress(uint32_t address, uart_port_t uart_num)
+{
+    return loadAddress((char)(address >> 24), (char)(address >> 16), (char)(address >> 8), (char)address, uart_num);
+}
+
+esp_err_t flashPage(uint32_t address, const char *data, uart_port_t uart_num)
+{
+    return flashPage(address, data, xorChecksum(data, BLOCK_SIZE, (uint8_t)(BLOCK_SIZE - 1)), uart_num);
+}
+
+esp_err_t flashPage(uint32_t address, const char *data, uint8_t checksum, uart_port_t uart_num)
+{
+    return writeMemory(address, data, BLOCK_SIZE, checksum, uart_num);
+}
+
+esp_err_t writeMemory(uint32_t address, const char *data, int count, uart_port_t uart_num)
+{
+    return writeMemory(address, data, count, xorChecksum(data, count, (uint8_t)(count - 1)), uart_num);
+}
+
+esp_err_t writeMemory(uint32_t address, const char *data, int count, uint8_t checksum, uart_port_t uart_num)
+{
+    logD(TAG_STM_PRO, "%s", "Flashing Page");
 
     if (cmdWrite(uart_num) != 1) {
         logE(TAG_STM_PRO, "Write command failed");
         return ESP_FAIL;
     }
 
-    if (loadAddress(address[0], address[1], address[2], address[3], uart_num) != 1) {
+    if (loadAddress(address, uart_num) != 1) {
         logE(TAG_STM_PRO, "Load address failed");
         return ESP_FAIL;
     }
 
     //ESP_LOG_BUFFER_HEXDUMP("FLASH PAGE", data, 256, ESP_LOG_DEBUG);
 
-    char xor_ = 0xFF;
-    char sz = 0xFF;
-
-    sendData(TAG_STM_PRO, &sz, 1, uart_num);
-
-    for (int i = 0; i < 256; i++)
-    {
-        sendData(TAG_STM_PRO, &data[i], 1, uart_num);
-        xor_ ^= data[i];
+    if (sendFrame(data, count, checksum, uart_num) != count + 2) {
+        logE(TAG_STM_PRO, "Failed to send page data");
+        return ESP_FAIL;
     }
 
-    sendData(TAG_STM_PRO, &xor_, 1, uart_num);
-
-    int length = waitForSerialData(1, SERIAL_TIMEOUT, uart_num);
-    if (length > 0)
+    // The ACK comes once the block is programmed
+    uint8_t resp = 0;
+    if (waitForSerialData(&resp, 1, replyTimeout(uart_num, count + 3, operationTimes(uart_num).write_ms), uart_num) <= 0)
     {
-        uint8_t data[length];
-        const int rxBytes = uart_read_bytes(uart_num, data, length, 1000 / portTICK_RATE_MS);
-        if (rxBytes > 0 && data[0] == ACK)
-        {
-            logI(TAG_STM_PRO, "%s", "Flash Success");
-            return ESP_OK;
-        }
-        else
-        {
-            logE(TAG_STM_PRO, "%s", "Flash Failure");
-            return ESP_FAIL;
-        }
+        logE(TAG_STM_PRO, "%s", "Serial Timeout");
+        return ESP_FAIL;
     }
-    else
+
+    if (resp != ACK)
     {
-        logE(TAG_STM_PRO, "%s", "Serial Timeout");
+        logE(TAG_STM_PRO, "%s", "Flash Failure");
+        return ESP_FAIL;
     }
-    return ESP_FAIL;
+
+    logD(TAG_STM_PRO, "%s", "Flash Success");
+    return ESP_OK;
 }
 
-esp_err_t readPage(const char *address, const char *data, uart_port_t uart_num)
+esp_err_t readPage(uint32_t address, char *data, uart_port_t uart_num)
 {
-    logI(TAG_STM_PRO, "%s", "Reading page");
-    char param[] = {0xFF, 0x00};
+    return readMemory(address, data, BLOCK_SIZE, uart_num);
+}
 
-    cmdRead(uart_num);
+esp_err_t readMemory(uint32_t address, char *data, int count, uart_port_t uart_num)
+{
+    logD(TAG_STM_PRO, "%s", "Reading page");
+    if (count < 1 || count > BLOCK_SIZE)
+    {
+        return ESP_FAIL;
+    }
+    char param[] = {(char)(count - 1), (char)~(count - 1)};
 
-    loadAddress(address[0], address[1], address[2], address[3], uart_num);
+    if (cmdRead(uart_num) != 1) {
+        logE(TAG_STM_PRO, "Read command failed");
+        return ESP_FAIL;
+    }
+
+    if (loadAddress(address, uart_num) != 1) {
+        logE(TAG_STM_PRO, "Load address failed");
+        return ESP_FAIL;
+    }
 
     sendData(TAG_STM_PRO, param, sizeof(param), uart_num);
-    int length = waitForSerialData(257, SERIAL_TIMEOUT, uart_num);
-    if (length > 0)
-    {
-        uint8_t uart_data[length];
-        const int rxBytes = uart_read_bytes(uart_num, uart_data, length, 1000 / portTICK_RATE_MS);
+    const int64_t sent_at = esp_timer_get_time();
 
-        if (rxBytes > 0 && uart_data[0] == 0x79)
-        {
-            logI(TAG_STM_PRO, "%s", "Success");
-            if (!memcpy((void *)data, uart_data, 257))
-            {
-                return ESP_FAIL;
-            }
+    uint8_t resp = 0;
+    if (waitForSerialData(&resp, 1, replyTimeout(uart_num, sizeof(param) + 1, COMMAND_ALLOWANCE), uart_num) <= 0)
+    {
+        logE(TAG_STM_PRO, "%s", "Serial Timeout");
+        return ESP_FAIL;
+    }
 
-            //ESP_LOG_BUFFER_HEXDUMP("READ MEMORY", data, rxBytes, ESP_LOG_DEBUG);
-        }
-        else
-        {
-            logE(TAG_STM_PRO, "%s", "Failure");
-            return ESP_FAIL;
-        }
+    if (resp != ACK)
+    {
+        logE(TAG_STM_PRO, "%s", "Failure");
+        return ESP_FAIL;
     }
-    else
+    recordAck(uart_num, sent_at);
+
+    // The page data follows the ACK and lands directly in the caller's buffer
+    if (waitForSerialData((uint8_t *)data, count, replyTimeout(uart_num, count, operationTimes(uart_num).read_ms), uart_num) <= 0)
     {
         logE(TAG_STM_PRO, "%s", "Serial Timeout");
         return ESP_FAIL;
     }
 
+    logD(TAG_STM_PRO, "%s", "Success");
+    //ESP_LOG_BUFFER_HEXDUMP("READ MEMORY", data, count, ESP_LOG_DEBUG);
     return ESP_OK;
 }
 
-stm32flash::FlashStatus isSTMPresent(gpio_num_t reset_pin, uart_port_t uart_num) {
+stm32flash::FlashStatus isSTMPresent(gpio_num_t reset_pin, uart_port_t uart_num, const FlashConfig &config, DeviceInfo *info) {
     logI(TAG_STM_PRO, "Checking STM32 presence...");
-    
-    // Reset (STM should already be set in BOOT0 mode)
-    resetSTM(reset_pin);
-    
-    // Essayer de synchroniser plusieurs fois
-    for(int i = 0; i < 3; i++) {
-        if(cmdSync(uart_num) == 1) {
-            if(cmdGet(uart_num) == 1) {
-                logI(TAG_STM_PRO, "STM32 detected in bootloader mode!");
+    const uint32_t baud_rate = config.baud_rate;
+    const BaudMode baud_mode = config.baud_mode;
+
+    // In fixed mode the only candidate is the configured rate, in probe mode it is tried first
+    // and followed by the standard rates below it
+    const int probe_count = sizeof(PROBE_BAUD_RATES) / sizeof(PROBE_BAUD_RATES[0]);
+    for (int r = -1; r < probe_count; r++) {
+        uint32_t rate = baud_rate;
+        if (r >= 0) {
+            if (baud_mode != BAUD_PROBE) break;
+            rate = PROBE_BAUD_RATES[r];
+            if (rate >= baud_rate) continue;
+        }
+
+        if (uart_set_baudrate(uart_num, rate) != ESP_OK) {
+            logE(TAG_STM_PRO, "Failed to set UART baud rate to %lu", (unsigned long)rate);
+            continue;
+        }
+        logI(TAG_STM_PRO, "Trying %lu baud", (unsigned long)rate);
+
+        // The bootloader started by setFlashMode is still waiting for its first sync byte: try it as-is,
+        // and only reset (STM should already be set in BOOT0 mode) if it does not answer. The bootloader
+        // autobauds on the first sync byte, so every other rate needs a fresh reset.
+        for (int pass = (r < 0) ? 0 : 1; pass < 2; pass++) {
+            if (pass == 1) {
+                resetSTM(reset_pin, config.reset_pulse_ms, config.reset_settle_ms);
+            }
+            if (syncSTM(uart_num) == 1 && cmdGet(uart_num, info) == 1) {
+                logI(TAG_STM_PRO, "STM32 detected in bootloader mode at %lu baud!", (unsigned long)rate);
                 return stm32flash::SUCCESS;
             }
         }
-        vTaskDelay(100 / portTICK_PERIOD_MS);
     }
     
     logE(TAG_STM_PRO, "No STM32 detected or not in bootloader mode!");
     return stm32flash::ERROR_STM_NOT_FOUND;
 }
 
-stm32flash::FlashStatus setFlashMode(gpio_num_t reset_pin, gpio_num_t boot0_pin, uart_port_t uart_num, bool enter_flash_mode) {
+stm32flash::FlashStatus goSTM(gpio_num_t boot0_pin, uart_port_t uart_num, bool boot0_shared, uint32_t address) {
+
+    // BOOT0 is only sampled at reset: drop it before jumping so that the next reset boots from flash.
+    // A BOOT0 shared with a UART pin can only be dropped once the UART has been released.
+    if (!boot0_shared) {
+        gpio_set_level(boot0_pin, LOW);
+    }
+
+    if (cmdGo(address, uart_num) != 1) {
+        logE(TAG_STM_PRO, "GO command failed");
+        return stm32flash::ERROR_GO_FAILED;
+    }
+
+    // Release the UART to the user, the application is already running
+    uart_driver_delete(uart_num);
+    if (boot0_shared) {
+        gpio_reset_pin(boot0_pin);
+        gpio_set_direction(boot0_pin, GPIO_MODE_OUTPUT);
+        gpio_set_level(boot0_pin, LOW);
+    }
+
+    logI(TAG_STM_PRO, "STM32 started at 0x%08lX", (unsigned long)address);
+    return stm32flash::SUCCESS;
+}
+
+stm32flash::FlashStatus setFlashMode(gpio_num_t reset_pin, gpio_num_t boot0_pin, uart_port_t uart_num, bool enter_flash_mode,
+                                     uint32_t reset_pulse_ms, uint32_t reset_settle_ms) {
     
     // Delete any existing UART driver to be sure both control pins are free (if using shared BOOT0/UART pins)
     uart_driver_delete(uart_num);
@@ -410,7 +992,7 @@ stm32flash::FlashStatus setFlashMode(gpio_num_t reset_pin, gpio_num_t boot0_pin,
     // Flash mode sequence
     gpio_set_level(boot0_pin, enter_flash_mode ? HIGH : LOW);
     vTaskDelay(10 / portTICK_PERIOD_MS);
-    resetSTM(reset_pin);
+    resetSTM(reset_pin, reset_pulse_ms, reset_settle_ms);
 
     logI(TAG_STM_PRO, "STM32 %s flash mode", enter_flash_mode ? "entered" : "exited");
     return stm32flash::SUCCESS;
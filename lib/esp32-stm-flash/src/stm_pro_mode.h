@@ -17,11 +17,15 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/event_groups.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
 
 #include "driver/uart.h"
 #include "driver/gpio.h"
 
 #include "esp_err.h"
+#include "esp_rom_crc.h"
+#include "esp_timer.h"
 #include "esp_vfs.h"
 #include "esp_system.h"
 #include "esp_spiffs.h"
@@ -30,6 +34,7 @@
 #include "esp_wifi.h"
 #include "esp_http_server.h"
 
+#include "nvs.h"
 #include "nvs_flash.h"
 
 #include "STM32Flasher.h"
@@ -39,34 +44,174 @@ namespace internal {
 
 #define UART_BAUD_RATE 115200
 #define UART_BUF_SIZE 1024
+#define BLOCK_SIZE 256 // Max payload of a single WRITE/READ MEMORY command
 
 #define ACK 0x79
-#define SERIAL_TIMEOUT 5000
+#define NACK 0x1F
+#define COMMAND_ALLOWANCE 10 // ms, bootloader turnaround of a command or of its parameters
+#define TIMEOUT_MARGIN 2 // ms, added to every reply timeout
+#define SYNC_TIMEOUT 20 // ms, the bootloader answers a sync byte within a few bit times
+#define SYNC_ATTEMPTS 6 // Backoff between attempts doubles from SYNC_BACKOFF
+#define SYNC_BACKOFF 10 // ms
+#define RESYNC_TIMEOUT 5 // ms, bootloader turnaround of a NACK
+#define RESYNC_FILLER 0x02
+#define RESYNC_CHUNK 64 // Filler bytes sent between checks for a NACK
+// Longest frame that filler bytes can complete: an EXTENDED ERASE of N = 0x0202, i.e. 515 page numbers
+#define RESYNC_MAX_FRAME (2 + 2 * (((RESYNC_FILLER << 8) | RESYNC_FILLER) + 1) + 1)
 
 #define FILE_PATH_MAX 128
 #define BASE_PATH "/spiffs/"
-#define MAX_FLASH_SIZE 32768 // 32KB
+#define FLASH_BASE_ADDRESS 0x08000000
+#define FLASH_END_ADDRESS 0x08200000 // End of the largest main flash memory in the device table (2MB)
+#define MAX_FLASH_SIZE 32768 // 32KB, for a device missing from the device table
+#define MAX_ERASE_PAGES 512
+#define MAX_LAYOUT_REGIONS 6
+#define DEVICE_UID_SIZE 12 // Bytes of the unique device ID
+
+//Worst-case time the bootloader spends on each operation, on top of the UART transfer time (ms)
+struct OperationTimes {
+    uint32_t write_ms;      // Programming of one WRITE MEMORY block
+    uint32_t read_ms;       // Start of a READ MEMORY reply
+    uint32_t page_erase_ms; // Per erased page
+    uint32_t mass_erase_ms;
+};
+
+//Allowances for an unidentified device, large enough for the slowest supported families
+static constexpr OperationTimes DEFAULT_OPERATION_TIMES = {100, 20, 500, 30000};
+
+//Latency of the command ACKs of the bootloader on a UART, from the command being queued to its ACK (us).
+//Erase and write ACKs, which wait for the flash to be programmed, are not counted.
+struct AckStats {
+    uint32_t count;
+    uint32_t min_us;
+    uint32_t max_us;
+    uint64_t total_us;
+};
+
+//Erase geometry of the flash memory from FLASH_BASE_ADDRESS: runs of equally sized pages (or sectors),
+//numbered as the erase commands expect them. Unused regions have a count of 0. A region of size 0 holds
+//page numbers without flash behind them, e.g. those skipped before the second bank of an STM32G0B.
+struct FlashLayout {
+    struct Region {
+        uint32_t count; // Pages in the region
+        uint32_t size;  // Bytes per page
+    };
+    Region regions[MAX_LAYOUT_REGIONS];
+
+    //Layout of uniform pages, as large as page numbers go
+    static constexpr FlashLayout uniform(uint32_t page_size) {
+        return {{{0xFFFF, page_size}}};
+    }
+
+    bool isValid() const {
+        return regions[0].count > 0 && regions[0].size > 0;
+    }
+
+    bool operator==(const FlashLayout &other) const {
+        return memcmp(regions, other.regions, sizeof(regions)) == 0;
+    }
+
+    //Page holding an offset from the start of flash, -1 beyond the last page
+    int pageOf(uint32_t offset) const;
+
+    //Offset of the end of a page (exclusive), 0 for an invalid page
+    uint32_t pageEnd(int page) const;
+
+    //Check if a page number names flash memory (and not a skipped number)
+    bool isPage(int page) const;
+
+    //Offset of the start of a page
+    uint32_t pageStart(int page) const {
+        return (page > 0) ? pageEnd(page - 1) : 0;
+    }
+
+    //Check if an offset is the end of a page
+    bool isPageEnd(uint32_t offset) const {
+        const int page = (offset > 0) ? pageOf(offset - 1) : -1;
+        return page >= 0 && pageEnd(page) == offset;
+    }
+
+    //Check if all pages are made of whole blocks
+    bool isBlockAligned() const {
+        for (int i = 0; i < MAX_LAYOUT_REGIONS; i++) {
+            if (regions[i].count > 0 && regions[i].size % BLOCK_SIZE != 0) return false;
+        }
+        return true;
+    }
+};
+
+//List of flash pages to erase, as page numbers
+struct ErasePlan {
+    FlashLayout layout = {};
+    uint16_t count = 0;
+    uint16_t pages[MAX_ERASE_PAGES];
+
+    bool contains(uint16_t page) const {
+        for (int i = 0; i < count; i++) {
+            if (pages[i] == page) return true;
+        }
+        return false;
+    }
+
+    //Check if an offset from the start of flash lies in one of the planned pages
+    bool covers(uint32_t offset) const {
+        const int page = layout.pageOf(offset);
+        return page >= 0 && contains((uint16_t)page);
+    }
+
+    bool add(uint16_t page) {
+        if (count >= MAX_ERASE_PAGES) return false;
+        pages[count++] = page;
+        return true;
+    }
+
+    //Bytes of flash memory erased by the plan
+    uint32_t size() const {
+        uint32_t total = 0;
+        for (int i = 0; i < count; i++) {
+            total += layout.pageEnd(pages[i]) - layout.pageStart(pages[i]);
+        }
+        return total;
+    }
+
+    //Drop a page from the plan, e.g. one whose contents are left untouched
+    void remove(uint16_t page) {
+        for (int i = 0; i < count; i++) {
+            if (pages[i] == page) {
+                memmove(&pages[i], &pages[i + 1], (count - i - 1) * sizeof(pages[0]));
+                count--;
+                return;
+            }
+        }
+    }
+};
 
 //Initialize UART functionalities
-stm32flash::FlashStatus initFlashUART(uart_port_t uart_num, gpio_num_t tx, gpio_num_t rx);
+stm32flash::FlashStatus initFlashUART(uart_port_t uart_num, gpio_num_t tx, gpio_num_t rx, uint32_t baud_rate = UART_BAUD_RATE);
 
 //Initialize SPIFFS functionalities
 stm32flash::FlashStatus initSPIFFS(void);
 
-//Increment the memory address for the next write operation
-void incrementLoadAddress(char *loadAddr);
-
 //Get in sync with STM32Fxx
 int cmdSync(uart_port_t uart_num);
 
+//Get in sync with STM32Fxx, retrying with an exponential backoff while the bootloader starts up
+int syncSTM(uart_port_t uart_num, int attempts = SYNC_ATTEMPTS);
+
+//Bring the bootloader back to its command state after a failed command (NACK, timeout, lost bytes)
+int resyncSTM(uart_port_t uart_num);
+
+//Pulse the reset pin of STM32Fxx, then wait for the firmware or bootloader to start
+void resetSTM(gpio_num_t reset_pin, uint32_t pulse_ms, uint32_t settle_ms);
+
 //Get the version and the allowed commands supported by the current version of the bootloader
-int cmdGet(uart_port_t uart_num);
+int cmdGet(uart_port_t uart_num, DeviceInfo *info = NULL);
 
 //Get the bootloader version and the Read Protection status of the Flash memory
-int cmdVersion(uart_port_t uart_num);
+int cmdVersion(uart_port_t uart_num, DeviceInfo *info = NULL);
 
 //Get the chip ID
-int cmdId(uart_port_t uart_num);
+int cmdId(uart_port_t uart_num, DeviceInfo *info = NULL);
 
 //Erase from one to all the Flash memory pages
 int cmdErase(uart_port_t uart_num);
@@ -74,8 +219,21 @@ int cmdErase(uart_port_t uart_num);
 //Erases from one to all the Flash memory pages using 2-byte addressing mode
 int cmdExtErase(uart_port_t uart_num);
 
-//Setup STM32Fxx for the 'flashing' process
-stm32flash::FlashStatus setupSTM(gpio_num_t reset_pin, uart_port_t uart_num);
+//Erase the pages listed in an erase plan with a single ERASE (extended = false) or EXTENDED ERASE command
+int cmdErasePages(const ErasePlan &plan, bool extended, uart_port_t uart_num);
+
+//Build an erase plan covering size bytes of flash memory, from offset (relative to FLASH_BASE_ADDRESS)
+bool planErase(ErasePlan &plan, uint32_t offset, uint32_t size, const FlashLayout &layout);
+
+//Setup STM32Fxx for the 'flashing' process, completing the device capabilities (the session must be open, see isSTMPresent).
+//Known devices get their flash size and operation times from the device table.
+stm32flash::FlashStatus setupSTM(uart_port_t uart_num, DeviceInfo &info);
+
+//Read the 96-bit unique ID of a known device, false if the device has none or it cannot be read (e.g. read protection)
+bool readDeviceUid(uart_port_t uart_num, const DeviceInfo &info, uint8_t uid[DEVICE_UID_SIZE]);
+
+//Erase the pages of the plan with the erase command supported by the bootloader (mass erase when no plan is given)
+stm32flash::FlashStatus eraseSTM(uart_port_t uart_num, const DeviceInfo &info, const ErasePlan *plan = NULL);
 
 //Write data to flash memory address
 int cmdWrite(uart_port_t uart_num);
@@ -83,29 +241,75 @@ int cmdWrite(uart_port_t uart_num);
 //Read data from flash memory address
 int cmdRead(uart_port_t uart_num);
 
-//UART send data to STM32Fxx & wait for response
-int sendBytes(const char *bytes, int count, int resp, uart_port_t uart_num);
+//Jump to the code at the given address
+int cmdGo(uint32_t address, uart_port_t uart_num);
+
+//Set the operation allowances of the device on a UART (NULL for DEFAULT_OPERATION_TIMES), times must outlive the session
+void setOperationTimes(uart_port_t uart_num, const OperationTimes *times);
+const OperationTimes &operationTimes(uart_port_t uart_num);
+
+//Clear the ACK latency statistics of a UART (done by initFlashUART for every new session)
+void resetAckStats(uart_port_t uart_num);
+const AckStats &ackStats(uart_port_t uart_num);
+
+//Timeout of a reply: transfer time of bytes (both ways) at the current baud rate, plus the operation allowance (ms)
+int replyTimeout(uart_port_t uart_num, int bytes, uint32_t allowance_ms);
+
+//UART send data to STM32Fxx & wait for response, within the transfer time plus allowance_ms.
+//record_latency adds the ACK to the ACK statistics: off for ACKs that wait for the flash (erase).
+int sendBytes(const char *bytes, int count, int resp, uart_port_t uart_num, uint32_t allowance_ms = COMMAND_ALLOWANCE,
+              bool record_latency = true);
+
+//Read a variable length reply ([N][N+1 bytes][ACK]) from STM32Fxx, returns the number of data bytes
+int readReply(uint8_t *data, uart_port_t uart_num);
 
 //UART send data byte-by-byte to STM32Fxx
 int sendData(const char *logName, const char *data, const int count, uart_port_t uart_num);
 
-//Wait for response from STM32Fxx
-int waitForSerialData(int dataCount, int timeout, uart_port_t uart_num);
+//UART send a data frame (length byte, payload, XOR checksum) to STM32Fxx in a single transfer
+int sendFrame(const char *data, int count, uart_port_t uart_num);
+int sendFrame(const char *data, int count, uint8_t checksum, uart_port_t uart_num);
+
+//Compute the XOR checksum of a data block, word-at-a-time
+uint8_t xorChecksum(const char *data, int count, uint8_t seed);
+
+//Check if a data block is all 0xFF (what erased flash already reads), word-at-a-time
+bool isBlockBlank(const char *data, int count);
+
+//Compare two data blocks, word-at-a-time
+bool blocksEqual(const char *a, const char *b, int count);
+
+//Wait for an exact number of response bytes from STM32Fxx (blocking read, timeout in ms)
+int waitForSerialData(uint8_t *data, int dataCount, int timeout, uart_port_t uart_num);
 
 //Send the STM32Fxx the memory address, to be written
 int loadAddress(const char adrMS, const char adrMI, const char adrLI, const char adrLS, uart_port_t uart_num);
+int loadAddress(uint32_t address, uart_port_t uart_num);
 
 //UART write the flash memory address of the STM32Fxx with blocks of data 
-esp_err_t flashPage(const char *address, const char *data, uart_port_t uart_num);
+esp_err_t flashPage(uint32_t address, const char *data, uart_port_t uart_num);
+esp_err_t flashPage(uint32_t address, const char *data, uint8_t checksum, uart_port_t uart_num);
+
+//UART write count bytes (1 to BLOCK_SIZE, a multiple of 4, or of 8 on families programmed by double words) to the memory address of the STM32Fxx
+esp_err_t writeMemory(uint32_t address, const char *data, int count, uart_port_t uart_num);
+esp_err_t writeMemory(uint32_t address, const char *data, int count, uint8_t checksum, uart_port_t uart_num);
+
+//UART read a block of data (BLOCK_SIZE bytes) from the flash memory address of the STM32Fxx
+esp_err_t readPage(uint32_t address, char *data, uart_port_t uart_num);
+
+//UART read count bytes (1 to BLOCK_SIZE) from the memory address of the STM32Fxx
+esp_err_t readMemory(uint32_t address, char *data, int count, uart_port_t uart_num);
 
-//UART read the flash memory address of the STM32Fxx and verify with the given block of data 
-esp_err_t readPage(const char *address, const char *data, uart_port_t uart_num);
+//Check if STM32 is present and in bootloader mode, negotiating the baud rate in BAUD_PROBE mode.
+//Opens the bootloader session started by setFlashMode (only resets again if that fails) and fills the GET capabilities.
+stm32flash::FlashStatus isSTMPresent(gpio_num_t reset_pin, uart_port_t uart_num, const FlashConfig &config, DeviceInfo *info = NULL);
 
-//Check if STM32 is present and in bootloader mode
-stm32flash::FlashStatus isSTMPresent(gpio_num_t reset_pin, uart_port_t uart_num);
+//Start the code at address with the GO command, dropping BOOT0 and releasing the UART (no reset)
+stm32flash::FlashStatus goSTM(gpio_num_t boot0_pin, uart_port_t uart_num, bool boot0_shared, uint32_t address = FLASH_BASE_ADDRESS);
 
 //Nouvelle fonction pour gérer l'état du STM32
-stm32flash::FlashStatus setFlashMode(gpio_num_t reset_pin, gpio_num_t boot0_pin, uart_port_t uart_num, bool enter_flash_mode);
+stm32flash::FlashStatus setFlashMode(gpio_num_t reset_pin, gpio_num_t boot0_pin, uart_port_t uart_num, bool enter_flash_mode,
+                                     uint32_t reset_pulse_ms, uint32_t reset_settle_ms);
 
 } // namespace internal
 } // namespace stm32flash
@@ -0,0 +1,16 @@
+#ifndef _HOST_ARDUINO_H
+#define _HOST_ARDUINO_H
+
+// Host shim: the few Arduino definitions used by the library, and the C headers Arduino.h brings in
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/stat.h>
+
+#define LOW 0
+#define HIGH 1
+
+#endif
@@ -0,0 +1,6 @@
+#ifndef _HOST_ESP_EVENT_H
+#define _HOST_ESP_EVENT_H
+
+// Host shim: included by the library, nothing used from it
+
+#endif
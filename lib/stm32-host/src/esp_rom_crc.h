@@ -0,0 +1,9 @@
+#ifndef _HOST_ESP_ROM_CRC_H
+#define _HOST_ESP_ROM_CRC_H
+
+#include <stdint.h>
+
+// CRC32 (zlib polynomial), same chaining as the ROM function: crc is the result of the previous call, 0 to start
+uint32_t esp_rom_crc32_le(uint32_t crc, uint8_t const *buf, uint32_t len);
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef _HOST_ESP_SPIFFS_H
+#define _HOST_ESP_SPIFFS_H
+
+// Host shim of SPIFFS: the host has no SPIFFS partition, mounting fails with ESP_ERR_NOT_FOUND.
+// Images are given to the library in memory or as data partitions (see stm32host::addPartition).
+
+#include "esp_err.h"
+#include <stddef.h>
+
+typedef struct {
+    const char *base_path;
+    const char *partition_label;
+    size_t max_files;
+    bool format_if_mount_failed;
+} esp_vfs_spiffs_conf_t;
+
+esp_err_t esp_vfs_spiffs_register(const esp_vfs_spiffs_conf_t *conf);
+bool esp_spiffs_mounted(const char *partition_label);
+esp_err_t esp_spiffs_info(const char *partition_label, size_t *total_bytes, size_t *used_bytes);
+esp_err_t esp_spiffs_format(const char *partition_label);
+
+#endif
@@ -0,0 +1,6 @@
+#ifndef _HOST_ESP_VFS_H
+#define _HOST_ESP_VFS_H
+
+// Host shim: included by the library, nothing used from it
+
+#endif
@@ -0,0 +1,6 @@
+#ifndef _HOST_ESP_WIFI_H
+#define _HOST_ESP_WIFI_H
+
+// Host shim: included by the library, nothing used from it
+
+#endif
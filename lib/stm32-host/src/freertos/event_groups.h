@@ -0,0 +1,11 @@
+#ifndef _HOST_FREERTOS_EVENT_GROUPS_H
+#define _HOST_FREERTOS_EVENT_GROUPS_H
+
+// Host shim: included by the library, event groups are not used
+
+#include "FreeRTOS.h"
+
+typedef struct HostEventGroup *EventGroupHandle_t;
+typedef uint32_t EventBits_t;
+
+#endif
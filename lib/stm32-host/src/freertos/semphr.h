@@ -0,0 +1,17 @@
+#ifndef _HOST_FREERTOS_SEMPHR_H
+#define _HOST_FREERTOS_SEMPHR_H
+
+#include "queue.h"
+
+// Semaphores are counters, as FreeRTOS queues of empty items
+typedef struct HostQueue *SemaphoreHandle_t;
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void);
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max_count, UBaseType_t initial_count);
+SemaphoreHandle_t xSemaphoreCreateMutex(void);
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks_to_wait);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore);
+
+#define vSemaphoreDelete(semaphore) vQueueDelete(semaphore)
+
+#endif
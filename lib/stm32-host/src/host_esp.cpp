@@ -0,0 +1,339 @@
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_rom_crc.h"
+#include "esp_partition.h"
+#include "esp_spiffs.h"
+#include "nvs.h"
+#include "nvs_flash.h"
+#include "stm32_host.h"
+
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+int64_t esp_timer_get_time(void)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+const char *esp_err_to_name(esp_err_t code)
+{
+    switch (code) {
+    case ESP_OK:                     return "ESP_OK";
+    case ESP_FAIL:                   return "ESP_FAIL";
+    case ESP_ERR_NO_MEM:             return "ESP_ERR_NO_MEM";
+    case ESP_ERR_INVALID_ARG:        return "ESP_ERR_INVALID_ARG";
+    case ESP_ERR_INVALID_STATE:      return "ESP_ERR_INVALID_STATE";
+    case ESP_ERR_INVALID_SIZE:       return "ESP_ERR_INVALID_SIZE";
+    case ESP_ERR_NOT_FOUND:          return "ESP_ERR_NOT_FOUND";
+    case ESP_ERR_NOT_SUPPORTED:      return "ESP_ERR_NOT_SUPPORTED";
+    case ESP_ERR_TIMEOUT:            return "ESP_ERR_TIMEOUT";
+    case ESP_ERR_NVS_NOT_FOUND:      return "ESP_ERR_NVS_NOT_FOUND";
+    case ESP_ERR_NVS_READ_ONLY:      return "ESP_ERR_NVS_READ_ONLY";
+    case ESP_ERR_NVS_INVALID_LENGTH: return "ESP_ERR_NVS_INVALID_LENGTH";
+    default:                         return "UNKNOWN ERROR";
+    }
+}
+
+// CRC32 with the zlib polynomial (reflected 0xEDB88320)
+uint32_t esp_rom_crc32_le(uint32_t crc, uint8_t const *buf, uint32_t len)
+{
+    static uint32_t table[256];
+    static std::once_flag table_built;
+    std::call_once(table_built, [] {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t value = i;
+            for (int bit = 0; bit < 8; bit++) {
+                value = (value & 1) ? (value >> 1) ^ 0xEDB88320 : (value >> 1);
+            }
+            table[i] = value;
+        }
+    });
+
+    crc = ~crc;
+    for (uint32_t i = 0; i < len; i++) {
+        crc = table[(crc ^ buf[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static esp_log_level_t logLevel()
+{
+    static esp_log_level_t s_level = [] {
+        const char *level = getenv("STM32_HOST_LOG_LEVEL");
+        return (level != NULL) ? (esp_log_level_t)atoi(level) : ESP_LOG_WARN;
+    }();
+    return s_level;
+}
+
+static esp_log_level_t s_log_level = ESP_LOG_NONE;
+static bool s_log_level_set = false;
+static const int64_t s_log_start = esp_timer_get_time(); // Log times count from the start, as from boot
+
+void esp_log_write(esp_log_level_t level, const char *tag, const char *format, ...)
+{
+    const esp_log_level_t max_level = s_log_level_set ? s_log_level : logLevel();
+    if (level > max_level || level == ESP_LOG_NONE) {
+        return;
+    }
+
+    static const char letters[] = "NEWIDV";
+    char message[1024];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    fprintf(stderr, "%c (%lld) %s: %s\n", letters[level], (long long)((esp_timer_get_time() - s_log_start) / 1000), tag, message);
+}
+
+// NVS: namespace -> key -> blob
+static std::mutex s_nvs_mutex;
+static std::map<std::string, std::map<std::string, std::vector<uint8_t>>> s_nvs;
+struct NvsHandle {
+    std::string name;
+    bool writable;
+};
+static std::vector<NvsHandle> s_nvs_handles;
+static uint32_t s_nvs_writes = 0;
+
+esp_err_t nvs_flash_init(void)
+{
+    return ESP_OK;
+}
+
+esp_err_t nvs_flash_erase(void)
+{
+    stm32host::clearNvs();
+    return ESP_OK;
+}
+
+esp_err_t nvs_open(const char *name, nvs_open_mode_t open_mode, nvs_handle_t *out_handle)
+{
+    std::lock_guard<std::mutex> lock(s_nvs_mutex);
+    if (open_mode == NVS_READONLY && s_nvs.find(name) == s_nvs.end()) {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    s_nvs[name];
+    s_nvs_handles.push_back({name, open_mode == NVS_READWRITE});
+    *out_handle = s_nvs_handles.size();
+    return ESP_OK;
+}
+
+void nvs_close(nvs_handle_t handle)
+{
+}
+
+static NvsHandle *findHandle(nvs_handle_t handle)
+{
+    return (handle > 0 && handle <= s_nvs_handles.size()) ? &s_nvs_handles[handle - 1] : NULL;
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *out_value, size_t *length)
+{
+    std::lock_guard<std::mutex> lock(s_nvs_mutex);
+    const NvsHandle *nvs = findHandle(handle);
+    if (nvs == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    const auto &blobs = s_nvs[nvs->name];
+    const auto blob = blobs.find(key);
+    if (blob == blobs.end()) {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    if (out_value == NULL) {
+        *length = blob->second.size();
+        return ESP_OK;
+    }
+    if (*length < blob->second.size()) {
+        return ESP_ERR_NVS_INVALID_LENGTH;
+    }
+    memcpy(out_value, blob->second.data(), blob->second.size());
+    *length = blob->second.size();
+    return ESP_OK;
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *value, size_t length)
+{
+    std::lock_guard<std::mutex> lock(s_nvs_mutex);
+    const NvsHandle *nvs = findHandle(handle);
+    if (nvs == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!nvs->writable) {
+        return ESP_ERR_NVS_READ_ONLY;
+    }
+    s_nvs[nvs->name][key].assign((const uint8_t *)value, (const uint8_t *)value + length);
+    s_nvs_writes++;
+    return ESP_OK;
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key)
+{
+    std::lock_guard<std::mutex> lock(s_nvs_mutex);
+    const NvsHandle *nvs = findHandle(handle);
+    if (nvs == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!nvs->writable) {
+        return ESP_ERR_NVS_READ_ONLY;
+    }
+    return (s_nvs[nvs->name].erase(key) > 0) ? ESP_OK : ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle)
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_vfs_spiffs_register(const esp_vfs_spiffs_conf_t *conf)
+{
+    return ESP_ERR_NOT_FOUND;
+}
+
+bool esp_spiffs_mounted(const char *partition_label)
+{
+    return false;
+}
+
+esp_err_t esp_spiffs_info(const char *partition_label, size_t *total_bytes, size_t *used_bytes)
+{
+    return ESP_ERR_INVALID_STATE;
+}
+
+esp_err_t esp_spiffs_format(const char *partition_label)
+{
+    return ESP_ERR_NOT_FOUND;
+}
+
+// Data partitions backed by files
+struct HostPartition {
+    esp_partition_t partition;
+    std::string path;
+};
+static std::mutex s_partition_mutex;
+static std::vector<HostPartition *> s_partitions;
+static std::map<esp_partition_mmap_handle_t, std::pair<void *, size_t>> s_mappings;
+static esp_partition_mmap_handle_t s_next_mapping = 1;
+
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype, const char *label)
+{
+    std::lock_guard<std::mutex> lock(s_partition_mutex);
+    for (const HostPartition *host : s_partitions) {
+        if ((type == ESP_PARTITION_TYPE_ANY || type == host->partition.type) &&
+            (label == NULL || strcmp(label, host->partition.label) == 0)) {
+            return &host->partition;
+        }
+    }
+    return NULL;
+}
+
+esp_err_t esp_partition_mmap(const esp_partition_t *partition, size_t offset, size_t size, esp_partition_mmap_memory_t memory,
+                             const void **out_ptr, esp_partition_mmap_handle_t *out_handle)
+{
+    if (partition == NULL || size == 0 || offset + size > partition->size) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    std::string path;
+    {
+        std::lock_guard<std::mutex> lock(s_partition_mutex);
+        for (const HostPartition *host : s_partitions) {
+            if (&host->partition == partition) {
+                path = host->path;
+            }
+        }
+    }
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    // As with the MMU, the mapping starts on a page boundary
+    const size_t page = sysconf(_SC_PAGESIZE);
+    const size_t start = offset - offset % page;
+    const size_t length = size + (offset - start);
+    void *mapping = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, start);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    std::lock_guard<std::mutex> lock(s_partition_mutex);
+    *out_handle = s_next_mapping++;
+    s_mappings[*out_handle] = {mapping, length};
+    *out_ptr = (const uint8_t *)mapping + (offset - start);
+    return ESP_OK;
+}
+
+void esp_partition_munmap(esp_partition_mmap_handle_t handle)
+{
+    std::lock_guard<std::mutex> lock(s_partition_mutex);
+    const auto mapping = s_mappings.find(handle);
+    if (mapping != s_mappings.end()) {
+        munmap(mapping->second.first, mapping->second.second);
+        s_mappings.erase(mapping);
+    }
+}
+
+namespace stm32host {
+
+bool addPartition(const char *label, const char *path)
+{
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        return false;
+    }
+
+    HostPartition *host = new HostPartition();
+    host->partition.type = ESP_PARTITION_TYPE_DATA;
+    host->partition.subtype = ESP_PARTITION_SUBTYPE_ANY;
+    host->partition.size = st.st_size;
+    snprintf(host->partition.label, sizeof(host->partition.label), "%s", label);
+    host->path = path;
+
+    std::lock_guard<std::mutex> lock(s_partition_mutex);
+    s_partitions.push_back(host);
+    return true;
+}
+
+void removePartitions()
+{
+    std::lock_guard<std::mutex> lock(s_partition_mutex);
+    for (HostPartition *host : s_partitions) {
+        delete host;
+    }
+    s_partitions.clear();
+}
+
+void clearNvs()
+{
+    std::lock_guard<std::mutex> lock(s_nvs_mutex);
+    s_nvs.clear();
+    s_nvs_writes = 0;
+}
+
+uint32_t nvsWrites()
+{
+    std::lock_guard<std::mutex> lock(s_nvs_mutex);
+    return s_nvs_writes;
+}
+
+void setLogLevel(esp_log_level_t level)
+{
+    s_log_level = level;
+    s_log_level_set = true;
+}
+
+} // namespace stm32host
@@ -0,0 +1,289 @@
+#include "host_images.h"
+#include "esp_rom_crc.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <unordered_map>
+
+namespace stm32host {
+
+// Same parameters as tools/stm32_pack.py
+#define PACK_WINDOW_SIZE 1024
+#define PACK_LENGTH_BITS 6
+#define PACK_MIN_MATCH 3
+#define PACK_MAX_MATCH (PACK_MIN_MATCH + (1 << PACK_LENGTH_BITS) - 1)
+#define PACK_MAX_CANDIDATES 64
+
+static uint32_t nextRandom(uint32_t &state)
+{
+    // xorshift32: the same seed gives the same image on every run
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+static void putLE16(std::vector<uint8_t> &out, uint16_t value)
+{
+    out.push_back((uint8_t)value);
+    out.push_back((uint8_t)(value >> 8));
+}
+
+static void putLE32(std::vector<uint8_t> &out, uint32_t value)
+{
+    putLE16(out, (uint16_t)value);
+    putLE16(out, (uint16_t)(value >> 16));
+}
+
+std::vector<uint8_t> firmwareImage(size_t size, uint32_t seed)
+{
+    static const uint16_t opcodes[] = {
+        0x4600, 0x4608, 0x2000, 0x2100, 0x6800, 0x6008, 0x6840, 0x6048, 0x3001, 0x3801, 0x1c40, 0x1e40,
+        0x4280, 0xd000, 0xd100, 0xe000, 0xb500, 0xbd00, 0xb510, 0xbd10, 0x4770, 0x0040, 0x0880, 0x4010,
+        0x4318, 0x7800, 0x7008, 0x8800, 0x8008, 0x9000, 0x9800, 0xf000, 0xf800, 0x4a00, 0x4b00, 0xbf00,
+    };
+    static const char *const words[] = {
+        "error", "init", "uart", "timeout", "config", "sensor", "ready", "failed", "value", "%d", "%s", "0x%08lx",
+        "motor", "speed", "reset", "boot", "version", "ok", "overflow", "adc", "channel", "\n",
+    };
+
+    uint32_t state = seed * 2654435761u + 1;
+    std::vector<uint8_t> image;
+    image.reserve(size + 512);
+
+    // Vector table: initial stack pointer, then handlers, most of them the default one
+    putLE32(image, 0x20005000);
+    const uint32_t default_handler = 0x08000000 + 0x1C0 + 1;
+    for (int i = 1; i < 48; i++) {
+        putLE32(image, (i < 16 && (nextRandom(state) & 1)) ? 0x08000100 + 8 * i + 1 : default_handler);
+    }
+
+    // Compilers emit the same short instruction sequences over and over (prologues, loads of a
+    // peripheral register, loop tails): code is made of idioms, some of them with a fresh operand
+    std::vector<std::vector<uint16_t>> idioms(64);
+    for (std::vector<uint16_t> &idiom : idioms) {
+        const uint32_t length = 2 + nextRandom(state) % 7;
+        for (uint32_t i = 0; i < length; i++) {
+            const uint32_t r = nextRandom(state);
+            idiom.push_back((uint16_t)(opcodes[r % (sizeof(opcodes) / sizeof(opcodes[0]))] | ((r >> 8) & 0x3F)));
+        }
+    }
+
+    while (image.size() < size) {
+        const uint32_t kind = nextRandom(state) % 10;
+        if (kind < 7) {
+            // Code: functions of idioms, the most common ones picked more often
+            const uint32_t count = 8 + nextRandom(state) % 48;
+            for (uint32_t i = 0; i < count; i++) {
+                const uint32_t r = nextRandom(state);
+                const std::vector<uint16_t> &idiom = idioms[std::min(r % idioms.size(), (r >> 8) % idioms.size())];
+                for (uint16_t opcode : idiom) {
+                    putLE16(image, opcode);
+                }
+                if ((r >> 16) % 4 == 0) {
+                    putLE16(image, (uint16_t)(opcodes[(r >> 20) % (sizeof(opcodes) / sizeof(opcodes[0]))] | (r >> 24)));
+                }
+            }
+        } else if (kind < 9) {
+            // Literal pool and constant tables: small values and flash or peripheral addresses
+            const uint32_t count = 4 + nextRandom(state) % 28;
+            for (uint32_t i = 0; i < count; i++) {
+                const uint32_t r = nextRandom(state);
+                const uint32_t bases[] = {0x08000000, 0x20000000, 0x40000000, 0};
+                putLE32(image, bases[r % 4] | ((r >> 4) & ((r % 4 == 3) ? 0xFF : 0x3FFC)));
+            }
+        } else {
+            // Format strings
+            const uint32_t count = 2 + nextRandom(state) % 6;
+            for (uint32_t i = 0; i < count; i++) {
+                const char *word = words[nextRandom(state) % (sizeof(words) / sizeof(words[0]))];
+                image.insert(image.end(), word, word + strlen(word));
+                image.push_back(' ');
+            }
+            image.push_back(0);
+            while (image.size() % 4 != 0) {
+                image.push_back(0);
+            }
+        }
+    }
+    image.resize(size);
+    return image;
+}
+
+std::vector<uint8_t> packImage(const std::vector<uint8_t> &raw)
+{
+    std::vector<uint8_t> out = {'S', 'T', 'Z', '1'};
+    putLE32(out, (uint32_t)raw.size());
+    putLE32(out, esp_rom_crc32_le(0, raw.data(), raw.size()));
+
+    // Positions of every 3-byte prefix, most recent last
+    std::unordered_map<uint32_t, std::vector<uint32_t>> chains;
+    const size_t size = raw.size();
+    size_t flags_pos = 0;
+    int flag_bit = 8;
+    size_t i = 0;
+    while (i < size) {
+        size_t best_len = 0;
+        size_t best_dist = 0;
+        if (i + PACK_MIN_MATCH <= size) {
+            const uint32_t key = (raw[i] << 16) | (raw[i + 1] << 8) | raw[i + 2];
+            auto chain = chains.find(key);
+            if (chain != chains.end()) {
+                const std::vector<uint32_t> &positions = chain->second;
+                const size_t first = (positions.size() > PACK_MAX_CANDIDATES) ? positions.size() - PACK_MAX_CANDIDATES : 0;
+                for (size_t c = positions.size(); c > first; c--) {
+                    const size_t p = positions[c - 1];
+                    const size_t dist = i - p;
+                    if (dist > PACK_WINDOW_SIZE) {
+                        break;
+                    }
+                    size_t length = PACK_MIN_MATCH;
+                    while (length < PACK_MAX_MATCH && i + length < size && raw[p + length] == raw[i + length]) {
+                        length++;
+                    }
+                    if (length > best_len) {
+                        best_len = length;
+                        best_dist = dist;
+                        if (length == PACK_MAX_MATCH) {
+                            break;
+                        }
+                    }
+                }
+            }
+        }
+
+        if (flag_bit == 8) {
+            flags_pos = out.size();
+            out.push_back(0);
+            flag_bit = 0;
+        }
+
+        size_t step;
+        if (best_len >= PACK_MIN_MATCH) {
+            const uint16_t token = (uint16_t)(((best_dist - 1) << PACK_LENGTH_BITS) | (best_len - PACK_MIN_MATCH));
+            out.push_back((uint8_t)(token >> 8));
+            out.push_back((uint8_t)token);
+            step = best_len;
+        } else {
+            out[flags_pos] |= 1 << flag_bit;
+            out.push_back(raw[i]);
+            step = 1;
+        }
+        flag_bit++;
+
+        for (size_t k = i; k < i + step; k++) {
+            if (k + PACK_MIN_MATCH <= size) {
+                chains[(raw[k] << 16) | (raw[k + 1] << 8) | raw[k + 2]].push_back((uint32_t)k);
+            }
+        }
+        i += step;
+    }
+    return out;
+}
+
+static void appendRecord(std::string &out, uint8_t type, uint16_t address, const uint8_t *data, size_t count)
+{
+    char text[12];
+    uint8_t checksum = (uint8_t)(count + (address >> 8) + address + type);
+    snprintf(text, sizeof(text), ":%02X%04X%02X", (unsigned)count, (unsigned)address, (unsigned)type);
+    out += text;
+    for (size_t i = 0; i < count; i++) {
+        snprintf(text, sizeof(text), "%02X", (unsigned)data[i]);
+        out += text;
+        checksum += data[i];
+    }
+    snprintf(text, sizeof(text), "%02X\n", (unsigned)(uint8_t)-checksum);
+    out += text;
+}
+
+std::string hexImage(const std::vector<LoadSegment> &segments)
+{
+    std::string out;
+    uint32_t upper = 0xFFFFFFFF;
+    for (const LoadSegment &segment : segments) {
+        size_t position = 0;
+        while (position < segment.data.size()) {
+            const uint32_t address = segment.address + (uint32_t)position;
+            if ((address >> 16) != upper) {
+                // Extended linear address: upper 16 bits of the following records
+                upper = address >> 16;
+                const uint8_t data[2] = {(uint8_t)(upper >> 8), (uint8_t)upper};
+                appendRecord(out, 0x04, 0, data, sizeof(data));
+            }
+            // Records never cross a 64KB boundary
+            size_t count = 16 - (address % 16);
+            count = (count < segment.data.size() - position) ? count : segment.data.size() - position;
+            appendRecord(out, 0x00, (uint16_t)address, &segment.data[position], count);
+            position += count;
+        }
+    }
+    appendRecord(out, 0x01, 0, NULL, 0);
+    return out;
+}
+
+std::vector<uint8_t> elfImage(const std::vector<LoadSegment> &segments)
+{
+    const uint32_t header_size = 52;
+    const uint32_t ph_size = 32;
+    const uint32_t ph_count = (uint32_t)segments.size() + 1;
+    static const uint8_t note[] = {4, 0, 0, 0, 4, 0, 0, 0, 3, 0, 0, 0, 'G', 'N', 'U', 0, 0xDE, 0xAD, 0xBE, 0xEF};
+
+    std::vector<uint8_t> out = {0x7F, 'E', 'L', 'F', 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+    putLE16(out, 2);  // ET_EXEC
+    putLE16(out, 40); // EM_ARM
+    putLE32(out, 1);
+    putLE32(out, segments.empty() ? 0 : segments[0].address + 1); // Thumb entry point
+    putLE32(out, header_size); // e_phoff
+    putLE32(out, 0);           // e_shoff: no section headers
+    putLE32(out, 0x05000200);  // EABI5, soft float
+    putLE16(out, header_size);
+    putLE16(out, ph_size);
+    putLE16(out, ph_count);
+    putLE16(out, 40);
+    putLE16(out, 0);
+    putLE16(out, 0);
+
+    // Contents after the program header table: the note, then each segment 4-byte aligned
+    uint32_t offset = header_size + ph_count * ph_size;
+    const uint32_t note_offset = offset;
+    offset += sizeof(note);
+    std::vector<uint32_t> offsets;
+    for (const LoadSegment &segment : segments) {
+        offset = (offset + 3) & ~3u;
+        offsets.push_back(offset);
+        offset += (uint32_t)segment.data.size();
+    }
+
+    const uint32_t note_header[] = {4, note_offset, 0, 0, sizeof(note), sizeof(note), 4, 4}; // PT_NOTE
+    for (uint32_t value : note_header) {
+        putLE32(out, value);
+    }
+    for (size_t i = 0; i < segments.size(); i++) {
+        const uint32_t size = (uint32_t)segments[i].data.size();
+        const uint32_t ph[] = {1, offsets[i], segments[i].address, segments[i].address, size, size, 5, 0x10000};
+        for (uint32_t value : ph) {
+            putLE32(out, value);
+        }
+    }
+
+    out.insert(out.end(), note, note + sizeof(note));
+    for (size_t i = 0; i < segments.size(); i++) {
+        out.resize(offsets[i], 0);
+        out.insert(out.end(), segments[i].data.begin(), segments[i].data.end());
+    }
+    return out;
+}
+
+bool writeFile(const char *path, const void *data, size_t size)
+{
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        return false;
+    }
+    const bool written = fwrite(data, 1, size, file) == size;
+    return (fclose(file) == 0) && written;
+}
+
+} // namespace stm32host
@@ -0,0 +1,50 @@
+#ifndef _HOST_IMAGES_H
+#define _HOST_IMAGES_H
+
+// Firmware images for the host tests: synthetic binaries and their packed, HEX and ELF forms
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+namespace stm32host {
+
+// Data loaded at an absolute STM32 address
+struct LoadSegment {
+    uint32_t address;
+    std::vector<uint8_t> data;
+};
+
+/**
+ * @brief Binary shaped like Cortex-M firmware: vector table, Thumb-like code from a small
+ * instruction set, constant tables and strings, so that it compresses like a real one
+ */
+std::vector<uint8_t> firmwareImage(size_t size, uint32_t seed = 1);
+
+/**
+ * @brief Pack a raw image into the STZ1 format of tools/stm32_pack.py (same greedy matcher)
+ */
+std::vector<uint8_t> packImage(const std::vector<uint8_t> &raw);
+
+/**
+ * @brief Intel HEX text of the segments, 16 data bytes per record, as written by objcopy
+ */
+std::string hexImage(const std::vector<LoadSegment> &segments);
+
+/**
+ * @brief 32-bit little-endian ARM ELF executable with one PT_LOAD program header per segment
+ *
+ * Each segment is loaded at its address (physical and virtual), a non-loadable note header
+ * comes first as in linker output
+ */
+std::vector<uint8_t> elfImage(const std::vector<LoadSegment> &segments);
+
+/**
+ * @brief Write a buffer to a file, false on error
+ */
+bool writeFile(const char *path, const void *data, size_t size);
+
+} // namespace stm32host
+
+#endif
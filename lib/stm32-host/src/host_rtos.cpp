@@ -0,0 +1,180 @@
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <new>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Thrown by vTaskDelete(NULL) to unwind the task back to its thread
+struct TaskExit {};
+
+static thread_local bool t_is_task = false;
+static thread_local UBaseType_t t_priority = 1;
+
+static void runTask(TaskFunction_t task, void *parameters, UBaseType_t priority)
+{
+    t_is_task = true;
+    t_priority = priority;
+    try {
+        task(parameters);
+    } catch (const TaskExit &) {
+        // Deleted itself
+    }
+}
+
+BaseType_t xTaskCreate(TaskFunction_t task, const char *name, uint32_t stack_depth, void *parameters,
+                       UBaseType_t priority, TaskHandle_t *created_task)
+{
+    try {
+        std::thread(runTask, task, parameters, priority).detach();
+    } catch (const std::system_error &) {
+        return pdFAIL;
+    }
+    if (created_task != NULL) {
+        *created_task = NULL;
+    }
+    return pdPASS;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t task, const char *name, uint32_t stack_depth, void *parameters,
+                                   UBaseType_t priority, TaskHandle_t *created_task, BaseType_t core_id)
+{
+    return xTaskCreate(task, name, stack_depth, parameters, priority, created_task);
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+    if (task != NULL || !t_is_task) {
+        fprintf(stderr, "vTaskDelete: only a task deleting itself is supported on the host\n");
+        abort();
+    }
+    throw TaskExit();
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(ticks * portTICK_PERIOD_MS));
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+    return (TickType_t)(esp_timer_get_time() / 1000 / portTICK_PERIOD_MS);
+}
+
+UBaseType_t uxTaskPriorityGet(TaskHandle_t task)
+{
+    return t_priority;
+}
+
+// Ring of fixed-size items (no items for a semaphore, only the count)
+struct HostQueue {
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::vector<uint8_t> items;
+    UBaseType_t length;
+    UBaseType_t item_size;
+    UBaseType_t head = 0;
+    UBaseType_t count = 0;
+
+    HostQueue(UBaseType_t length, UBaseType_t item_size) : items(length * item_size), length(length), item_size(item_size) {}
+
+    // Wait until ready() holds, or for ticks (portMAX_DELAY waits forever)
+    template <typename Ready>
+    bool waitFor(std::unique_lock<std::mutex> &lock, TickType_t ticks, Ready ready)
+    {
+        if (ticks == portMAX_DELAY) {
+            changed.wait(lock, ready);
+            return true;
+        }
+        return changed.wait_for(lock, std::chrono::milliseconds(ticks * portTICK_PERIOD_MS), ready);
+    }
+};
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size)
+{
+    if (length == 0) {
+        return NULL;
+    }
+    return new (std::nothrow) HostQueue(length, item_size);
+}
+
+void vQueueDelete(QueueHandle_t queue)
+{
+    delete queue;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks_to_wait)
+{
+    std::unique_lock<std::mutex> lock(queue->mutex);
+    if (!queue->waitFor(lock, ticks_to_wait, [queue] { return queue->count < queue->length; })) {
+        return pdFALSE;
+    }
+    const UBaseType_t tail = (queue->head + queue->count) % queue->length;
+    if (queue->item_size > 0) {
+        memcpy(&queue->items[tail * queue->item_size], item, queue->item_size);
+    }
+    queue->count++;
+    queue->changed.notify_all();
+    return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *buffer, TickType_t ticks_to_wait)
+{
+    std::unique_lock<std::mutex> lock(queue->mutex);
+    if (!queue->waitFor(lock, ticks_to_wait, [queue] { return queue->count > 0; })) {
+        return pdFALSE;
+    }
+    if (queue->item_size > 0) {
+        memcpy(buffer, &queue->items[queue->head * queue->item_size], queue->item_size);
+    }
+    queue->head = (queue->head + 1) % queue->length;
+    queue->count--;
+    queue->changed.notify_all();
+    return pdTRUE;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue)
+{
+    std::lock_guard<std::mutex> lock(queue->mutex);
+    return queue->count;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+    return xSemaphoreCreateCounting(1, 0);
+}
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max_count, UBaseType_t initial_count)
+{
+    HostQueue *semaphore = xQueueCreate(max_count, 0);
+    if (semaphore != NULL) {
+        semaphore->count = (initial_count < max_count) ? initial_count : max_count;
+    }
+    return semaphore;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    return xSemaphoreCreateCounting(1, 1);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks_to_wait)
+{
+    return xQueueReceive(semaphore, NULL, ticks_to_wait);
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore)
+{
+    return xQueueSend(semaphore, NULL, 0);
+}
@@ -0,0 +1,59 @@
+#include "host_target.h"
+
+#include <chrono>
+#include <memory>
+#include <thread>
+
+namespace stm32host {
+
+HostTarget::HostTarget(uart_port_t uart_num, const EmulatorConfig &emulator_config) : emulator(emulator_config)
+{
+    config.uart_num = uart_num;
+    config.reset_pin = (gpio_num_t)(10 + 2 * uart_num);
+    config.boot0_pin = (gpio_num_t)(11 + 2 * uart_num);
+    config.uart_tx = (gpio_num_t)(20 + 2 * uart_num);
+    config.uart_rx = (gpio_num_t)(21 + 2 * uart_num);
+    config.reset_pulse_ms = 1;
+    config.reset_settle_ms = 1;
+    attachTarget(uart_num, emulator, config.reset_pin, config.boot0_pin);
+}
+
+HostTarget::~HostTarget()
+{
+    detachTarget(config.uart_num);
+}
+
+static std::vector<std::unique_ptr<HostTarget>> s_targets;
+
+HostTarget &createTarget(uart_port_t uart_num, const EmulatorConfig &emulator_config)
+{
+    s_targets.emplace_back(new HostTarget(uart_num, emulator_config));
+    return *s_targets.back();
+}
+
+void releaseTargets()
+{
+    s_targets.clear();
+    for (int i = 0; i < UART_NUM_MAX; i++) {
+        if (uart_is_driver_installed((uart_port_t)i)) {
+            uart_driver_delete((uart_port_t)i);
+        }
+    }
+}
+
+const char *SlowImageSource::block(uint32_t offset, char *scratch)
+{
+    reads++;
+    if (_delay_us > 0) {
+        std::this_thread::sleep_for(std::chrono::microseconds(_delay_us));
+    }
+    if (offset >= fail_offset || offset >= _data.size()) {
+        return NULL;
+    }
+    const size_t length = (_data.size() - offset < BLOCK_SIZE) ? _data.size() - offset : BLOCK_SIZE;
+    memcpy(scratch, &_data[offset], length);
+    memset(scratch + length, 0xFF, BLOCK_SIZE - length);
+    return scratch;
+}
+
+} // namespace stm32host
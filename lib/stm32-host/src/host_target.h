@@ -0,0 +1,71 @@
+#ifndef _HOST_TARGET_H
+#define _HOST_TARGET_H
+
+#include "STM32Flasher.h"
+#include "stm_image.h"
+#include "stm32_emulator.h"
+#include "stm32_host.h"
+
+#include <string.h>
+
+#include <vector>
+
+namespace stm32host {
+
+/**
+ * @brief Emulated STM32 attached to a UART, with the flasher configuration that reaches it
+ *
+ * Each UART gets its own pins: NRST on GPIO 10 + 2n, BOOT0 on GPIO 11 + 2n, TX/RX on GPIO 20 + 2n / 21 + 2n.
+ * Reset timings are cut to 1 ms, the emulator boots as soon as NRST is released.
+ */
+class HostTarget {
+public:
+    explicit HostTarget(uart_port_t uart_num, const EmulatorConfig &emulator_config = EmulatorConfig());
+    ~HostTarget();
+    HostTarget(const HostTarget &) = delete;
+    HostTarget &operator=(const HostTarget &) = delete;
+
+    Stm32Emulator emulator;
+    stm32flash::FlashConfig config;
+
+    // Flash contents from an offset of the flash memory
+    const uint8_t *flashAt(uint32_t offset) { return &emulator.flash()[offset]; }
+    // Check if the flash holds data at an offset (and 0xFF up to the end of the image's pages)
+    bool holds(uint32_t offset, const uint8_t *data, size_t size) { return memcmp(flashAt(offset), data, size) == 0; }
+};
+
+/**
+ * @brief Create a target that lives until releaseTargets()
+ *
+ * Unity leaves a test with longjmp when an assertion fails, skipping the destructors of the
+ * objects on its stack: targets made here are still torn down by tearDown()
+ */
+HostTarget &createTarget(uart_port_t uart_num, const EmulatorConfig &emulator_config = EmulatorConfig());
+
+/**
+ * @brief Destroy the targets of createTarget(), and uninstall the UART drivers a failed test left installed
+ */
+void releaseTargets();
+
+/**
+ * @brief Image read with a delay per block, as a file on a busy filesystem
+ */
+class SlowImageSource : public stm32flash::internal::ImageSource {
+public:
+    SlowImageSource(const std::vector<uint8_t> &data, uint32_t delay_us) : _data(data), _delay_us(delay_us) {}
+
+    uint32_t size() const override { return (uint32_t)_data.size(); }
+    bool isMapped() const override { return false; }
+    const char *block(uint32_t offset, char *scratch) override;
+
+    uint32_t fail_offset = UINT32_MAX; // Blocks from this offset on fail to read
+    uint32_t reads = 0;
+
+private:
+    const std::vector<uint8_t> &_data;
+    uint32_t _delay_us;
+};
+
+} // namespace stm32host
+
+#endif
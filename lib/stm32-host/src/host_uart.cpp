@@ -0,0 +1,265 @@
+#include "driver/uart.h"
+#include "driver/gpio.h"
+#include "esp_timer.h"
+#include "stm32_host.h"
+#include "stm32_emulator.h"
+
+#include <chrono>
+#include <mutex>
+#include <thread>
+
+namespace stm32host {
+
+// UART of the ESP32 and the target wired to it
+struct HostPort {
+    bool installed = false;
+    uint32_t baud_rate = 115200;
+    bool timed = false;       // Wire times of the attached target
+    int64_t tx_busy_until = 0;
+    SerialLine rx;            // Target to ESP32
+    Stm32Emulator *target = NULL;
+    gpio_num_t reset_pin = GPIO_NUM_NC;
+    gpio_num_t boot0_pin = GPIO_NUM_NC;
+};
+
+static std::mutex s_mutex;
+static HostPort s_ports[UART_NUM_MAX];
+static int s_levels[GPIO_NUM_MAX];
+static bool s_levels_set = false;
+
+static bool isValidPort(uart_port_t uart_num)
+{
+    return uart_num >= 0 && uart_num < UART_NUM_MAX;
+}
+
+static bool isValidPin(gpio_num_t gpio_num)
+{
+    return gpio_num >= 0 && gpio_num < GPIO_NUM_MAX;
+}
+
+static void initLevels()
+{
+    if (!s_levels_set) {
+        for (int i = 0; i < GPIO_NUM_MAX; i++) {
+            s_levels[i] = -1;
+        }
+        s_levels_set = true;
+    }
+}
+
+void attachTarget(uart_port_t uart_num, Stm32Emulator &target, gpio_num_t reset_pin, gpio_num_t boot0_pin)
+{
+    std::lock_guard<std::mutex> lock(s_mutex);
+    HostPort &port = s_ports[uart_num];
+    port.target = &target;
+    port.timed = target.config().wire_time;
+    port.reset_pin = reset_pin;
+    port.boot0_pin = boot0_pin;
+    port.rx.clear();
+    target.connect(&port.rx);
+}
+
+void detachTarget(uart_port_t uart_num)
+{
+    std::lock_guard<std::mutex> lock(s_mutex);
+    HostPort &port = s_ports[uart_num];
+    if (port.target != NULL) {
+        port.target->connect(NULL);
+    }
+    port.target = NULL;
+    port.reset_pin = GPIO_NUM_NC;
+    port.boot0_pin = GPIO_NUM_NC;
+    port.rx.clear();
+}
+
+int gpioLevel(gpio_num_t gpio_num)
+{
+    std::lock_guard<std::mutex> lock(s_mutex);
+    initLevels();
+    return isValidPin(gpio_num) ? s_levels[gpio_num] : -1;
+}
+
+} // namespace stm32host
+
+using stm32host::HostPort;
+using stm32host::s_mutex;
+using stm32host::s_ports;
+
+esp_err_t uart_driver_install(uart_port_t uart_num, int rx_buffer_size, int tx_buffer_size, int queue_size,
+                              QueueHandle_t *uart_queue, int intr_alloc_flags)
+{
+    if (!stm32host::isValidPort(uart_num)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    std::lock_guard<std::mutex> lock(s_mutex);
+    HostPort &port = s_ports[uart_num];
+    if (port.installed) {
+        return ESP_FAIL;
+    }
+    port.installed = true;
+    port.rx.flush();
+    return ESP_OK;
+}
+
+esp_err_t uart_driver_delete(uart_port_t uart_num)
+{
+    if (!stm32host::isValidPort(uart_num)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    std::lock_guard<std::mutex> lock(s_mutex);
+    s_ports[uart_num].installed = false;
+    return ESP_OK;
+}
+
+bool uart_is_driver_installed(uart_port_t uart_num)
+{
+    std::lock_guard<std::mutex> lock(s_mutex);
+    return stm32host::isValidPort(uart_num) && s_ports[uart_num].installed;
+}
+
+esp_err_t uart_param_config(uart_port_t uart_num, const uart_config_t *uart_config)
+{
+    if (!stm32host::isValidPort(uart_num) || uart_config->baud_rate <= 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    std::lock_guard<std::mutex> lock(s_mutex);
+    s_ports[uart_num].baud_rate = uart_config->baud_rate;
+    return ESP_OK;
+}
+
+esp_err_t uart_set_pin(uart_port_t uart_num, int tx_io_num, int rx_io_num, int rts_io_num, int cts_io_num)
+{
+    return stm32host::isValidPort(uart_num) ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t uart_set_baudrate(uart_port_t uart_num, uint32_t baudrate)
+{
+    if (!stm32host::isValidPort(uart_num) || baudrate == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    std::lock_guard<std::mutex> lock(s_mutex);
+    s_ports[uart_num].baud_rate = baudrate;
+    return ESP_OK;
+}
+
+esp_err_t uart_get_baudrate(uart_port_t uart_num, uint32_t *baudrate)
+{
+    if (!stm32host::isValidPort(uart_num)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    std::lock_guard<std::mutex> lock(s_mutex);
+    *baudrate = s_ports[uart_num].baud_rate;
+    return ESP_OK;
+}
+
+int uart_write_bytes(uart_port_t uart_num, const void *src, size_t size)
+{
+    if (!stm32host::isValidPort(uart_num)) {
+        return -1;
+    }
+    std::lock_guard<std::mutex> lock(s_mutex);
+    HostPort &port = s_ports[uart_num];
+    if (!port.installed) {
+        return -1;
+    }
+
+    // Returns once queued, the bytes then take their time on the wire
+    const int64_t now = esp_timer_get_time();
+    const int64_t start = (port.tx_busy_until > now) ? port.tx_busy_until : now;
+    port.tx_busy_until = start;
+    if (port.timed) {
+        port.tx_busy_until += (int64_t)size * UART_BITS_PER_BYTE * 1000000 / port.baud_rate;
+    }
+    if (port.target != NULL) {
+        port.target->receive((const uint8_t *)src, size, port.baud_rate);
+    }
+    return (int)size;
+}
+
+int uart_read_bytes(uart_port_t uart_num, void *buf, uint32_t length, TickType_t ticks_to_wait)
+{
+    HostPort *port;
+    uint32_t baud_rate;
+    {
+        std::lock_guard<std::mutex> lock(s_mutex);
+        if (!stm32host::isValidPort(uart_num) || !s_ports[uart_num].installed) {
+            return -1;
+        }
+        port = &s_ports[uart_num];
+        baud_rate = port->baud_rate;
+    }
+
+    const int64_t deadline = (ticks_to_wait == portMAX_DELAY) ? INT64_MAX :
+                             esp_timer_get_time() + (int64_t)ticks_to_wait * portTICK_PERIOD_MS * 1000;
+    return (int)port->rx.receive((uint8_t *)buf, length, deadline, baud_rate, port->rx.epoch());
+}
+
+esp_err_t uart_get_buffered_data_len(uart_port_t uart_num, size_t *size)
+{
+    if (!stm32host::isValidPort(uart_num)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    *size = s_ports[uart_num].rx.available();
+    return ESP_OK;
+}
+
+esp_err_t uart_flush_input(uart_port_t uart_num)
+{
+    if (!stm32host::isValidPort(uart_num)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    s_ports[uart_num].rx.flush();
+    return ESP_OK;
+}
+
+esp_err_t uart_wait_tx_done(uart_port_t uart_num, TickType_t ticks_to_wait)
+{
+    if (!stm32host::isValidPort(uart_num)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    int64_t busy_until;
+    {
+        std::lock_guard<std::mutex> lock(s_mutex);
+        busy_until = s_ports[uart_num].tx_busy_until;
+    }
+    const int64_t wait = busy_until - esp_timer_get_time();
+    if (wait > 0) {
+        std::this_thread::sleep_for(std::chrono::microseconds(wait));
+    }
+    return ESP_OK;
+}
+
+esp_err_t gpio_reset_pin(gpio_num_t gpio_num)
+{
+    return stm32host::isValidPin(gpio_num) ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t gpio_set_direction(gpio_num_t gpio_num, gpio_mode_t mode)
+{
+    return stm32host::isValidPin(gpio_num) ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t gpio_set_level(gpio_num_t gpio_num, uint32_t level)
+{
+    if (!stm32host::isValidPin(gpio_num)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    std::lock_guard<std::mutex> lock(s_mutex);
+    stm32host::initLevels();
+    stm32host::s_levels[gpio_num] = level ? 1 : 0;
+
+    // NRST of a target: BOOT0 is sampled as the reset is released
+    for (int i = 0; i < UART_NUM_MAX; i++) {
+        HostPort &port = s_ports[i];
+        if (port.target != NULL && port.reset_pin == gpio_num) {
+            port.target->setResetLevel(level != 0, stm32host::s_levels[port.boot0_pin] == 1);
+        }
+    }
+    return ESP_OK;
+}
+
+int gpio_get_level(gpio_num_t gpio_num)
+{
+    const int level = stm32host::gpioLevel(gpio_num);
+    return (level > 0) ? 1 : 0;
+}
@@ -0,0 +1,9 @@
+#ifndef _HOST_NVS_FLASH_H
+#define _HOST_NVS_FLASH_H
+
+#include "esp_err.h"
+
+esp_err_t nvs_flash_init(void);
+esp_err_t nvs_flash_erase(void);
+
+#endif
@@ -0,0 +1,129 @@
+#include "serial_line.h"
+#include "esp_timer.h"
+
+#include <chrono>
+
+namespace stm32host {
+
+// esp_timer_get_time() counts on the steady clock
+static std::chrono::steady_clock::time_point timePoint(int64_t us)
+{
+    return std::chrono::steady_clock::time_point(std::chrono::microseconds(us));
+}
+
+int64_t SerialLine::send(const uint8_t *data, size_t count, uint32_t baud_rate, bool timed)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    const int64_t now = esp_timer_get_time();
+    const int64_t start = (_busy_until > now) ? _busy_until : now;
+    for (size_t i = 0; i < count; i++) {
+        const int64_t wire_us = (timed && baud_rate > 0) ? (int64_t)(i + 1) * UART_BITS_PER_BYTE * 1000000 / baud_rate : 0;
+        _bytes.push_back({start + wire_us, baud_rate, data[i]});
+    }
+    if (count > 0) {
+        _busy_until = _bytes.back().arrival;
+    }
+    _changed.notify_all();
+    return _busy_until;
+}
+
+bool SerialLine::waitUntil(std::unique_lock<std::mutex> &lock, int64_t deadline)
+{
+    if (deadline == INT64_MAX) {
+        _changed.wait(lock);
+        return true;
+    }
+    return _changed.wait_until(lock, timePoint(deadline)) == std::cv_status::no_timeout;
+}
+
+size_t SerialLine::receive(uint8_t *data, size_t count, int64_t deadline, uint32_t baud_rate, uint32_t epoch,
+                           int64_t *first_arrival, uint32_t *first_baud)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    size_t done = 0;
+    while (done < count && _epoch == epoch) {
+        const int64_t now = esp_timer_get_time();
+        while (done < count && !_bytes.empty() && _bytes.front().arrival <= now) {
+            const Byte byte = _bytes.front();
+            _bytes.pop_front();
+            if (baud_rate != 0 && byte.baud_rate != baud_rate) {
+                continue;
+            }
+            if (done == 0 && first_arrival != NULL) {
+                *first_arrival = byte.arrival;
+            }
+            if (done == 0 && first_baud != NULL) {
+                *first_baud = byte.baud_rate;
+            }
+            data[done++] = byte.value;
+        }
+        if (done == count || now >= deadline) {
+            break;
+        }
+
+        // Wake up for the next byte on the wire, or when something changes
+        int64_t wake = deadline;
+        if (!_bytes.empty() && _bytes.front().arrival < wake) {
+            wake = _bytes.front().arrival;
+        }
+        waitUntil(lock, wake);
+    }
+    return done;
+}
+
+bool SerialLine::sleepUntil(int64_t deadline, uint32_t epoch)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (_epoch == epoch && esp_timer_get_time() < deadline) {
+        waitUntil(lock, deadline);
+    }
+    return _epoch == epoch;
+}
+
+size_t SerialLine::available()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    const int64_t now = esp_timer_get_time();
+    size_t count = 0;
+    while (count < _bytes.size() && _bytes[count].arrival <= now) {
+        count++;
+    }
+    return count;
+}
+
+void SerialLine::flush()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    const int64_t now = esp_timer_get_time();
+    while (!_bytes.empty() && _bytes.front().arrival <= now) {
+        _bytes.pop_front();
+    }
+}
+
+void SerialLine::clear()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _bytes.clear();
+    _busy_until = 0;
+}
+
+void SerialLine::interrupt()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _epoch++;
+    _changed.notify_all();
+}
+
+uint32_t SerialLine::epoch()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _epoch;
+}
+
+int64_t SerialLine::idleAt()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _busy_until;
+}
+
+} // namespace stm32host
@@ -0,0 +1,78 @@
+#ifndef _SERIAL_LINE_H
+#define _SERIAL_LINE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+namespace stm32host {
+
+#define UART_BITS_PER_BYTE 11 // Start, 8 data, even parity, stop
+
+/**
+ * @brief One direction of a UART link
+ *
+ * A byte sent at a baud rate becomes readable once its transfer on the wire is over (right away
+ * when untimed). Bytes keep their baud rate: the receiver drops those sent at another rate, as a
+ * UART does with the framing errors they cause.
+ */
+class SerialLine {
+public:
+    /**
+     * @brief Queue bytes behind the ones still on the wire
+     * @return Time the last byte arrives (us, esp_timer_get_time() clock)
+     */
+    int64_t send(const uint8_t *data, size_t count, uint32_t baud_rate, bool timed);
+
+    /**
+     * @brief Read up to count bytes, waiting until deadline (us, INT64_MAX for no deadline)
+     *
+     * Stops early when interrupt() is called after epoch() returned the given epoch
+     *
+     * @param baud_rate Drop the bytes sent at another rate, 0 to accept all of them
+     * @param first_arrival Set to the arrival time of the first byte read, may be NULL
+     * @param first_baud Set to the baud rate of the first byte read, may be NULL
+     * @return Bytes read
+     */
+    size_t receive(uint8_t *data, size_t count, int64_t deadline, uint32_t baud_rate, uint32_t epoch,
+                   int64_t *first_arrival = NULL, uint32_t *first_baud = NULL);
+
+    /**
+     * @brief Wait until deadline (us), false if interrupted since epoch
+     */
+    bool sleepUntil(int64_t deadline, uint32_t epoch);
+
+    // Bytes already arrived
+    size_t available();
+    // Drop the bytes already arrived, the ones still on the wire are kept
+    void flush();
+    // Drop all the bytes, as a line that was cut
+    void clear();
+    // Wake up the receive() and sleepUntil() callers
+    void interrupt();
+    uint32_t epoch();
+    // Time the last byte sent arrives (us)
+    int64_t idleAt();
+
+private:
+    struct Byte {
+        int64_t arrival;
+        uint32_t baud_rate;
+        uint8_t value;
+    };
+
+    bool waitUntil(std::unique_lock<std::mutex> &lock, int64_t deadline);
+
+    std::mutex _mutex;
+    std::condition_variable _changed;
+    std::deque<Byte> _bytes;
+    int64_t _busy_until = 0;
+    uint32_t _epoch = 0;
+};
+
+} // namespace stm32host
+
+#endif
@@ -0,0 +1,711 @@
+#include "stm32_emulator.h"
+#include "esp_timer.h"
+
+#include <string.h>
+#include <time.h>
+
+namespace stm32host {
+
+#define ACK 0x79
+#define NACK 0x1F
+#define SYNC 0x7F
+
+#define CMD_GET 0x00
+#define CMD_GET_VERSION 0x01
+#define CMD_GET_ID 0x02
+#define CMD_READ 0x11
+#define CMD_GO 0x21
+#define CMD_WRITE 0x31
+#define CMD_ERASE 0x43
+#define CMD_EXT_ERASE 0x44
+
+void LatencyHistogram::add(uint32_t us)
+{
+    int bucket = 0;
+    while (bucket < BUCKETS - 1 && us >= (1u << bucket)) {
+        bucket++;
+    }
+    buckets[bucket]++;
+    count++;
+    total_us += us;
+    min_us = (us < min_us) ? us : min_us;
+    max_us = (us > max_us) ? us : max_us;
+}
+
+void LatencyHistogram::merge(const LatencyHistogram &other)
+{
+    for (int i = 0; i < BUCKETS; i++) {
+        buckets[i] += other.buckets[i];
+    }
+    count += other.count;
+    total_us += other.total_us;
+    min_us = (other.min_us < min_us) ? other.min_us : min_us;
+    max_us = (other.max_us > max_us) ? other.max_us : max_us;
+}
+
+uint32_t LatencyHistogram::percentile(double fraction) const
+{
+    const double target = fraction * count;
+    uint32_t seen = 0;
+    for (int i = 0; i < BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen > 0 && seen >= target) {
+            return 1u << i;
+        }
+    }
+    return 0;
+}
+
+void LatencyHistogram::print(FILE *out, const char *name) const
+{
+    if (count == 0) {
+        fprintf(out, "%-12s no samples\n", name);
+        return;
+    }
+    fprintf(out, "%-12s %6lu samples, min %lu / avg %lu / max %lu us, p50 < %lu us, p99 < %lu us\n", name,
+            (unsigned long)count, (unsigned long)min_us, (unsigned long)average(), (unsigned long)max_us,
+            (unsigned long)percentile(0.5), (unsigned long)percentile(0.99));
+
+    uint32_t largest = 0;
+    for (int i = 0; i < BUCKETS; i++) {
+        largest = (buckets[i] > largest) ? buckets[i] : largest;
+    }
+    for (int i = 0; i < BUCKETS; i++) {
+        if (buckets[i] == 0) {
+            continue;
+        }
+        const unsigned long low = (i == 0) ? 0 : (1ul << (i - 1));
+        const int bar = (int)((uint64_t)buckets[i] * 40 / largest);
+        fprintf(out, "    %8lu - %8lu us |%-40.*s| %lu\n", low, (1ul << i) - 1, (bar > 0) ? bar : 1,
+                "########################################", (unsigned long)buckets[i]);
+    }
+}
+
+EmulatorConfig EmulatorConfig::f411()
+{
+    EmulatorConfig config;
+    config.product_id = 0x431;
+    config.bootloader_version = 0x31;
+    config.commands = {0x00, 0x01, 0x02, 0x11, 0x21, 0x31, 0x44, 0x63, 0x73, 0x82, 0x92};
+    config.pages = {{4, 16 * 1024}, {1, 64 * 1024}, {3, 128 * 1024}};
+    config.flash_size_address = 0x1FFF7A22;
+    config.uid_address = 0x1FFF7A10;
+    return config;
+}
+
+EmulatorConfig EmulatorConfig::g071()
+{
+    EmulatorConfig config;
+    config.product_id = 0x460;
+    config.bootloader_version = 0x31;
+    config.commands = {0x00, 0x01, 0x02, 0x11, 0x21, 0x31, 0x44, 0x63, 0x73, 0x82, 0x92};
+    config.pages = {{64, 2048}};
+    config.flash_size_address = 0x1FFF75E0;
+    config.uid_address = 0x1FFF7590;
+    config.write_align = 8;
+    return config;
+}
+
+EmulatorConfig EmulatorConfig::g0b1()
+{
+    EmulatorConfig config = g071();
+    config.product_id = 0x467;
+    config.pages = {{128, 2048}, {128, 0}, {128, 2048}};
+    return config;
+}
+
+uint32_t EmulatorConfig::flashSize() const
+{
+    uint32_t size = 0;
+    for (const PageRun &run : pages) {
+        size += run.count * run.size;
+    }
+    return size;
+}
+
+Stm32Emulator::Stm32Emulator(const EmulatorConfig &config)
+    : _config(config), _flash(config.flashSize(), 0xFF)
+{
+    _thread = std::thread(&Stm32Emulator::run, this);
+}
+
+Stm32Emulator::~Stm32Emulator()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stopping = true;
+        _from_host.interrupt();
+        _changed.notify_all();
+    }
+    _thread.join();
+}
+
+Stm32Emulator::Mode Stm32Emulator::mode()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _mode;
+}
+
+uint32_t Stm32Emulator::baudRate()
+{
+    return _baud_rate.load();
+}
+
+uint32_t Stm32Emulator::startAddress()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _start_address;
+}
+
+void Stm32Emulator::eraseAll()
+{
+    memset(_flash.data(), 0xFF, _flash.size());
+}
+
+EmulatorStats Stm32Emulator::stats()
+{
+    std::lock_guard<std::mutex> lock(_stats_mutex);
+    return _stats;
+}
+
+void Stm32Emulator::resetStats()
+{
+    std::lock_guard<std::mutex> lock(_stats_mutex);
+    _stats = EmulatorStats();
+    _frames = 0;
+}
+
+void Stm32Emulator::connect(SerialLine *to_host)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _to_host = to_host;
+}
+
+void Stm32Emulator::receive(const uint8_t *data, size_t count, uint32_t baud_rate)
+{
+    _from_host.send(data, count, baud_rate, _config.wire_time);
+}
+
+void Stm32Emulator::setResetLevel(bool high, bool boot0_high)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (!high) {
+        if (!_reset_asserted) {
+            // Whatever the bootloader was doing is lost, with the bytes still in its USART
+            _reset_asserted = true;
+            _mode = MODE_RESET;
+            _boot_pending = false;
+            _from_host.interrupt();
+            _from_host.clear();
+            std::lock_guard<std::mutex> stats_lock(_stats_mutex);
+            _stats.resets++;
+        }
+        return;
+    }
+    if (!_reset_asserted) {
+        return;
+    }
+
+    // BOOT0 is sampled on the rising edge of NRST
+    _reset_asserted = false;
+    _mode = boot0_high ? MODE_BOOTLOADER : MODE_APPLICATION;
+    _boot_pending = boot0_high;
+    _start_address = 0;
+    _baud_rate = 0;
+    _silent = false;
+    _changed.notify_all();
+}
+
+void Stm32Emulator::run()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    for (;;) {
+        _changed.wait(lock, [this] { return _stopping || _boot_pending; });
+        if (_stopping) {
+            return;
+        }
+        _boot_pending = false;
+        const uint32_t epoch = _from_host.epoch();
+        lock.unlock();
+
+        bootloader(epoch);
+
+        lock.lock();
+    }
+}
+
+static uint64_t threadCpuTime()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void Stm32Emulator::bootloader(uint32_t epoch)
+{
+    // Autobaud: the first sync byte received at a supported rate sets the baud rate
+    for (;;) {
+        uint8_t byte = 0;
+        uint32_t baud_rate = 0;
+        if (_from_host.receive(&byte, 1, INT64_MAX, 0, epoch, NULL, &baud_rate) != 1) {
+            return;
+        }
+        if (byte == SYNC && (_config.max_baud == 0 || baud_rate <= _config.max_baud)) {
+            _baud_rate = baud_rate;
+            break;
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(_stats_mutex);
+        _stats.syncs++;
+    }
+    sendByte(ACK);
+
+    for (;;) {
+        uint8_t command[2];
+        int64_t start = 0;
+        if (!read(command, sizeof(command), epoch, &start)) {
+            return;
+        }
+
+        if ((uint8_t)(command[0] ^ command[1]) != 0xFF || !supports(command[0])) {
+            nack();
+            continue;
+        }
+        const uint8_t code = command[0];
+        if (_config.read_protected &&
+            (code == CMD_READ || code == CMD_GO || code == CMD_WRITE || code == CMD_ERASE || code == CMD_EXT_ERASE)) {
+            nack();
+            continue;
+        }
+
+        bool alive = true;
+        bool started = false;
+        switch (code) {
+        case CMD_GET:
+            alive = cmdGet(epoch);
+            break;
+        case CMD_GET_VERSION: {
+            const uint8_t reply[] = {ACK, _config.bootloader_version, 0x00, 0x00, ACK};
+            send(reply, sizeof(reply));
+            break;
+        }
+        case CMD_GET_ID: {
+            const uint8_t reply[] = {ACK, 0x01, (uint8_t)(_config.product_id >> 8), (uint8_t)_config.product_id, ACK};
+            send(reply, sizeof(reply));
+            break;
+        }
+        case CMD_READ:
+            alive = cmdRead(epoch);
+            break;
+        case CMD_GO:
+            alive = cmdGo(epoch, &started);
+            break;
+        case CMD_WRITE:
+            alive = cmdWrite(epoch);
+            break;
+        case CMD_ERASE:
+            alive = cmdErase(epoch);
+            break;
+        case CMD_EXT_ERASE:
+            alive = cmdExtErase(epoch);
+            break;
+        default:
+            // Listed by GET but not emulated (write and read protection commands)
+            nack();
+            break;
+        }
+        if (!alive) {
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(_stats_mutex);
+            const int64_t end = (_reply_end > start) ? _reply_end : esp_timer_get_time();
+            _stats.commands[code].add((uint32_t)(end - start));
+        }
+        _cpu_us = threadCpuTime();
+
+        if (started) {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (_from_host.epoch() == epoch) {
+                _mode = MODE_APPLICATION;
+            }
+            return;
+        }
+    }
+}
+
+bool Stm32Emulator::read(uint8_t *data, size_t count, uint32_t epoch, int64_t *arrival)
+{
+    int64_t first = 0;
+    if (_from_host.receive(data, count, INT64_MAX, _baud_rate, epoch, &first) != count) {
+        return false;
+    }
+    if (arrival != NULL) {
+        *arrival = first;
+    }
+
+    std::lock_guard<std::mutex> lock(_stats_mutex);
+    _stats.bytes_received += count;
+    if (_reply_end != 0) {
+        // The arrival time is the end of the byte on the wire
+        const int64_t byte_us = _config.wire_time ? (int64_t)UART_BITS_PER_BYTE * 1000000 / _baud_rate : 0;
+        const int64_t turnaround = first - byte_us - _reply_end;
+        _stats.turnaround.add((turnaround > 0) ? (uint32_t)turnaround : 0);
+        _reply_end = 0;
+    }
+    return true;
+}
+
+bool Stm32Emulator::readAddress(uint32_t *address, bool *valid, uint32_t epoch)
+{
+    uint8_t bytes[5];
+    if (!read(bytes, sizeof(bytes), epoch)) {
+        return false;
+    }
+    *address = ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) | ((uint32_t)bytes[2] << 8) | bytes[3];
+    *valid = (uint8_t)(bytes[0] ^ bytes[1] ^ bytes[2] ^ bytes[3]) == bytes[4];
+    return true;
+}
+
+void Stm32Emulator::send(const uint8_t *data, size_t count)
+{
+    if (_silent || _to_host == NULL) {
+        return;
+    }
+    const int64_t end = _to_host->send(data, count, _baud_rate, _config.wire_time);
+
+    std::lock_guard<std::mutex> lock(_stats_mutex);
+    _stats.bytes_sent += count;
+    _reply_end = end;
+}
+
+void Stm32Emulator::nack()
+{
+    sendByte(NACK);
+    std::lock_guard<std::mutex> lock(_stats_mutex);
+    _stats.nacks++;
+}
+
+bool Stm32Emulator::busy(uint32_t us, uint32_t epoch)
+{
+    return us == 0 || _from_host.sleepUntil(esp_timer_get_time() + us, epoch);
+}
+
+bool Stm32Emulator::supports(uint8_t command) const
+{
+    for (uint8_t code : _config.commands) {
+        if (code == command) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Stm32Emulator::isFlash(uint32_t address, uint32_t count) const
+{
+    return address >= EMULATOR_FLASH_BASE && count <= _flash.size() &&
+           address - EMULATOR_FLASH_BASE <= _flash.size() - count;
+}
+
+bool Stm32Emulator::readMemory(uint32_t address, uint8_t *data, uint32_t count) const
+{
+    if (isFlash(address, count)) {
+        memcpy(data, &_flash[address - EMULATOR_FLASH_BASE], count);
+        return true;
+    }
+
+    // System memory: flash size register (KB, little-endian) and unique ID
+    const uint16_t size_kb = _flash.size() / 1024;
+    const uint8_t size_register[2] = {(uint8_t)size_kb, (uint8_t)(size_kb >> 8)};
+    for (uint32_t i = 0; i < count; i++) {
+        const uint32_t at = address + i;
+        if (at - _config.flash_size_address < sizeof(size_register)) {
+            data[i] = size_register[at - _config.flash_size_address];
+        } else if (at - _config.uid_address < EMULATOR_UID_SIZE) {
+            data[i] = _config.uid[at - _config.uid_address];
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+uint32_t Stm32Emulator::pageSize(int page) const
+{
+    for (const EmulatorConfig::PageRun &run : _config.pages) {
+        if ((uint32_t)page < run.count) {
+            return run.size;
+        }
+        page -= run.count;
+    }
+    return 0;
+}
+
+bool Stm32Emulator::erasePage(int page)
+{
+    uint32_t start = 0;
+    for (const EmulatorConfig::PageRun &run : _config.pages) {
+        if ((uint32_t)page < run.count) {
+            start += page * run.size;
+            memset(&_flash[start], 0xFF, run.size);
+            return true;
+        }
+        start += run.count * run.size;
+        page -= run.count;
+    }
+    return false;
+}
+
+bool Stm32Emulator::cmdGet(uint32_t epoch)
+{
+    // [ACK][N][version][N command codes][ACK]
+    std::vector<uint8_t> reply = {ACK, (uint8_t)_config.commands.size(), _config.bootloader_version};
+    reply.insert(reply.end(), _config.commands.begin(), _config.commands.end());
+    reply.push_back(ACK);
+    send(reply.data(), reply.size());
+    return true;
+}
+
+bool Stm32Emulator::cmdRead(uint32_t epoch)
+{
+    sendByte(ACK);
+
+    uint32_t address;
+    bool valid;
+    uint8_t probe;
+    if (!readAddress(&address, &valid, epoch)) {
+        return false;
+    }
+    if (!valid || !readMemory(address, &probe, 1)) {
+        nack();
+        return true;
+    }
+    sendByte(ACK);
+
+    // [N][~N], N + 1 bytes to read
+    uint8_t count[2];
+    if (!read(count, sizeof(count), epoch)) {
+        return false;
+    }
+    uint8_t data[256];
+    if ((uint8_t)(count[0] ^ count[1]) != 0xFF || !readMemory(address, data, count[0] + 1)) {
+        nack();
+        return true;
+    }
+    sendByte(ACK);
+    send(data, count[0] + 1);
+
+    std::lock_guard<std::mutex> lock(_stats_mutex);
+    _stats.blocks_read++;
+    return true;
+}
+
+bool Stm32Emulator::cmdGo(uint32_t epoch, bool *started)
+{
+    sendByte(ACK);
+
+    uint32_t address;
+    bool valid;
+    if (!readAddress(&address, &valid, epoch)) {
+        return false;
+    }
+    if (!valid || !isFlash(address, 4)) {
+        nack();
+        return true;
+    }
+    sendByte(ACK);
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    _start_address = address;
+    *started = true;
+    return true;
+}
+
+bool Stm32Emulator::cmdWrite(uint32_t epoch)
+{
+    sendByte(ACK);
+
+    uint32_t address;
+    bool valid;
+    if (!readAddress(&address, &valid, epoch)) {
+        return false;
+    }
+    if (!valid || !isFlash(address, 1) || address % _config.write_align != 0) {
+        nack();
+        return true;
+    }
+    sendByte(ACK);
+
+    // [N][N + 1 bytes][XOR of N and the bytes]
+    uint8_t frame[1 + 256 + 1];
+    if (!read(frame, 1, epoch) || !read(&frame[1], frame[0] + 2, epoch)) {
+        return false;
+    }
+    const uint32_t count = frame[0] + 1;
+    uint8_t checksum = 0;
+    for (uint32_t i = 0; i <= count; i++) {
+        checksum ^= frame[i];
+    }
+    if (checksum != frame[count + 1] || count % _config.write_align != 0 || !isFlash(address, count)) {
+        nack();
+        return true;
+    }
+
+    uint32_t frames;
+    {
+        std::lock_guard<std::mutex> lock(_stats_mutex);
+        frames = ++_frames;
+    }
+    if (_config.silent_after > 0 && frames > _config.silent_after) {
+        _silent = true;
+        return true;
+    }
+    if (_config.nack_every > 0 && frames % _config.nack_every == 0) {
+        nack();
+        return true;
+    }
+
+    if (!busy(_config.write_us, epoch)) {
+        return false;
+    }
+    // Programming can only clear bits
+    for (uint32_t i = 0; i < count; i++) {
+        if (_config.stuck_address == 0 || address + i != _config.stuck_address) {
+            _flash[address - EMULATOR_FLASH_BASE + i] &= frame[1 + i];
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(_stats_mutex);
+        _stats.blocks_written++;
+    }
+
+    if (_config.lost_ack_every > 0 && frames % _config.lost_ack_every == 0) {
+        return true;
+    }
+    sendByte(ACK);
+    return true;
+}
+
+bool Stm32Emulator::cmdErase(uint32_t epoch)
+{
+    sendByte(ACK);
+
+    // [N][N + 1 page numbers][XOR], or [0xFF][0x00] for a mass erase
+    uint8_t params[1 + 256 + 1];
+    if (!read(params, 1, epoch)) {
+        return false;
+    }
+    if (params[0] == 0xFF) {
+        if (!read(&params[1], 1, epoch)) {
+            return false;
+        }
+        if (params[1] != 0x00) {
+            nack();
+            return true;
+        }
+        if (!busy(_config.mass_erase_us, epoch)) {
+            return false;
+        }
+        eraseAll();
+        {
+            std::lock_guard<std::mutex> lock(_stats_mutex);
+            _stats.mass_erases++;
+        }
+        sendByte(ACK);
+        return true;
+    }
+
+    const int count = params[0] + 1;
+    if (!read(&params[1], count + 1, epoch)) {
+        return false;
+    }
+    uint8_t checksum = 0;
+    bool valid = true;
+    for (int i = 0; i <= count; i++) {
+        checksum ^= params[i];
+        valid &= (i == 0 || pageSize(params[i]) > 0);
+    }
+    if (!valid || checksum != params[count + 1]) {
+        nack();
+        return true;
+    }
+
+    if (!busy(_config.page_erase_us * count, epoch)) {
+        return false;
+    }
+    for (int i = 1; i <= count; i++) {
+        erasePage(params[i]);
+    }
+    {
+        std::lock_guard<std::mutex> lock(_stats_mutex);
+        _stats.pages_erased += count;
+    }
+    sendByte(ACK);
+    return true;
+}
+
+bool Stm32Emulator::cmdExtErase(uint32_t epoch)
+{
+    sendByte(ACK);
+
+    // [N MSB][N LSB][N + 1 page numbers, MSB first][XOR], or a special code from 0xFFF0 and its XOR
+    uint8_t params[2];
+    if (!read(params, 2, epoch)) {
+        return false;
+    }
+    const uint32_t code = ((uint32_t)params[0] << 8) | params[1];
+    if (code >= 0xFFF0) {
+        uint8_t checksum;
+        if (!read(&checksum, 1, epoch)) {
+            return false;
+        }
+        // Mass erase, bank 1 or bank 2 erase: the whole flash memory here
+        if (checksum != (params[0] ^ params[1]) || code < 0xFFFD) {
+            nack();
+            return true;
+        }
+        if (!busy(_config.mass_erase_us, epoch)) {
+            return false;
+        }
+        eraseAll();
+        {
+            std::lock_guard<std::mutex> lock(_stats_mutex);
+            _stats.mass_erases++;
+        }
+        sendByte(ACK);
+        return true;
+    }
+
+    const uint32_t count = code + 1;
+    std::vector<uint8_t> pages(2 * count + 1);
+    if (!read(pages.data(), pages.size(), epoch)) {
+        return false;
+    }
+    uint8_t checksum = params[0] ^ params[1];
+    bool valid = true;
+    for (uint32_t i = 0; i < count; i++) {
+        checksum ^= pages[2 * i] ^ pages[2 * i + 1];
+        valid &= (pageSize((pages[2 * i] << 8) | pages[2 * i + 1]) > 0);
+    }
+    if (!valid || checksum != pages[2 * count]) {
+        nack();
+        return true;
+    }
+
+    if (!busy(_config.page_erase_us * count, epoch)) {
+        return false;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        erasePage((pages[2 * i] << 8) | pages[2 * i + 1]);
+    }
+    {
+        std::lock_guard<std::mutex> lock(_stats_mutex);
+        _stats.pages_erased += count;
+    }
+    sendByte(ACK);
+    return true;
+}
+
+} // namespace stm32host
@@ -0,0 +1,203 @@
+#ifndef _STM32_EMULATOR_H
+#define _STM32_EMULATOR_H
+
+#include "serial_line.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace stm32host {
+
+#define EMULATOR_FLASH_BASE 0x08000000
+#define EMULATOR_UID_SIZE 12
+
+/**
+ * @brief Latencies in power-of-two buckets of microseconds
+ *
+ * Bucket 0 holds latencies under 1 us, bucket i those from 2^(i-1) to 2^i - 1 us, the last one everything above
+ */
+struct LatencyHistogram {
+    static constexpr int BUCKETS = 26;
+
+    uint32_t buckets[BUCKETS] = {};
+    uint32_t count = 0;
+    uint64_t total_us = 0;
+    uint32_t min_us = UINT32_MAX;
+    uint32_t max_us = 0;
+
+    void add(uint32_t us);
+    void merge(const LatencyHistogram &other);
+    uint32_t average() const { return (count > 0) ? (uint32_t)(total_us / count) : 0; }
+    // Upper bound of the bucket holding the given fraction (0 to 1) of the latencies
+    uint32_t percentile(double fraction) const;
+    // One line of summary, then one line per non-empty bucket
+    void print(FILE *out, const char *name) const;
+};
+
+/**
+ * @brief Bootloader statistics of an emulated target
+ */
+struct EmulatorStats {
+    LatencyHistogram commands[256]; // Per command code: from the command byte to the last byte of the reply
+    LatencyHistogram turnaround;    // Host reaction: from the end of a reply on the wire to the start of the next byte
+    uint32_t resets = 0;
+    uint32_t syncs = 0;
+    uint32_t nacks = 0;
+    uint32_t blocks_written = 0;
+    uint32_t blocks_read = 0;
+    uint32_t pages_erased = 0;
+    uint32_t mass_erases = 0;
+    uint64_t bytes_received = 0;
+    uint64_t bytes_sent = 0;
+};
+
+/**
+ * @brief Emulated STM32 part and the behavior of its bootloader
+ *
+ * The default is an STM32F103 medium-density (PID 0x410) with instant flash operations and wire times at the UART rate
+ */
+struct EmulatorConfig {
+    struct PageRun {
+        uint32_t count; // Pages (or sectors) in the run
+        uint32_t size;  // Bytes per page
+    };
+
+    uint16_t product_id = 0x410;
+    uint8_t bootloader_version = 0x22;
+    std::vector<uint8_t> commands = {0x00, 0x01, 0x02, 0x11, 0x21, 0x31, 0x43, 0x63, 0x73, 0x82, 0x92};
+    std::vector<PageRun> pages = {{128, 1024}}; // Erase geometry, as numbered by the erase commands (size 0: unused numbers)
+    uint32_t flash_size_address = 0x1FFFF7E0;   // 16-bit flash size register (KB)
+    uint32_t uid_address = 0x1FFFF7E8;
+    uint8_t uid[EMULATOR_UID_SIZE] = {0x34, 0xFF, 0xD8, 0x05, 0x42, 0x47, 0x31, 0x38, 0x21, 0x67, 0x16, 0x43};
+    uint32_t write_align = 4; // WRITE MEMORY address and length unit (8 on double-word families)
+
+    bool wire_time = true;    // Bytes take their transfer time on the wire, off for fast functional tests
+    uint32_t max_baud = 0;    // Sync bytes sent faster are lost (0: any rate)
+    bool read_protected = false; // READ, WRITE, GO and erases are NACKed
+
+    // Flash timings (us)
+    uint32_t write_us = 0;       // Programming of a WRITE MEMORY block
+    uint32_t page_erase_us = 0;  // Per erased page
+    uint32_t mass_erase_us = 0;
+
+    // Fault injection, counted on WRITE MEMORY frames (0: off)
+    uint32_t nack_every = 0;     // NACK every Nth frame without programming it
+    uint32_t lost_ack_every = 0; // Program every Nth frame but never send its ACK
+    uint32_t silent_after = 0;   // Stop answering after N frames, until the next reset (target unplugged)
+    uint32_t stuck_address = 0;  // Flash byte that never programs (bad cell), 0 for none
+
+    // STM32F411 (PID 0x431): 512KB in 16KB to 128KB sectors, EXTENDED ERASE
+    static EmulatorConfig f411();
+    // STM32G07x (PID 0x460): 128KB in 2KB pages, double-word programming, EXTENDED ERASE
+    static EmulatorConfig g071();
+    // STM32G0B1 (PID 0x467): 512KB in two banks of 2KB pages, bank 2 erased as pages 256 to 383
+    static EmulatorConfig g0b1();
+
+    uint32_t flashSize() const;
+};
+
+/**
+ * @brief STM32 running the USART bootloader of AN3155, on a thread of its own
+ *
+ * Wired to a UART and to the reset and BOOT0 GPIOs with attachTarget(). Releasing the reset
+ * pin boots the bootloader if BOOT0 is high, the (silent) application otherwise. The flash
+ * reads 0xFF once erased and programming can only clear bits, as on the real memory.
+ */
+class Stm32Emulator {
+public:
+    enum Mode {
+        MODE_RESET = 0,
+        MODE_BOOTLOADER,
+        MODE_APPLICATION,
+    };
+
+    explicit Stm32Emulator(const EmulatorConfig &config = EmulatorConfig());
+    ~Stm32Emulator();
+    Stm32Emulator(const Stm32Emulator &) = delete;
+    Stm32Emulator &operator=(const Stm32Emulator &) = delete;
+
+    // Options and faults can be changed between flashes, the layout and commands are fixed
+    EmulatorConfig &config() { return _config; }
+
+    Mode mode();
+    // Baud rate locked by the last sync, 0 before the first one
+    uint32_t baudRate();
+    // Address the application was started at by GO, 0 if it was started by a reset
+    uint32_t startAddress();
+
+    // Flash memory contents, from EMULATOR_FLASH_BASE (only read or set while the target is idle)
+    std::vector<uint8_t> &flash() { return _flash; }
+    void eraseAll();
+
+    EmulatorStats stats();
+    void resetStats();
+    // CPU time used by the bootloader thread so far (us), to tell it apart from the host side
+    uint64_t cpuTime() const { return _cpu_us.load(); }
+
+    // Wiring, see attachTarget()
+    void connect(SerialLine *to_host);
+    void receive(const uint8_t *data, size_t count, uint32_t baud_rate);
+    void setResetLevel(bool high, bool boot0_high);
+
+private:
+    void run();
+    void bootloader(uint32_t epoch);
+
+    // Read bytes at the locked rate, false on reset
+    bool read(uint8_t *data, size_t count, uint32_t epoch, int64_t *arrival = NULL);
+    // Read an address and its checksum, valid is cleared on a checksum mismatch; false on reset
+    bool readAddress(uint32_t *address, bool *valid, uint32_t epoch);
+    void send(const uint8_t *data, size_t count);
+    void sendByte(uint8_t value) { send(&value, 1); }
+    // Spend the time of a flash operation, false on reset
+    bool busy(uint32_t us, uint32_t epoch);
+
+    bool supports(uint8_t command) const;
+    bool isFlash(uint32_t address, uint32_t count) const;
+    bool readMemory(uint32_t address, uint8_t *data, uint32_t count) const;
+    uint32_t pageSize(int page) const; // 0 for a page number without flash
+    bool erasePage(int page);
+
+    // Command handlers (after the command byte and its complement): false on reset
+    bool cmdGet(uint32_t epoch);
+    bool cmdRead(uint32_t epoch);
+    bool cmdGo(uint32_t epoch, bool *started);
+    bool cmdWrite(uint32_t epoch);
+    bool cmdErase(uint32_t epoch);
+    bool cmdExtErase(uint32_t epoch);
+    void nack();
+
+    EmulatorConfig _config;
+    std::vector<uint8_t> _flash;
+
+    SerialLine _from_host;
+    SerialLine *_to_host = NULL;
+
+    std::mutex _mutex;
+    std::condition_variable _changed;
+    Mode _mode = MODE_APPLICATION;
+    bool _reset_asserted = false;
+    bool _stopping = false;
+    bool _boot_pending = false;
+    uint32_t _start_address = 0;
+    std::atomic<uint32_t> _baud_rate{0};
+    std::atomic<bool> _silent{false};
+
+    std::mutex _stats_mutex;
+    EmulatorStats _stats;
+    uint32_t _frames = 0;   // WRITE MEMORY frames since the last resetStats(), for the fault counters
+    int64_t _reply_end = 0; // End of the last reply on the wire, 0 once the host answered
+    std::atomic<uint64_t> _cpu_us{0};
+
+    std::thread _thread;
+};
+
+} // namespace stm32host
+
+#endif
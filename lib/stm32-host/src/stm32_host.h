@@ -0,0 +1,60 @@
+#ifndef _STM32_HOST_H
+#define _STM32_HOST_H
+
+// Host build of esp32-stm-flash: the hooks of the shims that have no ESP-IDF equivalent
+
+#include "driver/uart.h"
+#include "driver/gpio.h"
+#include "esp_log.h"
+
+namespace stm32host {
+
+class Stm32Emulator;
+
+/**
+ * @brief Wire an emulated STM32 to a UART: its USART to the port, its NRST and BOOT0 pins to the GPIOs
+ *
+ * The target must stay attached (and alive) while the library uses the UART
+ */
+void attachTarget(uart_port_t uart_num, Stm32Emulator &target, gpio_num_t reset_pin, gpio_num_t boot0_pin);
+
+/**
+ * @brief Unplug the target of a UART, writes to the port then go nowhere
+ */
+void detachTarget(uart_port_t uart_num);
+
+/**
+ * @brief Level last set on a GPIO, -1 if it was never driven
+ */
+int gpioLevel(gpio_num_t gpio_num);
+
+/**
+ * @brief Make a file available as a data partition, mapped with mmap by esp_partition_mmap()
+ *
+ * @return false if the file cannot be opened
+ */
+bool addPartition(const char *label, const char *path);
+
+/**
+ * @brief Remove all the partitions added with addPartition()
+ */
+void removePartitions();
+
+/**
+ * @brief Erase all the NVS namespaces, as a fresh nvs_flash_erase()
+ */
+void clearNvs();
+
+/**
+ * @brief Blobs written to NVS since the last clearNvs(), each one wearing the NVS partition
+ */
+uint32_t nvsWrites();
+
+/**
+ * @brief Most verbose level printed by the ESP_LOGx shims (ESP_LOG_WARN by default, or STM32_HOST_LOG_LEVEL)
+ */
+void setLogLevel(esp_log_level_t level);
+
+} // namespace stm32host
+
+#endif
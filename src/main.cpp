@@ -16,13 +16,19 @@ void setup() {
         .uart_tx = GPIO_NUM_43,
         .uart_rx = GPIO_NUM_6,
         .uart_num = (uart_port_t)UART_NUM_1,
+        // Skip the flash if the STM32 already runs this build: the firmware links a block holding
+        // its version and build hash right after its vector table (see "Skipping Up-to-Date Targets")
+        .fingerprint = FINGERPRINT_BLOCK,
+        .fingerprint_address = STM32_FLASH_BASE + 0x200,
     };
 
     Serial.println("Starting STM32 flash...");
 
     // Flash the STM32
     FlashStatus status = flash(config, "blink1000.bin");
-    if (status != SUCCESS) {
+    if (status == ALREADY_UP_TO_DATE) {
+        Serial.println("STM32 already up to date");
+    } else if (status != SUCCESS) {
         Serial.printf("STM32 flash aborted with error: %s\n", toString(status));
     } else {
         Serial.println("STM32 flash completed!");
@@ -0,0 +1,153 @@
+// Flashes running in a task of their own: waiting, cancelling and progress reports
+
+#include <unity.h>
+
+#include "STM32Flasher.h"
+#include "stm_flash.h"
+#include "host_images.h"
+#include "host_target.h"
+
+#include <vector>
+
+using namespace stm32flash;
+using namespace stm32flash::internal;
+using namespace stm32host;
+
+#define IMAGE_SIZE (32 * 1024)
+
+static std::vector<FlashProgress> s_progress;
+
+static void recordProgress(const FlashProgress &progress, void *arg)
+{
+    s_progress.push_back(progress);
+}
+
+static HostTarget &slowTarget(uint32_t write_us)
+{
+    EmulatorConfig emulator_config;
+    emulator_config.wire_time = false;
+    emulator_config.write_us = write_us;
+    return createTarget(UART_NUM_1, emulator_config);
+}
+
+void setUp(void)
+{
+    clearNvs();
+    s_progress.clear();
+}
+
+void tearDown(void)
+{
+    releaseTargets();
+}
+
+static void test_wait_status(void)
+{
+    HostTarget &target = slowTarget(0);
+    const std::vector<uint8_t> image = firmwareImage(IMAGE_SIZE);
+    FlashImage source;
+    source.data = image.data();
+    source.size = image.size();
+
+    // The status and report of the flash task, as flash() would have returned them
+    FlashHandle handle = flashAsync(target.config, source);
+    TEST_ASSERT_TRUE(handle.wait());
+    TEST_ASSERT_TRUE(handle.isDone());
+    TEST_ASSERT_EQUAL_INT(SUCCESS, handle.status());
+    TEST_ASSERT_EQUAL_UINT32(image.size(), handle.report().bytes_written);
+    TEST_ASSERT_TRUE(target.holds(0, image.data(), image.size()));
+
+    detachTarget(UART_NUM_1);
+    FlashHandle missing = flashAsync(target.config, source);
+    TEST_ASSERT_TRUE(missing.wait());
+    TEST_ASSERT_EQUAL_INT(ERROR_STM_NOT_FOUND, missing.status());
+
+    // Refused before any task starts
+    FlashConfig invalid = target.config;
+    invalid.reset_pin = GPIO_NUM_NC;
+    FlashHandle refused = flashAsync(invalid, source);
+    TEST_ASSERT_TRUE(refused.isDone());
+    TEST_ASSERT_EQUAL_INT(ERROR_CONFIG_INVALID, refused.status());
+}
+
+static void test_cancel_mid_write(void)
+{
+    HostTarget &target = slowTarget(1000);
+    target.config.resume = true;
+    const std::vector<uint8_t> image = firmwareImage(IMAGE_SIZE);
+    FlashImage source;
+    source.data = image.data();
+    source.size = image.size();
+
+    FlashHandle handle = flashAsync(target.config, source);
+    TEST_ASSERT_FALSE(handle.wait(1));
+    FlashProgress progress;
+    while (!handle.isDone()) {
+        progress = handle.progress();
+        if (progress.phase == PHASE_WRITE && progress.bytes_done >= IMAGE_SIZE / 4) {
+            break;
+        }
+        vTaskDelay(1);
+    }
+    handle.cancel();
+    TEST_ASSERT_TRUE(handle.wait());
+    TEST_ASSERT_EQUAL_INT(ERROR_CANCELLED, handle.status());
+
+    // The journal is kept for a resume, and the target has left the bootloader
+    FlashJournal journal;
+    TEST_ASSERT_TRUE(loadJournal(UART_NUM_1, journal));
+    TEST_ASSERT_GREATER_THAN(0, journal.next_offset);
+    TEST_ASSERT_LESS_THAN(IMAGE_SIZE, journal.next_offset);
+    TEST_ASSERT_EQUAL_INT(Stm32Emulator::MODE_APPLICATION, target.emulator.mode());
+
+    FlashReport report;
+    TEST_ASSERT_EQUAL_INT(SUCCESS, flash(target.config, source, &report));
+    TEST_ASSERT_EQUAL_UINT32(journal.next_offset, report.resumed_from);
+    TEST_ASSERT_TRUE(target.holds(0, image.data(), image.size()));
+}
+
+static void test_progress(void)
+{
+    HostTarget &target = slowTarget(0);
+    target.config.progress_callback = recordProgress;
+    const std::vector<uint8_t> image = firmwareImage(IMAGE_SIZE);
+    FlashImage source;
+    source.data = image.data();
+    source.size = image.size();
+
+    // Just past the 32-bit range of pdMS_TO_TICKS(), where the product wraps to 0 ticks: waits for the end
+    FlashHandle handle = flashAsync(target.config, source);
+    TEST_ASSERT_TRUE(handle.wait(UINT32_MAX / configTICK_RATE_HZ + 1));
+    TEST_ASSERT_EQUAL_INT(SUCCESS, handle.status());
+    TEST_ASSERT_EQUAL_INT(PHASE_DONE, handle.progress().phase);
+
+    // Phases in order, each reported as it starts, with bytes growing up to their total
+    TEST_ASSERT_GREATER_THAN(0, s_progress.size());
+    bool seen[PHASE_DONE + 1] = {false};
+    for (size_t i = 0; i < s_progress.size(); i++) {
+        const FlashProgress &progress = s_progress[i];
+        TEST_ASSERT_LESS_OR_EQUAL(progress.bytes_total, progress.bytes_done);
+        if (i > 0 && progress.phase == s_progress[i - 1].phase) {
+            TEST_ASSERT_GREATER_OR_EQUAL(s_progress[i - 1].bytes_done, progress.bytes_done);
+        } else {
+            TEST_ASSERT_TRUE(i == 0 || progress.phase > s_progress[i - 1].phase);
+            TEST_ASSERT_EQUAL_UINT32(0, progress.bytes_done);
+        }
+        if (i > 0 && progress.phase != s_progress[i - 1].phase && s_progress[i - 1].phase == PHASE_WRITE) {
+            TEST_ASSERT_EQUAL_UINT32(IMAGE_SIZE, s_progress[i - 1].bytes_done);
+        }
+        seen[progress.phase] = true;
+    }
+    TEST_ASSERT_TRUE(seen[PHASE_CONNECT] && seen[PHASE_ERASE] && seen[PHASE_WRITE] && seen[PHASE_VERIFY]);
+    TEST_ASSERT_FALSE(seen[PHASE_COMPARE]);
+    TEST_ASSERT_EQUAL_INT(PHASE_DONE, s_progress.back().phase);
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_wait_status);
+    RUN_TEST(test_cancel_mid_write);
+    RUN_TEST(test_progress);
+    return UNITY_END();
+}
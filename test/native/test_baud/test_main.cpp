@@ -0,0 +1,86 @@
+// Bootloader baud rate: a fixed rate other than 115200, and the fastest rate a target accepts with BAUD_PROBE
+
+#include <unity.h>
+
+#include "STM32Flasher.h"
+#include "host_images.h"
+#include "host_target.h"
+
+using namespace stm32flash;
+using namespace stm32host;
+
+static HostTarget &baudTarget(uint32_t max_baud)
+{
+    EmulatorConfig emulator_config;
+    emulator_config.wire_time = false;
+    emulator_config.max_baud = max_baud;
+    return createTarget(UART_NUM_1, emulator_config);
+}
+
+static FlashStatus flashData(HostTarget &target, const std::vector<uint8_t> &image, FlashReport *report)
+{
+    FlashImage source;
+    source.data = image.data();
+    source.size = image.size();
+    return flash(target.config, source, report);
+}
+
+void setUp(void)
+{
+    clearNvs();
+}
+
+void tearDown(void)
+{
+    releaseTargets();
+}
+
+static void test_fixed_rate(void)
+{
+    HostTarget &target = baudTarget(0);
+    target.config.baud_rate = 460800;
+    const std::vector<uint8_t> image = firmwareImage(4 * 1024);
+
+    FlashReport report;
+    TEST_ASSERT_EQUAL_INT(SUCCESS, flashData(target, image, &report));
+    TEST_ASSERT_EQUAL_UINT32(460800, report.baud_rate);
+    TEST_ASSERT_EQUAL_UINT32(1, target.emulator.stats().syncs);
+    TEST_ASSERT_TRUE(target.holds(0, image.data(), image.size()));
+
+    // Too fast for the target: fixed mode does not fall back
+    target.emulator.config().max_baud = 230400;
+    TEST_ASSERT_EQUAL_INT(ERROR_STM_NOT_FOUND, flashData(target, image, &report));
+}
+
+static void test_probe(void)
+{
+    // 921600 and 460800 are lost on the way, 230400 syncs
+    HostTarget &target = baudTarget(230400);
+    target.config.baud_rate = 921600;
+    target.config.baud_mode = BAUD_PROBE;
+    const std::vector<uint8_t> image = firmwareImage(4 * 1024);
+
+    FlashReport report;
+    TEST_ASSERT_EQUAL_INT(SUCCESS, flashData(target, image, &report));
+    TEST_ASSERT_EQUAL_UINT32(230400, report.baud_rate);
+    TEST_ASSERT_EQUAL_UINT32(1, target.emulator.stats().syncs);
+    // Flash mode entry, a retry of the first rate, one per slower rate, and the exit
+    TEST_ASSERT_EQUAL_UINT32(1 + 1 + 2 + 1, target.emulator.stats().resets);
+    TEST_ASSERT_GREATER_THAN(0, report.sync_us);
+    TEST_ASSERT_TRUE(target.holds(0, image.data(), image.size()));
+
+    // A target taking the configured rate is not probed further
+    target.emulator.config().max_baud = 0;
+    target.emulator.resetStats();
+    TEST_ASSERT_EQUAL_INT(SUCCESS, flashData(target, image, &report));
+    TEST_ASSERT_EQUAL_UINT32(921600, report.baud_rate);
+    TEST_ASSERT_EQUAL_UINT32(1 + 1, target.emulator.stats().resets);
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_fixed_rate);
+    RUN_TEST(test_probe);
+    return UNITY_END();
+}
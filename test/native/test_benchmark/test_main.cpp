@@ -0,0 +1,359 @@
+// Timings of the library against the emulated bootloader, with wire times and flash latencies
+//
+// Run with `pio test -e native -f native/test_benchmark -v` to see the tables. The numbers are those
+// of the host: use them to compare versions of the library, not as ESP32 figures.
+
+#include <unity.h>
+
+#include "STM32Flasher.h"
+#include "stm_pro_mode.h"
+#include "stm_flash.h"
+#include "host_images.h"
+#include "host_target.h"
+
+#include <time.h>
+
+using namespace stm32flash;
+using namespace stm32host;
+
+#define BENCH_BLOCKS 64
+
+static uint64_t cpuTime(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// STM32F103 at its datasheet programming time (16-bit writes of ~52 us)
+static EmulatorConfig f103Target()
+{
+    EmulatorConfig config;
+    config.write_us = 128 * 52;
+    config.page_erase_us = 20000;
+    config.mass_erase_us = 30000;
+    return config;
+}
+
+void setUp(void)
+{
+    clearNvs();
+}
+
+void tearDown(void)
+{
+    releaseTargets();
+}
+
+// WRITE MEMORY with the frame sent one byte per uart_write_bytes(), as before framed writes
+static esp_err_t writeBlockByteWise(uint32_t address, const char *data, uart_port_t uart_num)
+{
+    if (internal::cmdWrite(uart_num) != 1 || internal::loadAddress(address, uart_num) != 1) {
+        return ESP_FAIL;
+    }
+    const char length = (char)(BLOCK_SIZE - 1);
+    char checksum = length;
+    internal::sendData("length", &length, 1, uart_num);
+    for (int i = 0; i < BLOCK_SIZE; i++) {
+        internal::sendData("data", &data[i], 1, uart_num);
+        checksum ^= data[i];
+    }
+    internal::sendData("checksum", &checksum, 1, uart_num);
+
+    uint8_t resp = 0;
+    const int timeout = internal::replyTimeout(uart_num, BLOCK_SIZE + 3, internal::operationTimes(uart_num).write_ms);
+    return (internal::waitForSerialData(&resp, 1, timeout, uart_num) == 1 && resp == ACK) ? ESP_OK : ESP_FAIL;
+}
+
+// Block writes: CPU and wall time per 256-byte block, byte-wise writes against one framed write
+static void benchmark_block_write(void)
+{
+    const std::vector<uint8_t> image = firmwareImage(BENCH_BLOCKS * BLOCK_SIZE);
+
+    printf("\nBlock writes, %d blocks of %d bytes\n", BENCH_BLOCKS, BLOCK_SIZE);
+    printf("%-10s %-10s %12s %12s %8s\n", "wire", "frame", "wall ms/blk", "CPU us/blk", "retries");
+    for (int timed = 1; timed >= 0; timed--) {
+        for (int framed = 0; framed <= 1; framed++) {
+            EmulatorConfig emulator_config = f103Target();
+            emulator_config.wire_time = timed;
+            HostTarget &target = createTarget(UART_NUM_1, emulator_config);
+            Session session(target.config);
+            TEST_ASSERT_EQUAL_INT(SUCCESS, session.connect());
+            TEST_ASSERT_EQUAL_INT(SUCCESS, session.eraseAll());
+
+            const int64_t start = esp_timer_get_time();
+            const uint64_t cpu_start = cpuTime(CLOCK_THREAD_CPUTIME_ID);
+            int retries = 0;
+            for (int i = 0; i < BENCH_BLOCKS; i++) {
+                const uint32_t address = STM32_FLASH_BASE + i * BLOCK_SIZE;
+                const char *data = (const char *)&image[i * BLOCK_SIZE];
+                // An ACK delayed past its timeout (the host thread was descheduled) is recovered as writeBlock() does
+                esp_err_t err;
+                while ((err = framed ? internal::flashPage(address, data, UART_NUM_1)
+                                     : writeBlockByteWise(address, data, UART_NUM_1)) != ESP_OK && retries < 3) {
+                    internal::resyncSTM(UART_NUM_1);
+                    retries++;
+                }
+                TEST_ASSERT_EQUAL_INT(ESP_OK, err);
+            }
+            const uint64_t cpu_us = cpuTime(CLOCK_THREAD_CPUTIME_ID) - cpu_start;
+            const int64_t wall_us = esp_timer_get_time() - start;
+            session.disconnect();
+
+            TEST_ASSERT_TRUE(target.holds(0, image.data(), image.size()));
+            printf("%-10s %-10s %12.2f %12.1f %8d\n", timed ? "115200" : "untimed", framed ? "framed" : "byte-wise",
+                   wall_us / 1000.0 / BENCH_BLOCKS, (double)cpu_us / BENCH_BLOCKS, retries);
+            releaseTargets();
+        }
+    }
+}
+
+static const char *commandName(int code)
+{
+    switch (code) {
+    case CMD_GET:         return "GET";
+    case CMD_GET_VERSION: return "GET VERSION";
+    case CMD_GET_ID:      return "GET ID";
+    case CMD_READ:        return "READ";
+    case CMD_GO:          return "GO";
+    case CMD_WRITE:       return "WRITE";
+    case CMD_ERASE:       return "ERASE";
+    case CMD_EXT_ERASE:   return "EXT ERASE";
+    default:              return NULL;
+    }
+}
+
+// Command latencies: per command histograms of a full flash, and the host turnaround after each reply
+static void benchmark_command_latency(void)
+{
+    const std::vector<uint8_t> image = firmwareImage(16 * 1024);
+    HostTarget &target = createTarget(UART_NUM_1, f103Target());
+
+    FlashImage source;
+    source.data = image.data();
+    source.size = image.size();
+    FlashReport report;
+    TEST_ASSERT_EQUAL_INT(SUCCESS, flash(target.config, source, &report));
+    TEST_ASSERT_TRUE(target.holds(0, image.data(), image.size()));
+
+    const EmulatorStats stats = target.emulator.stats();
+    const uint32_t byte_us = UART_BITS_PER_BYTE * 1000000 / report.baud_rate;
+    printf("\nCommand latencies, %u byte image at %lu baud (one byte: %lu us)\n", (unsigned)image.size(),
+           (unsigned long)report.baud_rate, (unsigned long)byte_us);
+    for (int code = 0; code < 256; code++) {
+        if (stats.commands[code].count > 0 && commandName(code) != NULL) {
+            stats.commands[code].print(stdout, commandName(code));
+        }
+    }
+    stats.turnaround.print(stdout, "turnaround");
+    printf("Library ACK latency: %lu commands, min %lu / avg %lu / max %lu us\n", (unsigned long)report.ack_count,
+           (unsigned long)report.ack_min_us, (unsigned long)report.ack_avg_us, (unsigned long)report.ack_max_us);
+
+    // The next command starts within a few byte times of the reply, not on a scheduler tick
+    TEST_ASSERT_GREATER_THAN(0, stats.turnaround.count);
+    TEST_ASSERT_LESS_THAN(2000, stats.turnaround.average());
+}
+
+// Read-ahead: time the reads of a slow image add to a flash, against reading every block inline
+static void benchmark_pipeline_overlap(void)
+{
+    const std::vector<uint8_t> image = firmwareImage(8 * 1024);
+    const uint32_t delays_us[] = {0, 2000, 10000, 30000};
+    uint32_t base_us = 0;
+
+    printf("\nRead-ahead pipeline, %u byte image, reads delayed per block\n", (unsigned)image.size());
+    printf("%10s %8s %12s %14s %10s\n", "delay us", "reads", "write+verify", "inline reads", "hidden");
+    for (uint32_t delay_us : delays_us) {
+        HostTarget &target = createTarget(UART_NUM_1, f103Target());
+        SlowImageSource source(image, delay_us);
+        FlashReport report;
+        TEST_ASSERT_EQUAL_INT(SUCCESS, internal::flashImage(source, target.config, &report));
+        TEST_ASSERT_TRUE(target.holds(0, image.data(), image.size()));
+
+        // Serial engine: the reads would add up on top of the transfers
+        const uint32_t us = report.phase_us[PHASE_WRITE] + report.phase_us[PHASE_VERIFY];
+        const uint32_t read_us = source.reads * delay_us;
+        base_us = (delay_us == 0) ? us : base_us;
+        char hidden[16] = "-";
+        if (read_us > 0) {
+            const double shown = (double)(us - MIN(us, base_us)) / read_us;
+            snprintf(hidden, sizeof(hidden), "%.0f%%", 100.0 * (1.0 - MIN(shown, 1.0)));
+        }
+        printf("%10lu %8lu %9.1f ms %11.1f ms %10s\n", (unsigned long)delay_us, (unsigned long)source.reads,
+               us / 1000.0, read_us / 1000.0, hidden);
+        releaseTargets();
+    }
+}
+
+// Image sources: library CPU for one image kept in RAM, mapped from a partition, or read from a file
+static void benchmark_image_sources(void)
+{
+    const std::vector<uint8_t> image = firmwareImage(64 * 1024);
+    const char *path = "/tmp/stm32_bench_partition.bin";
+    TEST_ASSERT_TRUE(writeFile(path, image.data(), image.size()));
+    TEST_ASSERT_TRUE(addPartition("stm32", path));
+    const char *names[] = {"memory", "partition", "file"};
+
+    printf("\nImage sources, %u byte image, untimed wire (best of 3)\n", (unsigned)image.size());
+    printf("%-10s %10s %12s %14s\n", "source", "mount us", "wall ms", "library CPU ms");
+    for (int kind = 0; kind < 3; kind++) {
+        uint64_t best_cpu_us = UINT64_MAX;
+        int64_t best_wall_us = INT64_MAX;
+        uint32_t mount_us = 0;
+        for (int run = 0; run < 3; run++) {
+            EmulatorConfig emulator_config;
+            emulator_config.wire_time = false;
+            HostTarget &target = createTarget(UART_NUM_1, emulator_config);
+            FILE *file = (kind == 2) ? fopen(path, "rb") : NULL;
+
+            const int64_t start = esp_timer_get_time();
+            const uint64_t cpu_start = cpuTime(CLOCK_PROCESS_CPUTIME_ID);
+            FlashReport report;
+            if (kind == 2) {
+                internal::FileImageSource source(file, image.size());
+                TEST_ASSERT_EQUAL_INT(SUCCESS, internal::flashImage(source, target.config, &report));
+            } else {
+                FlashImage source;
+                source.data = (kind == 0) ? image.data() : NULL;
+                source.partition_label = (kind == 1) ? "stm32" : NULL;
+                source.size = image.size();
+                TEST_ASSERT_EQUAL_INT(SUCCESS, flash(target.config, source, &report));
+            }
+            // The emulator thread runs in the same process: its CPU is not the library's
+            const uint64_t cpu_us = cpuTime(CLOCK_PROCESS_CPUTIME_ID) - cpu_start - target.emulator.cpuTime();
+            const int64_t wall_us = esp_timer_get_time() - start;
+            if (file != NULL) {
+                fclose(file);
+            }
+            TEST_ASSERT_TRUE(target.holds(0, image.data(), image.size()));
+
+            best_cpu_us = MIN(best_cpu_us, cpu_us);
+            best_wall_us = MIN(best_wall_us, wall_us);
+            mount_us = report.mount_us;
+            releaseTargets();
+        }
+        printf("%-10s %10lu %12.1f %14.1f\n", names[kind], (unsigned long)mount_us, best_wall_us / 1000.0,
+               best_cpu_us / 1000.0);
+    }
+    removePartitions();
+    remove(path);
+}
+
+// Compressed images: storage reads, flash time and library CPU of one image, raw and packed
+static void benchmark_compressed_image(void)
+{
+    const std::vector<uint8_t> image = firmwareImage(16 * 1024);
+    const std::vector<uint8_t> packed = packImage(image);
+    const uint32_t delays_us[] = {0, 10000};
+
+    printf("\nCompressed images, %u -> %u bytes (%.0f%%), reads delayed per block\n", (unsigned)image.size(),
+           (unsigned)packed.size(), 100.0 * packed.size() / image.size());
+    printf("%10s %-10s %8s %10s %14s\n", "delay us", "image", "reads", "flash ms", "library CPU ms");
+    for (uint32_t delay_us : delays_us) {
+        for (int compressed = 0; compressed <= 1; compressed++) {
+            HostTarget &target = createTarget(UART_NUM_1, f103Target());
+            SlowImageSource source(compressed ? packed : image, delay_us);
+
+            const int64_t start = esp_timer_get_time();
+            const uint64_t cpu_start = cpuTime(CLOCK_PROCESS_CPUTIME_ID);
+            FlashReport report;
+            TEST_ASSERT_EQUAL_INT(SUCCESS, internal::flashAnyImage(source, target.config, &report));
+            const uint64_t cpu_us = cpuTime(CLOCK_PROCESS_CPUTIME_ID) - cpu_start - target.emulator.cpuTime();
+            const int64_t wall_us = esp_timer_get_time() - start;
+            TEST_ASSERT_TRUE(target.holds(0, image.data(), image.size()));
+
+            // The packed stream is read twice: once to check its CRC32 before erasing, once to flash
+            printf("%10lu %-10s %8lu %10.1f %14.1f\n", (unsigned long)delay_us, compressed ? "packed" : "raw",
+                   (unsigned long)source.reads, wall_us / 1000.0, cpu_us / 1000.0);
+            releaseTargets();
+        }
+    }
+}
+
+// Multi-target: wall time of one image flashed to 1, 2 and 3 targets at once, one UART each
+static void benchmark_target_scaling(void)
+{
+    const std::vector<uint8_t> image = firmwareImage(8 * 1024);
+    int64_t single_us = 0;
+
+    printf("\nMulti-target flash, %u byte image\n", (unsigned)image.size());
+    printf("%8s %10s %12s %10s %14s\n", "targets", "flash ms", "total KB/s", "speedup", "library CPU ms");
+    for (size_t count = 1; count <= UART_NUM_MAX; count++) {
+        HostTarget *hosts[UART_NUM_MAX];
+        FlashTarget targets[UART_NUM_MAX];
+        uint64_t emulator_cpu_us = 0;
+        for (size_t i = 0; i < count; i++) {
+            hosts[i] = &createTarget((uart_port_t)i, f103Target());
+            targets[i].config = hosts[i]->config;
+        }
+        FlashImage source;
+        source.data = image.data();
+        source.size = image.size();
+
+        const int64_t start = esp_timer_get_time();
+        const uint64_t cpu_start = cpuTime(CLOCK_PROCESS_CPUTIME_ID);
+        TEST_ASSERT_EQUAL_INT(SUCCESS, flashAll(targets, count, source));
+        const uint64_t cpu_us = cpuTime(CLOCK_PROCESS_CPUTIME_ID) - cpu_start;
+        const int64_t wall_us = esp_timer_get_time() - start;
+        for (size_t i = 0; i < count; i++) {
+            TEST_ASSERT_TRUE(hosts[i]->holds(0, image.data(), image.size()));
+            emulator_cpu_us += hosts[i]->emulator.cpuTime();
+        }
+
+        single_us = (count == 1) ? wall_us : single_us;
+        printf("%8u %10.1f %12.1f %9.2fx %14.1f\n", (unsigned)count, wall_us / 1000.0,
+               count * image.size() / 1024.0 / (wall_us / 1e6), (double)count * single_us / wall_us,
+               (cpu_us - emulator_cpu_us) / 1000.0);
+        releaseTargets();
+    }
+}
+
+// End to end: flash time, its phases, WRITE / READ latencies and library CPU for several image sizes and baud rates
+static void benchmark_end_to_end(void)
+{
+    const size_t sizes[] = {4 * 1024, 16 * 1024, 32 * 1024};
+    const uint32_t bauds[] = {115200, 460800};
+
+    printf("\nEnd-to-end flash, STM32F103 timings\n");
+    printf("%8s %7s %9s %8s %8s %8s %8s %7s %9s %8s %8s\n", "baud", "KB", "total ms", "connect", "erase",
+           "write", "verify", "KB/s", "WRITE us", "READ us", "CPU ms");
+    for (uint32_t baud : bauds) {
+        for (size_t size : sizes) {
+            const std::vector<uint8_t> image = firmwareImage(size);
+            HostTarget &target = createTarget(UART_NUM_1, f103Target());
+            target.config.baud_rate = baud;
+
+            FlashImage source;
+            source.data = image.data();
+            source.size = image.size();
+            FlashReport report;
+            const uint64_t cpu_start = cpuTime(CLOCK_PROCESS_CPUTIME_ID);
+            TEST_ASSERT_EQUAL_INT(SUCCESS, flash(target.config, source, &report));
+            const uint64_t cpu_us = cpuTime(CLOCK_PROCESS_CPUTIME_ID) - cpu_start - target.emulator.cpuTime();
+            TEST_ASSERT_TRUE(target.holds(0, image.data(), image.size()));
+            TEST_ASSERT_EQUAL_UINT32(baud, report.baud_rate);
+
+            const EmulatorStats stats = target.emulator.stats();
+            printf("%8lu %7u %9.1f %8.1f %8.1f %8.1f %8.1f %7.1f %9lu %8lu %8.1f\n", (unsigned long)baud,
+                   (unsigned)(size / 1024), report.total_us / 1000.0, report.phase_us[PHASE_CONNECT] / 1000.0,
+                   report.phase_us[PHASE_ERASE] / 1000.0, report.phase_us[PHASE_WRITE] / 1000.0,
+                   report.phase_us[PHASE_VERIFY] / 1000.0, size / 1024.0 / (report.total_us / 1e6),
+                   (unsigned long)stats.commands[CMD_WRITE].average(), (unsigned long)stats.commands[CMD_READ].average(),
+                   cpu_us / 1000.0);
+            releaseTargets();
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(benchmark_end_to_end);
+    RUN_TEST(benchmark_block_write);
+    RUN_TEST(benchmark_command_latency);
+    RUN_TEST(benchmark_pipeline_overlap);
+    RUN_TEST(benchmark_image_sources);
+    RUN_TEST(benchmark_compressed_image);
+    RUN_TEST(benchmark_target_scaling);
+    return UNITY_END();
+}
@@ -0,0 +1,116 @@
+// STZ1 images (LZSS, see tools/stm32_pack.py) decompressed on the fly
+
+#include <unity.h>
+
+#include "STM32Flasher.h"
+#include "stm_flash.h"
+#include "host_images.h"
+#include "host_target.h"
+
+using namespace stm32flash;
+using namespace stm32flash::internal;
+using namespace stm32host;
+
+void setUp(void)
+{
+    clearNvs();
+}
+
+void tearDown(void)
+{
+    releaseTargets();
+}
+
+static void test_round_trip(void)
+{
+    const std::vector<uint8_t> image = firmwareImage(6 * BLOCK_SIZE + 77);
+    const std::vector<uint8_t> packed = packImage(image);
+    TEST_ASSERT_LESS_THAN(image.size(), packed.size());
+
+    MemoryImageSource input(packed.data(), packed.size());
+    TEST_ASSERT_TRUE(CompressedImageSource::isCompressed(input));
+    CompressedImageSource source(input);
+    TEST_ASSERT_EQUAL_INT(SUCCESS, source.open());
+    TEST_ASSERT_EQUAL_UINT32(image.size(), source.size());
+    TEST_ASSERT_EQUAL_HEX32(esp_rom_crc32_le(0, image.data(), image.size()), source.crc());
+    TEST_ASSERT_FALSE(source.isMapped());
+
+    char scratch[BLOCK_SIZE];
+    for (uint32_t offset = 0; offset < image.size(); offset += BLOCK_SIZE) {
+        const uint32_t length = MIN((uint32_t)BLOCK_SIZE, image.size() - offset);
+        const char *data = source.block(offset, scratch);
+        TEST_ASSERT_NOT_NULL(data);
+        TEST_ASSERT_EQUAL_MEMORY(&image[offset], data, length);
+        TEST_ASSERT_TRUE(isBlockBlank(data + length, BLOCK_SIZE - length));
+    }
+
+    // Going back decompresses again from the start of the stream
+    TEST_ASSERT_EQUAL_MEMORY(&image[BLOCK_SIZE], source.block(BLOCK_SIZE, scratch), BLOCK_SIZE);
+    TEST_ASSERT_NULL(source.block(image.size() + BLOCK_SIZE, scratch));
+
+    // Plain images are not taken for compressed ones
+    MemoryImageSource raw(image.data(), image.size());
+    TEST_ASSERT_FALSE(CompressedImageSource::isCompressed(raw));
+}
+
+static void test_corrupted_stream(void)
+{
+    const std::vector<uint8_t> image = firmwareImage(4 * 1024);
+    const std::vector<uint8_t> packed = packImage(image);
+
+    // A flipped byte in the stream, the CRC32 of the header or a truncated stream
+    std::vector<uint8_t> stream = packed;
+    stream[packed.size() / 2] ^= 0x5A;
+    std::vector<uint8_t> header = packed;
+    header[8] ^= 0x01;
+    std::vector<uint8_t> truncated(packed.begin(), packed.end() - 32);
+
+    for (const std::vector<uint8_t> *corrupted : {&stream, &header, &truncated}) {
+        MemoryImageSource input(corrupted->data(), corrupted->size());
+        CompressedImageSource source(input);
+        TEST_ASSERT_EQUAL_INT(ERROR_IMAGE_CORRUPTED, source.open());
+    }
+
+    // Rejected before the target is erased
+    EmulatorConfig emulator_config;
+    emulator_config.wire_time = false;
+    HostTarget &target = createTarget(UART_NUM_1, emulator_config);
+    FlashImage source;
+    source.data = stream.data();
+    source.size = stream.size();
+    TEST_ASSERT_EQUAL_INT(ERROR_IMAGE_CORRUPTED, flash(target.config, source));
+    TEST_ASSERT_EQUAL_UINT32(0, target.emulator.stats().mass_erases);
+    TEST_ASSERT_EQUAL_UINT32(0, target.emulator.stats().blocks_written);
+}
+
+static void test_flash_compressed(void)
+{
+    EmulatorConfig emulator_config;
+    emulator_config.wire_time = false;
+    HostTarget &target = createTarget(UART_NUM_1, emulator_config);
+    const std::vector<uint8_t> image = firmwareImage(24 * 1024 + 5);
+    const std::vector<uint8_t> packed = packImage(image);
+
+    FlashImage source;
+    source.data = packed.data();
+    source.size = packed.size();
+    FlashReport report;
+    TEST_ASSERT_EQUAL_INT(SUCCESS, flash(target.config, source, &report));
+    TEST_ASSERT_TRUE(target.holds(0, image.data(), image.size()));
+    TEST_ASSERT_EQUAL_HEX8(0xFF, target.flashAt(0)[image.size()]);
+    TEST_ASSERT_EQUAL_UINT32(image.size(), report.bytes_written);
+
+    // Also from a source that is not mapped, as a file is
+    SlowImageSource slow(packed, 0);
+    TEST_ASSERT_EQUAL_INT(SUCCESS, flashAnyImage(slow, target.config, &report));
+    TEST_ASSERT_TRUE(target.holds(0, image.data(), image.size()));
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_round_trip);
+    RUN_TEST(test_corrupted_stream);
+    RUN_TEST(test_flash_compressed);
+    return UNITY_END();
+}
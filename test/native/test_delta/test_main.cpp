@@ -0,0 +1,107 @@
+// Delta reflash: the target is read back first, only the pages that differ are erased and rewritten
+
+#include <unity.h>
+
+#include "STM32Flasher.h"
+#include "host_images.h"
+#include "host_target.h"
+
+using namespace stm32flash;
+using namespace stm32host;
+
+#define PAGE_SIZE 1024
+#define IMAGE_SIZE (10 * PAGE_SIZE + 300) // Ends in the middle of page 10
+#define IMAGE_BLOCKS ((IMAGE_SIZE + BLOCK_SIZE - 1) / BLOCK_SIZE)
+
+// Target already holding the image, flashed without delta mode
+static HostTarget &flashedTarget(const std::vector<uint8_t> &image)
+{
+    EmulatorConfig emulator_config;
+    emulator_config.wire_time = false;
+    HostTarget &target = createTarget(UART_NUM_1, emulator_config);
+
+    FlashImage source;
+    source.data = image.data();
+    source.size = image.size();
+    TEST_ASSERT_EQUAL_INT(SUCCESS, flash(target.config, source));
+    target.emulator.resetStats();
+    target.config.delta = true;
+    return target;
+}
+
+static FlashStatus flashData(HostTarget &target, const std::vector<uint8_t> &image, FlashReport *report)
+{
+    FlashImage source;
+    source.data = image.data();
+    source.size = image.size();
+    return flash(target.config, source, report);
+}
+
+void setUp(void)
+{
+    clearNvs();
+}
+
+void tearDown(void)
+{
+    releaseTargets();
+}
+
+static void test_one_page_changed(void)
+{
+    std::vector<uint8_t> image = firmwareImage(IMAGE_SIZE);
+    HostTarget &target = flashedTarget(image);
+
+    // Two blocks of page 4 change: its four blocks are rewritten, as it is erased as a whole
+    image[4 * PAGE_SIZE + 10] ^= 0x01;
+    image[4 * PAGE_SIZE + 700] ^= 0x80;
+    FlashReport report;
+    TEST_ASSERT_EQUAL_INT(SUCCESS, flashData(target, image, &report));
+    TEST_ASSERT_TRUE(target.holds(0, image.data(), image.size()));
+
+    TEST_ASSERT_EQUAL_UINT32(1, target.emulator.stats().pages_erased);
+    TEST_ASSERT_EQUAL_UINT32(0, target.emulator.stats().mass_erases);
+    TEST_ASSERT_EQUAL_UINT32(PAGE_SIZE / BLOCK_SIZE, target.emulator.stats().blocks_written);
+    TEST_ASSERT_EQUAL_UINT32(PAGE_SIZE / BLOCK_SIZE, report.pages_written);
+    TEST_ASSERT_EQUAL_UINT32(IMAGE_BLOCKS - PAGE_SIZE / BLOCK_SIZE, report.pages_skipped);
+}
+
+static void test_partial_last_page_changed(void)
+{
+    std::vector<uint8_t> image = firmwareImage(IMAGE_SIZE);
+    HostTarget &target = flashedTarget(image);
+
+    // Last byte of the image: page 10 holds the two last blocks, the second one partly
+    image[IMAGE_SIZE - 1] ^= 0x01;
+    FlashReport report;
+    TEST_ASSERT_EQUAL_INT(SUCCESS, flashData(target, image, &report));
+    TEST_ASSERT_TRUE(target.holds(0, image.data(), image.size()));
+
+    TEST_ASSERT_EQUAL_UINT32(1, target.emulator.stats().pages_erased);
+    TEST_ASSERT_EQUAL_UINT32(2, target.emulator.stats().blocks_written);
+    TEST_ASSERT_EQUAL_UINT32(2, report.pages_written);
+    TEST_ASSERT_EQUAL_UINT32(IMAGE_BLOCKS - 2, report.pages_skipped);
+    TEST_ASSERT_EQUAL_HEX8(0xFF, target.flashAt(IMAGE_SIZE)[0]);
+}
+
+static void test_nothing_changed(void)
+{
+    const std::vector<uint8_t> image = firmwareImage(IMAGE_SIZE);
+    HostTarget &target = flashedTarget(image);
+
+    FlashReport report;
+    TEST_ASSERT_EQUAL_INT(SUCCESS, flashData(target, image, &report));
+    TEST_ASSERT_EQUAL_UINT32(0, target.emulator.stats().pages_erased);
+    TEST_ASSERT_EQUAL_UINT32(0, target.emulator.stats().blocks_written);
+    TEST_ASSERT_EQUAL_UINT32(0, report.pages_written);
+    TEST_ASSERT_EQUAL_UINT32(IMAGE_BLOCKS, report.pages_skipped);
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_one_page_changed);
+    RUN_TEST(test_partial_last_page_changed);
+    RUN_TEST(test_nothing_changed);
+    return UNITY_END();
+}
@@ -0,0 +1,210 @@
+// Erase plans over uniform pages, F4 sectors and G0B banks, and page erases on the emulated bootloader
+
+#include <unity.h>
+
+#include "STM32Flasher.h"
+#include "stm_pro_mode.h"
+#include "stm_devices.h"
+#include "host_images.h"
+#include "host_target.h"
+
+#include <algorithm>
+
+using namespace stm32flash;
+using namespace stm32flash::internal;
+using namespace stm32host;
+
+#define KB(x) ((x) * 1024)
+
+static const FlashLayout F4_LAYOUT = {{{4, KB(16)}, {1, KB(64)}, {3, KB(128)}}};
+
+void setUp(void)
+{
+    clearNvs();
+}
+
+void tearDown(void)
+{
+    releaseTargets();
+}
+
+static void test_uniform_layout(void)
+{
+    const FlashLayout layout = FlashLayout::uniform(KB(1));
+    TEST_ASSERT_TRUE(layout.isValid());
+    TEST_ASSERT_TRUE(layout.isBlockAligned());
+    TEST_ASSERT_EQUAL_INT(0, layout.pageOf(0));
+    TEST_ASSERT_EQUAL_INT(0, layout.pageOf(KB(1) - 1));
+    TEST_ASSERT_EQUAL_INT(1, layout.pageOf(KB(1)));
+    TEST_ASSERT_EQUAL_UINT32(KB(3), layout.pageEnd(2));
+    TEST_ASSERT_EQUAL_UINT32(KB(2), layout.pageStart(2));
+    TEST_ASSERT_TRUE(layout.isPageEnd(KB(2)));
+    TEST_ASSERT_FALSE(layout.isPageEnd(KB(2) + BLOCK_SIZE));
+    TEST_ASSERT_FALSE(layout.isPageEnd(0));
+    TEST_ASSERT_FALSE(FlashLayout().isValid());
+    TEST_ASSERT_FALSE(FlashLayout::uniform(100).isBlockAligned());
+}
+
+static void test_sector_layout(void)
+{
+    TEST_ASSERT_EQUAL_INT(3, F4_LAYOUT.pageOf(KB(64) - 1));
+    TEST_ASSERT_EQUAL_INT(4, F4_LAYOUT.pageOf(KB(64)));
+    TEST_ASSERT_EQUAL_INT(4, F4_LAYOUT.pageOf(KB(128) - 1));
+    TEST_ASSERT_EQUAL_INT(5, F4_LAYOUT.pageOf(KB(128)));
+    TEST_ASSERT_EQUAL_INT(7, F4_LAYOUT.pageOf(KB(512) - 1));
+    TEST_ASSERT_EQUAL_INT(-1, F4_LAYOUT.pageOf(KB(512)));
+    TEST_ASSERT_EQUAL_UINT32(KB(128), F4_LAYOUT.pageEnd(4));
+    TEST_ASSERT_EQUAL_UINT32(KB(512), F4_LAYOUT.pageEnd(7));
+    TEST_ASSERT_EQUAL_UINT32(0, F4_LAYOUT.pageEnd(8));
+}
+
+static void test_plan_range(void)
+{
+    ErasePlan plan;
+    TEST_ASSERT_TRUE(planErase(plan, KB(1) + 10, KB(2), FlashLayout::uniform(KB(1))));
+    TEST_ASSERT_EQUAL_INT(3, plan.count);
+    TEST_ASSERT_EQUAL_INT(1, plan.pages[0]);
+    TEST_ASSERT_EQUAL_INT(3, plan.pages[2]);
+    TEST_ASSERT_EQUAL_UINT32(KB(3), plan.size());
+    TEST_ASSERT_TRUE(plan.covers(KB(4) - 1));
+    TEST_ASSERT_FALSE(plan.covers(KB(4)));
+    TEST_ASSERT_FALSE(plan.covers(KB(1) - 1));
+
+    plan.remove(2);
+    TEST_ASSERT_EQUAL_INT(2, plan.count);
+    TEST_ASSERT_FALSE(plan.contains(2));
+    TEST_ASSERT_TRUE(plan.contains(3));
+
+    // A few bytes past the first sectors take the whole 64KB sector
+    TEST_ASSERT_TRUE(planErase(plan, 0, KB(64) + 1, F4_LAYOUT));
+    TEST_ASSERT_EQUAL_INT(5, plan.count);
+    TEST_ASSERT_EQUAL_UINT32(KB(128), plan.size());
+
+    TEST_ASSERT_FALSE(planErase(plan, KB(500), KB(16), F4_LAYOUT)); // Past the end of flash
+    TEST_ASSERT_FALSE(planErase(plan, 0, 0, F4_LAYOUT));
+    TEST_ASSERT_FALSE(planErase(plan, 0, (MAX_ERASE_PAGES + 1) * 256, FlashLayout::uniform(256)));
+}
+
+static void test_device_layout(void)
+{
+    FlashConfig config;
+    DeviceInfo info;
+    info.product_id = 0x431;
+    TEST_ASSERT_TRUE(flashLayout(config, info) == F4_LAYOUT);
+    TEST_ASSERT_EQUAL_UINT32(4, writeAlignment(info));
+
+    // An explicit page size overrides the device table
+    config.page_size = KB(2);
+    TEST_ASSERT_TRUE(flashLayout(config, info) == FlashLayout::uniform(KB(2)));
+
+    info.product_id = 0x123;
+    config.page_size = 0;
+    TEST_ASSERT_NULL(findDevice(0x123));
+    TEST_ASSERT_FALSE(flashLayout(config, info).isValid());
+}
+
+static void test_banked_layout(void)
+{
+    // G0B: bank 2 is erased as pages 256 and up, whatever the size of bank 1
+    FlashConfig config;
+    DeviceInfo info;
+    info.product_id = 0x467;
+    info.flash_size = KB(512);
+    FlashLayout layout = flashLayout(config, info);
+    TEST_ASSERT_EQUAL_INT(127, layout.pageOf(KB(256) - 1));
+    TEST_ASSERT_EQUAL_INT(256, layout.pageOf(KB(256)));
+    TEST_ASSERT_EQUAL_INT(383, layout.pageOf(KB(512) - 1));
+    TEST_ASSERT_EQUAL_INT(-1, layout.pageOf(KB(512)));
+    TEST_ASSERT_EQUAL_UINT32(KB(256), layout.pageStart(256));
+    TEST_ASSERT_TRUE(layout.isPageEnd(KB(256)));
+    TEST_ASSERT_FALSE(layout.isPage(128));
+    TEST_ASSERT_FALSE(layout.isPage(255));
+    TEST_ASSERT_TRUE(layout.isPage(256));
+
+    // A range across the banks skips the unused page numbers
+    ErasePlan plan;
+    TEST_ASSERT_TRUE(planErase(plan, KB(254), KB(4), layout));
+    TEST_ASSERT_EQUAL_INT(2, plan.count);
+    TEST_ASSERT_EQUAL_INT(127, plan.pages[0]);
+    TEST_ASSERT_EQUAL_INT(256, plan.pages[1]);
+    TEST_ASSERT_EQUAL_UINT32(KB(4), plan.size());
+
+    // 256KB part: two banks of 128KB
+    info.flash_size = KB(256);
+    layout = flashLayout(config, info);
+    TEST_ASSERT_EQUAL_INT(63, layout.pageOf(KB(128) - 1));
+    TEST_ASSERT_EQUAL_INT(256, layout.pageOf(KB(128)));
+    TEST_ASSERT_EQUAL_INT(256 + 63, layout.pageOf(KB(256) - 1));
+    TEST_ASSERT_EQUAL_INT(-1, layout.pageOf(KB(256)));
+
+    // F0 bootloaders (v3.x) erase with EXTENDED ERASE
+    TEST_ASSERT_EQUAL_HEX8(CMD_EXT_ERASE, findDevice(0x440)->erase_command);
+}
+
+// Flash the image over a target whose flash is full of zeros: only the erased pages read 0xFF again
+static void flashOverZeros(HostTarget &target, const std::vector<uint8_t> &image)
+{
+    std::fill(target.emulator.flash().begin(), target.emulator.flash().end(), 0x00);
+    target.config.erase_mode = ERASE_PAGES;
+
+    FlashImage source;
+    source.data = image.data();
+    source.size = image.size();
+    TEST_ASSERT_EQUAL_INT(SUCCESS, flash(target.config, source));
+    TEST_ASSERT_TRUE(target.holds(0, image.data(), image.size()));
+    TEST_ASSERT_EQUAL_UINT32(0, target.emulator.stats().mass_erases);
+}
+
+static void test_page_erase(void)
+{
+    EmulatorConfig config;
+    config.wire_time = false;
+    HostTarget &target = createTarget(UART_NUM_1, config);
+    const std::vector<uint8_t> image = firmwareImage(KB(2) + 100);
+    flashOverZeros(target, image);
+
+    TEST_ASSERT_EQUAL_UINT32(3, target.emulator.stats().pages_erased);
+    TEST_ASSERT_EQUAL_HEX8(0xFF, target.flashAt(0)[KB(3) - 1]);
+    TEST_ASSERT_EQUAL_HEX8(0x00, target.flashAt(0)[KB(3)]);
+}
+
+static void test_sector_erase(void)
+{
+    EmulatorConfig config = EmulatorConfig::f411();
+    config.wire_time = false;
+    HostTarget &target = createTarget(UART_NUM_1, config);
+    const std::vector<uint8_t> image = firmwareImage(KB(48) + 4);
+    flashOverZeros(target, image);
+
+    // EXTENDED ERASE of sectors 0 to 3, sector 4 (64KB) is left alone
+    TEST_ASSERT_EQUAL_UINT32(4, target.emulator.stats().pages_erased);
+    TEST_ASSERT_EQUAL_HEX8(0xFF, target.flashAt(0)[KB(64) - 1]);
+    TEST_ASSERT_EQUAL_HEX8(0x00, target.flashAt(0)[KB(64)]);
+}
+
+static void test_bank2_erase(void)
+{
+    EmulatorConfig config = EmulatorConfig::g0b1();
+    config.wire_time = false;
+    HostTarget &target = createTarget(UART_NUM_1, config);
+    const std::vector<uint8_t> image = firmwareImage(KB(300));
+    flashOverZeros(target, image);
+
+    // Pages 0 to 127 and 256 to 277: page numbers without flash would have been NACKed
+    TEST_ASSERT_EQUAL_UINT32(128 + 22, target.emulator.stats().pages_erased);
+    TEST_ASSERT_EQUAL_HEX8(0x00, target.flashAt(0)[KB(300)]);
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_uniform_layout);
+    RUN_TEST(test_sector_layout);
+    RUN_TEST(test_plan_range);
+    RUN_TEST(test_device_layout);
+    RUN_TEST(test_banked_layout);
+    RUN_TEST(test_page_erase);
+    RUN_TEST(test_sector_erase);
+    RUN_TEST(test_bank2_erase);
+    return UNITY_END();
+}
@@ -0,0 +1,120 @@
+// Fingerprint pre-check: a target already holding the image is neither erased nor written
+
+#include <unity.h>
+
+#include "STM32Flasher.h"
+#include "host_images.h"
+#include "host_target.h"
+
+using namespace stm32flash;
+using namespace stm32host;
+
+#define VERSION_OFFSET 0x200 // Version block of the synthetic firmware, after its vector table
+
+static HostTarget &flashedTarget(uart_port_t uart_num, const std::vector<uint8_t> &image)
+{
+    EmulatorConfig emulator_config;
+    emulator_config.wire_time = false;
+    HostTarget &target = createTarget(uart_num, emulator_config);
+
+    FlashImage source;
+    source.data = image.data();
+    source.size = image.size();
+    TEST_ASSERT_EQUAL_INT(SUCCESS, flash(target.config, source));
+    target.emulator.resetStats();
+    return target;
+}
+
+static FlashStatus flashData(HostTarget &target, const std::vector<uint8_t> &image)
+{
+    FlashImage source;
+    source.data = image.data();
+    source.size = image.size();
+    return flash(target.config, source);
+}
+
+void setUp(void)
+{
+    clearNvs();
+}
+
+void tearDown(void)
+{
+    releaseTargets();
+}
+
+static void test_edges(void)
+{
+    std::vector<uint8_t> image = firmwareImage(10 * 1024 + 30);
+    HostTarget &target = flashedTarget(UART_NUM_1, image);
+    target.config.fingerprint = FINGERPRINT_EDGES;
+
+    // Only the first and last blocks are read back (after the flash size register, read at setup)
+    TEST_ASSERT_EQUAL_INT(ALREADY_UP_TO_DATE, flashData(target, image));
+    TEST_ASSERT_EQUAL_UINT32(0, target.emulator.stats().mass_erases);
+    TEST_ASSERT_EQUAL_UINT32(0, target.emulator.stats().blocks_written);
+    TEST_ASSERT_EQUAL_UINT32(1 + 2, target.emulator.stats().blocks_read);
+
+    // A new build changes its last block (or its size)
+    image[image.size() - 1] ^= 0x01;
+    TEST_ASSERT_EQUAL_INT(SUCCESS, flashData(target, image));
+    TEST_ASSERT_TRUE(target.holds(0, image.data(), image.size()));
+    image.push_back(0x00);
+    TEST_ASSERT_EQUAL_INT(SUCCESS, flashData(target, image));
+    TEST_ASSERT_EQUAL_INT(ALREADY_UP_TO_DATE, flashData(target, image));
+}
+
+static void test_version_block(void)
+{
+    std::vector<uint8_t> image = firmwareImage(10 * 1024);
+    HostTarget &target = flashedTarget(UART_NUM_1, image);
+    target.config.fingerprint = FINGERPRINT_BLOCK;
+    target.config.fingerprint_address = STM32_FLASH_BASE + VERSION_OFFSET + 16;
+
+    // Changes outside the version block go unnoticed, by design
+    image[5000] ^= 0x01;
+    TEST_ASSERT_EQUAL_INT(ALREADY_UP_TO_DATE, flashData(target, image));
+    TEST_ASSERT_EQUAL_UINT32(1 + 1, target.emulator.stats().blocks_read);
+
+    image[VERSION_OFFSET] ^= 0x01;
+    TEST_ASSERT_EQUAL_INT(SUCCESS, flashData(target, image));
+    TEST_ASSERT_TRUE(target.holds(0, image.data(), image.size()));
+
+    // An address outside the image always flashes
+    target.config.fingerprint_address = STM32_FLASH_BASE + image.size();
+    TEST_ASSERT_EQUAL_INT(SUCCESS, flashData(target, image));
+}
+
+static void test_flash_all_up_to_date(void)
+{
+    const std::vector<uint8_t> image = firmwareImage(4 * 1024);
+    HostTarget &first = flashedTarget(UART_NUM_0, image);
+    HostTarget &second = flashedTarget(UART_NUM_1, firmwareImage(4 * 1024, 2));
+
+    FlashTarget targets[2];
+    targets[0].config = first.config;
+    targets[1].config = second.config;
+    for (FlashTarget &target : targets) {
+        target.config.fingerprint = FINGERPRINT_EDGES;
+    }
+    FlashImage source;
+    source.data = image.data();
+    source.size = image.size();
+
+    // Only the out of date target is flashed, then none
+    TEST_ASSERT_EQUAL_INT(SUCCESS, flashAll(targets, 2, source));
+    TEST_ASSERT_EQUAL_INT(ALREADY_UP_TO_DATE, targets[0].status);
+    TEST_ASSERT_EQUAL_INT(SUCCESS, targets[1].status);
+    TEST_ASSERT_EQUAL_UINT32(0, first.emulator.stats().blocks_written);
+    TEST_ASSERT_TRUE(second.holds(0, image.data(), image.size()));
+    TEST_ASSERT_EQUAL_INT(ALREADY_UP_TO_DATE, flashAll(targets, 2, source));
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_edges);
+    RUN_TEST(test_version_block);
+    RUN_TEST(test_flash_all_up_to_date);
+    return UNITY_END();
+}
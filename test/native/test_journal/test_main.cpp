@@ -0,0 +1,155 @@
+// Flashes interrupted by a target going silent, resumed from the NVS progress journal
+
+#include <unity.h>
+
+#include "STM32Flasher.h"
+#include "stm_flash.h"
+#include "host_images.h"
+#include "host_target.h"
+
+using namespace stm32flash;
+using namespace stm32flash::internal;
+using namespace stm32host;
+
+#define IMAGE_SIZE (16 * 1024 + 100)
+
+// Unplugged after some WRITE MEMORY frames: the flash fails half-way and leaves a journal
+static HostTarget &interruptedTarget(const std::vector<uint8_t> &image, uint32_t frames)
+{
+    EmulatorConfig emulator_config;
+    emulator_config.wire_time = false;
+    emulator_config.silent_after = frames;
+    HostTarget &target = createTarget(UART_NUM_1, emulator_config);
+    target.config.resume = true;
+    target.config.retries = 1;
+
+    FlashImage source;
+    source.data = image.data();
+    source.size = image.size();
+    TEST_ASSERT_NOT_EQUAL(SUCCESS, flash(target.config, source));
+    target.emulator.config().silent_after = 0; // Plugged back
+    return target;
+}
+
+static FlashStatus flashData(HostTarget &target, const std::vector<uint8_t> &image, FlashReport *report)
+{
+    FlashImage source;
+    source.data = image.data();
+    source.size = image.size();
+    return flash(target.config, source, report);
+}
+
+void setUp(void)
+{
+    clearNvs();
+}
+
+void tearDown(void)
+{
+    releaseTargets();
+}
+
+static void test_resume_after_interruption(void)
+{
+    const std::vector<uint8_t> image = firmwareImage(IMAGE_SIZE);
+    HostTarget &target = interruptedTarget(image, 40);
+
+    FlashJournal journal;
+    TEST_ASSERT_TRUE(loadJournal(UART_NUM_1, journal));
+    TEST_ASSERT_EQUAL_UINT32(image.size(), journal.image_size);
+    TEST_ASSERT_EQUAL_UINT32(40 * BLOCK_SIZE, journal.next_offset); // Saved as the write failed, between two intervals
+
+    // Only the rest of the image is written, without erasing what is already there
+    target.emulator.resetStats();
+    FlashReport report;
+    TEST_ASSERT_EQUAL_INT(SUCCESS, flashData(target, image, &report));
+    TEST_ASSERT_EQUAL_UINT32(journal.next_offset, report.resumed_from);
+    TEST_ASSERT_TRUE(target.holds(0, image.data(), image.size()));
+    TEST_ASSERT_EQUAL_UINT32(0, target.emulator.stats().mass_erases);
+    TEST_ASSERT_LESS_THAN((image.size() + BLOCK_SIZE - 1) / BLOCK_SIZE, target.emulator.stats().blocks_written);
+    TEST_ASSERT_FALSE(loadJournal(UART_NUM_1, journal));
+}
+
+static void test_save_cadence(void)
+{
+    EmulatorConfig emulator_config;
+    emulator_config.wire_time = false;
+    HostTarget &target = createTarget(UART_NUM_1, emulator_config);
+    target.config.resume = true;
+    const std::vector<uint8_t> image = firmwareImage(IMAGE_SIZE);
+
+    // Once the erase is done, then every JOURNAL_INTERVAL bytes instead of every page
+    TEST_ASSERT_EQUAL_INT(SUCCESS, flashData(target, image, NULL));
+    TEST_ASSERT_EQUAL_UINT32(1 + IMAGE_SIZE / JOURNAL_INTERVAL, nvsWrites());
+}
+
+static void test_resume_after_host_reset(void)
+{
+    // The ESP32 reset between two saves: the pages written since the last one are erased again
+    const std::vector<uint8_t> image = firmwareImage(IMAGE_SIZE);
+    HostTarget &target = interruptedTarget(image, 40);
+    FlashJournal journal;
+    TEST_ASSERT_TRUE(loadJournal(UART_NUM_1, journal));
+    journal.next_offset = 40 * BLOCK_SIZE - JOURNAL_INTERVAL + 2 * 1024;
+    saveJournal(UART_NUM_1, journal);
+
+    target.emulator.resetStats();
+    FlashReport report;
+    TEST_ASSERT_EQUAL_INT(SUCCESS, flashData(target, image, &report));
+    TEST_ASSERT_EQUAL_UINT32(journal.next_offset, report.resumed_from);
+    TEST_ASSERT_TRUE(target.holds(0, image.data(), image.size()));
+    TEST_ASSERT_EQUAL_UINT32(0, target.emulator.stats().mass_erases);
+    TEST_ASSERT_EQUAL_UINT32(JOURNAL_INTERVAL / 1024, target.emulator.stats().pages_erased);
+}
+
+static void test_other_target_or_image(void)
+{
+    const std::vector<uint8_t> image = firmwareImage(IMAGE_SIZE);
+    HostTarget &target = interruptedTarget(image, 30);
+    FlashReport report;
+
+    // Another board on the same UART (another UID) starts over
+    target.emulator.config().uid[0] ^= 0x01;
+    TEST_ASSERT_EQUAL_INT(SUCCESS, flashData(target, image, &report));
+    TEST_ASSERT_EQUAL_UINT32(0, report.resumed_from);
+    TEST_ASSERT_TRUE(target.holds(0, image.data(), image.size()));
+
+    // So does another image
+    FlashJournal journal;
+    target.emulator.resetStats();
+    target.emulator.config().silent_after = 30;
+    TEST_ASSERT_NOT_EQUAL(SUCCESS, flashData(target, image, &report));
+    target.emulator.config().silent_after = 0;
+    TEST_ASSERT_TRUE(loadJournal(UART_NUM_1, journal));
+    TEST_ASSERT_GREATER_THAN(0, journal.next_offset);
+    const std::vector<uint8_t> other = firmwareImage(IMAGE_SIZE, 2);
+    TEST_ASSERT_EQUAL_INT(SUCCESS, flashData(target, other, &report));
+    TEST_ASSERT_EQUAL_UINT32(0, report.resumed_from);
+    TEST_ASSERT_TRUE(target.holds(0, other.data(), other.size()));
+}
+
+static void test_verify_failure_clears_journal(void)
+{
+    const std::vector<uint8_t> image = firmwareImage(IMAGE_SIZE);
+    EmulatorConfig emulator_config;
+    emulator_config.wire_time = false;
+    emulator_config.stuck_address = STM32_FLASH_BASE + 5000;
+    HostTarget &target = createTarget(UART_NUM_1, emulator_config);
+    target.config.resume = true;
+
+    // The write completed: resuming would skip straight to a verification that fails again
+    FlashJournal journal;
+    TEST_ASSERT_EQUAL_INT(ERROR_VERIFY_FAILED, flashData(target, image, NULL));
+    TEST_ASSERT_FALSE(loadJournal(UART_NUM_1, journal));
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_resume_after_interruption);
+    RUN_TEST(test_save_cadence);
+    RUN_TEST(test_resume_after_host_reset);
+    RUN_TEST(test_other_target_or_image);
+    RUN_TEST(test_verify_failure_clears_journal);
+    return UNITY_END();
+}
@@ -0,0 +1,121 @@
+// One image flashed to several targets in parallel, one worker task per UART
+
+#include <unity.h>
+
+#include "STM32Flasher.h"
+#include "stm_flash.h"
+#include "host_images.h"
+#include "host_target.h"
+
+using namespace stm32flash;
+using namespace stm32host;
+
+static EmulatorConfig fastTarget(EmulatorConfig config = EmulatorConfig())
+{
+    config.wire_time = false;
+    return config;
+}
+
+void setUp(void)
+{
+    clearNvs();
+}
+
+void tearDown(void)
+{
+    releaseTargets();
+}
+
+static void test_flash_all(void)
+{
+    // Three different parts, each erased and written the way it needs
+    HostTarget *hosts[] = {
+        &createTarget(UART_NUM_0, fastTarget()),
+        &createTarget(UART_NUM_1, fastTarget(EmulatorConfig::g071())),
+        &createTarget(UART_NUM_2, fastTarget(EmulatorConfig::f411())),
+    };
+    const std::vector<uint8_t> image = firmwareImage(12 * 1024 + 40);
+
+    FlashTarget targets[3];
+    for (int i = 0; i < 3; i++) {
+        targets[i].config = hosts[i]->config;
+    }
+    FlashImage source;
+    source.data = image.data();
+    source.size = image.size();
+    TEST_ASSERT_EQUAL_INT(SUCCESS, flashAll(targets, 3, source));
+    for (int i = 0; i < 3; i++) {
+        TEST_ASSERT_EQUAL_INT(SUCCESS, targets[i].status);
+        TEST_ASSERT_TRUE(hosts[i]->holds(0, image.data(), image.size()));
+        TEST_ASSERT_EQUAL_UINT32(image.size(), targets[i].report.bytes_written);
+        TEST_ASSERT_EQUAL_INT(Stm32Emulator::MODE_APPLICATION, hosts[i]->emulator.mode());
+    }
+}
+
+static void test_compressed_broadcast(void)
+{
+    HostTarget &first = createTarget(UART_NUM_0, fastTarget());
+    HostTarget &second = createTarget(UART_NUM_1, fastTarget());
+    const std::vector<uint8_t> image = firmwareImage(8 * 1024);
+    const std::vector<uint8_t> packed = packImage(image);
+
+    // Decompressed once, before any worker starts
+    FlashTarget targets[2];
+    targets[0].config = first.config;
+    targets[1].config = second.config;
+    FlashImage source;
+    source.data = packed.data();
+    source.size = packed.size();
+    TEST_ASSERT_EQUAL_INT(SUCCESS, flashAll(targets, 2, source));
+    TEST_ASSERT_TRUE(first.holds(0, image.data(), image.size()));
+    TEST_ASSERT_TRUE(second.holds(0, image.data(), image.size()));
+}
+
+static void test_one_target_missing(void)
+{
+    HostTarget &present = createTarget(UART_NUM_0, fastTarget());
+    HostTarget &missing = createTarget(UART_NUM_1, fastTarget());
+    detachTarget(UART_NUM_1);
+    const std::vector<uint8_t> image = firmwareImage(2048);
+
+    // The other target is still flashed
+    FlashTarget targets[2];
+    targets[0].config = present.config;
+    targets[1].config = missing.config;
+    FlashImage source;
+    source.data = image.data();
+    source.size = image.size();
+    TEST_ASSERT_EQUAL_INT(ERROR_STM_NOT_FOUND, flashAll(targets, 2, source));
+    TEST_ASSERT_EQUAL_INT(SUCCESS, targets[0].status);
+    TEST_ASSERT_EQUAL_INT(ERROR_STM_NOT_FOUND, targets[1].status);
+    TEST_ASSERT_TRUE(present.holds(0, image.data(), image.size()));
+}
+
+static void test_invalid_targets(void)
+{
+    HostTarget &target = createTarget(UART_NUM_0, fastTarget());
+    const uint8_t image[BLOCK_SIZE] = {0};
+    FlashImage source;
+    source.data = image;
+    source.size = sizeof(image);
+
+    // Two targets on the same UART, none, or more than there are UARTs
+    FlashTarget targets[UART_NUM_MAX + 1];
+    for (FlashTarget &t : targets) {
+        t.config = target.config;
+    }
+    TEST_ASSERT_EQUAL_INT(ERROR_CONFIG_INVALID, flashAll(targets, 2, source));
+    TEST_ASSERT_EQUAL_INT(ERROR_CONFIG_INVALID, flashAll(targets, 0, source));
+    TEST_ASSERT_EQUAL_INT(ERROR_CONFIG_INVALID, flashAll(targets, UART_NUM_MAX + 1, source));
+    TEST_ASSERT_EQUAL_UINT32(0, target.emulator.stats().resets);
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_flash_all);
+    RUN_TEST(test_compressed_broadcast);
+    RUN_TEST(test_one_target_missing);
+    RUN_TEST(test_invalid_targets);
+    return UNITY_END();
+}
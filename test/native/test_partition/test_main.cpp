@@ -0,0 +1,126 @@
+// Images flashed in place from a mapped data partition (a file mapped with mmap on the host)
+
+#include <unity.h>
+
+#include "STM32Flasher.h"
+#include "stm_flash.h"
+#include "host_images.h"
+#include "host_target.h"
+
+#include <unistd.h>
+
+using namespace stm32flash;
+using namespace stm32flash::internal;
+using namespace stm32host;
+
+#define PARTITION_SIZE (64 * 1024)
+
+static char s_path[] = "/tmp/stm32_partition_XXXXXX";
+
+// Partition holding the image, the rest of it erased (0xFF) as after esptool writes it
+static std::vector<uint8_t> addImagePartition(const char *label, size_t image_size)
+{
+    const std::vector<uint8_t> image = firmwareImage(image_size);
+    std::vector<uint8_t> contents(PARTITION_SIZE, 0xFF);
+    memcpy(contents.data(), image.data(), image.size());
+
+    strcpy(s_path, "/tmp/stm32_partition_XXXXXX");
+    const int fd = mkstemp(s_path);
+    TEST_ASSERT_TRUE(fd >= 0);
+    close(fd);
+    TEST_ASSERT_TRUE(writeFile(s_path, contents.data(), contents.size()));
+    TEST_ASSERT_TRUE(addPartition(label, s_path));
+    return image;
+}
+
+void setUp(void)
+{
+    clearNvs();
+}
+
+void tearDown(void)
+{
+    releaseTargets();
+    removePartitions();
+    unlink(s_path);
+}
+
+static void test_flash_partition(void)
+{
+    EmulatorConfig emulator_config;
+    emulator_config.wire_time = false;
+    HostTarget &target = createTarget(UART_NUM_1, emulator_config);
+    const std::vector<uint8_t> image = addImagePartition("stm32", 12 * 1024 + 8);
+
+    // The whole partition: the erased tail is skipped as blank blocks
+    FlashImage source;
+    source.partition_label = "stm32";
+    FlashReport report;
+    TEST_ASSERT_EQUAL_INT(SUCCESS, flash(target.config, source, &report));
+    TEST_ASSERT_TRUE(target.holds(0, image.data(), image.size()));
+    TEST_ASSERT_EQUAL_UINT32((image.size() + BLOCK_SIZE - 1) / BLOCK_SIZE, report.pages_written);
+    TEST_ASSERT_EQUAL_UINT32(PARTITION_SIZE - report.pages_written * BLOCK_SIZE, report.blank_bytes_skipped);
+
+    // Or only the image size
+    source.size = image.size();
+    TEST_ASSERT_EQUAL_INT(SUCCESS, flash(target.config, source, &report));
+    TEST_ASSERT_EQUAL_UINT32(0, report.blank_bytes_skipped);
+    TEST_ASSERT_EQUAL_UINT32(image.size(), report.bytes_written);
+}
+
+static void test_pages_are_not_copied(void)
+{
+    const std::vector<uint8_t> image = addImagePartition("stm32", 4 * BLOCK_SIZE);
+    PartitionImageSource source;
+    TEST_ASSERT_EQUAL_INT(SUCCESS, source.map("stm32", image.size()));
+    TEST_ASSERT_TRUE(source.isMapped());
+    TEST_ASSERT_EQUAL_UINT32(image.size(), source.size());
+
+    // No reader task: pages point straight into the mapping
+    char scratch[BLOCK_SIZE];
+    const char *mapped = source.block(0, scratch);
+    TEST_ASSERT_TRUE(mapped != scratch);
+    TEST_ASSERT_EQUAL_MEMORY(image.data(), mapped, image.size());
+
+    PagePipeline pipeline;
+    TEST_ASSERT_EQUAL_INT(SUCCESS, startPipeline(pipeline, source));
+    TEST_ASSERT_NULL(pipeline.ready_pages);
+    PipelinePage *page = nextPage(pipeline);
+    TEST_ASSERT_TRUE(page->data == mapped);
+    releasePage(pipeline, page);
+    page = nextPage(pipeline);
+    TEST_ASSERT_TRUE(page->data == mapped + BLOCK_SIZE);
+    stopPipeline(pipeline);
+    source.unmap();
+}
+
+static void test_partition_errors(void)
+{
+    EmulatorConfig emulator_config;
+    emulator_config.wire_time = false;
+    HostTarget &target = createTarget(UART_NUM_1, emulator_config);
+    addImagePartition("stm32", 1024);
+
+    FlashImage source;
+    source.partition_label = "missing";
+    TEST_ASSERT_EQUAL_INT(ERROR_PARTITION_NOT_FOUND, flash(target.config, source));
+    source.partition_label = "stm32";
+    source.size = PARTITION_SIZE + 1;
+    TEST_ASSERT_EQUAL_INT(ERROR_FILE_TOO_LARGE, flash(target.config, source));
+
+    // Exactly one of partition_label and data
+    const uint8_t data[4] = {0};
+    source.data = data;
+    source.size = sizeof(data);
+    TEST_ASSERT_EQUAL_INT(ERROR_CONFIG_INVALID, flash(target.config, source));
+    TEST_ASSERT_EQUAL_UINT32(0, target.emulator.stats().resets);
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_flash_partition);
+    RUN_TEST(test_pages_are_not_copied);
+    RUN_TEST(test_partition_errors);
+    return UNITY_END();
+}
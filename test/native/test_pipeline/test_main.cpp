@@ -0,0 +1,106 @@
+// Read-ahead pipeline between the image reader task and the UART transfers
+
+#include <unity.h>
+
+#include "STM32Flasher.h"
+#include "stm_flash.h"
+#include "host_images.h"
+#include "host_target.h"
+
+using namespace stm32flash;
+using namespace stm32flash::internal;
+using namespace stm32host;
+
+void setUp(void)
+{
+    clearNvs();
+}
+
+void tearDown(void)
+{
+    releaseTargets();
+}
+
+static void test_pages_in_order(void)
+{
+    std::vector<uint8_t> image = firmwareImage(10 * BLOCK_SIZE + 17);
+    memset(&image[3 * BLOCK_SIZE], 0xFF, BLOCK_SIZE);
+    SlowImageSource source(image, 100);
+
+    PagePipeline pipeline;
+    TEST_ASSERT_EQUAL_INT(SUCCESS, startPipeline(pipeline, source));
+    for (uint32_t offset = 0; offset < image.size(); offset += BLOCK_SIZE) {
+        PipelinePage *page = nextPage(pipeline);
+        const int length = (image.size() - offset < BLOCK_SIZE) ? image.size() - offset : BLOCK_SIZE;
+        TEST_ASSERT_EQUAL_UINT32(offset, page->offset);
+        TEST_ASSERT_EQUAL_INT(length, page->length);
+        TEST_ASSERT_EQUAL_MEMORY(&image[offset], page->data, length);
+        TEST_ASSERT_TRUE(isBlockBlank(page->data + length, BLOCK_SIZE - length));
+        TEST_ASSERT_EQUAL_HEX8(xorChecksum(page->data, BLOCK_SIZE, BLOCK_SIZE - 1), page->checksum);
+        TEST_ASSERT_EQUAL(offset == 3 * BLOCK_SIZE, page->blank);
+        releasePage(pipeline, page);
+    }
+    TEST_ASSERT_EQUAL_INT(0, nextPage(pipeline)->length);
+    stopPipeline(pipeline);
+    TEST_ASSERT_NULL(pipeline.free_pages);
+}
+
+static void test_read_error(void)
+{
+    const std::vector<uint8_t> image = firmwareImage(8 * BLOCK_SIZE);
+    SlowImageSource source(image, 0);
+    source.fail_offset = 5 * BLOCK_SIZE;
+
+    PagePipeline pipeline;
+    TEST_ASSERT_EQUAL_INT(SUCCESS, startPipeline(pipeline, source));
+    PipelinePage *page;
+    while ((page = nextPage(pipeline))->length > 0) {
+        releasePage(pipeline, page);
+    }
+    TEST_ASSERT_EQUAL_INT(-1, page->length);
+    TEST_ASSERT_EQUAL_UINT32(5 * BLOCK_SIZE, page->offset);
+    stopPipeline(pipeline);
+}
+
+static void test_stop_while_reading_ahead(void)
+{
+    // The reader is blocked on a full ring: stopping must wake it up and wait for it
+    const std::vector<uint8_t> image = firmwareImage(64 * BLOCK_SIZE);
+    SlowImageSource source(image, 0);
+
+    PagePipeline pipeline;
+    TEST_ASSERT_EQUAL_INT(SUCCESS, startPipeline(pipeline, source));
+    releasePage(pipeline, nextPage(pipeline));
+    vTaskDelay(pdMS_TO_TICKS(20));
+    stopPipeline(pipeline);
+    TEST_ASSERT_LESS_OR_EQUAL(2 + PIPELINE_DEPTH, source.reads);
+}
+
+static void test_flash_from_file(void)
+{
+    EmulatorConfig emulator_config;
+    emulator_config.wire_time = false;
+    HostTarget &target = createTarget(UART_NUM_1, emulator_config);
+    const std::vector<uint8_t> image = firmwareImage(20 * 1024 + 3);
+
+    FILE *file = tmpfile();
+    TEST_ASSERT_NOT_NULL(file);
+    TEST_ASSERT_EQUAL_INT(image.size(), fwrite(image.data(), 1, image.size(), file));
+    FileImageSource source(file, image.size());
+
+    FlashReport report;
+    TEST_ASSERT_EQUAL_INT(SUCCESS, flashImage(source, target.config, &report));
+    fclose(file);
+    TEST_ASSERT_TRUE(target.holds(0, image.data(), image.size()));
+    TEST_ASSERT_EQUAL_HEX32(esp_rom_crc32_le(0, target.flashAt(0), report.pages_written * BLOCK_SIZE), report.image_crc);
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_pages_in_order);
+    RUN_TEST(test_read_error);
+    RUN_TEST(test_stop_while_reading_ahead);
+    RUN_TEST(test_flash_from_file);
+    return UNITY_END();
+}
@@ -0,0 +1,183 @@
+// AN3155 framing and a full flash against the emulated bootloader
+
+#include <unity.h>
+
+#include "STM32Flasher.h"
+#include "stm_pro_mode.h"
+#include "host_images.h"
+#include "host_target.h"
+
+using namespace stm32flash;
+using namespace stm32host;
+
+static EmulatorConfig fastTarget()
+{
+    // No wire times: functional tests run at memory speed
+    EmulatorConfig config;
+    config.wire_time = false;
+    return config;
+}
+
+void setUp(void)
+{
+    clearNvs();
+}
+
+void tearDown(void)
+{
+    releaseTargets();
+}
+
+static void test_xor_checksum(void)
+{
+    const char frame[] = {0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40};
+    TEST_ASSERT_EQUAL_HEX8(0x7F, internal::xorChecksum(frame, sizeof(frame), 0));
+    TEST_ASSERT_EQUAL_HEX8(0x7F ^ 0xA5, internal::xorChecksum(frame, sizeof(frame), 0xA5));
+    TEST_ASSERT_EQUAL_HEX8(0x00, internal::xorChecksum(frame, 0, 0));
+
+    // Same result as a byte-by-byte XOR for every length and alignment around the word loop
+    const std::vector<uint8_t> data = firmwareImage(300, 7);
+    for (int offset = 0; offset < 4; offset++) {
+        for (int count = 0; count <= 256; count++) {
+            uint8_t expected = (uint8_t)count;
+            for (int i = 0; i < count; i++) {
+                expected ^= data[offset + i];
+            }
+            TEST_ASSERT_EQUAL_HEX8(expected, internal::xorChecksum((const char *)&data[offset], count, (uint8_t)count));
+        }
+    }
+}
+
+static void test_blank_and_equal_blocks(void)
+{
+    char a[BLOCK_SIZE];
+    char b[BLOCK_SIZE];
+    memset(a, 0xFF, sizeof(a));
+    TEST_ASSERT_TRUE(internal::isBlockBlank(a, sizeof(a)));
+    TEST_ASSERT_TRUE(internal::isBlockBlank(a, 0));
+
+    a[BLOCK_SIZE - 1] = (char)0xFE; // Tail byte, after the word loop of a short count
+    TEST_ASSERT_FALSE(internal::isBlockBlank(a, sizeof(a)));
+    TEST_ASSERT_TRUE(internal::isBlockBlank(a, sizeof(a) - 1));
+    a[BLOCK_SIZE - 1] = (char)0xFF;
+    a[5] = 0x00;
+    TEST_ASSERT_FALSE(internal::isBlockBlank(a, sizeof(a)));
+
+    memcpy(b, a, sizeof(b));
+    TEST_ASSERT_TRUE(internal::blocksEqual(a, b, sizeof(a)));
+    b[254] ^= 0x01;
+    TEST_ASSERT_FALSE(internal::blocksEqual(a, b, sizeof(a)));
+    TEST_ASSERT_TRUE(internal::blocksEqual(a, b, 254));
+}
+
+static void test_flash_memory_image(void)
+{
+    HostTarget &target = createTarget(UART_NUM_1, fastTarget());
+    const std::vector<uint8_t> image = firmwareImage(10 * 1024 + 100);
+
+    FlashImage source;
+    source.data = image.data();
+    source.size = image.size();
+    FlashReport report;
+    TEST_ASSERT_EQUAL_INT(SUCCESS, flash(target.config, source, &report));
+
+    TEST_ASSERT_TRUE(target.holds(0, image.data(), image.size()));
+    TEST_ASSERT_EQUAL_HEX8(0xFF, target.flashAt(0)[image.size()]);
+    TEST_ASSERT_EQUAL_INT(Stm32Emulator::MODE_APPLICATION, target.emulator.mode());
+    TEST_ASSERT_EQUAL_UINT32(0, target.emulator.startAddress()); // Started by a reset
+    TEST_ASSERT_EQUAL_UINT32((image.size() + BLOCK_SIZE - 1) / BLOCK_SIZE, report.pages_written);
+    TEST_ASSERT_EQUAL_UINT32(image.size(), report.bytes_written);
+    TEST_ASSERT_EQUAL_UINT32(115200, report.baud_rate);
+    TEST_ASSERT_EQUAL_UINT32(1, target.emulator.stats().mass_erases);
+    TEST_ASSERT_EQUAL_UINT32(0, target.emulator.stats().nacks);
+}
+
+static void test_flash_skips_blank_blocks(void)
+{
+    HostTarget &target = createTarget(UART_NUM_1, fastTarget());
+    std::vector<uint8_t> image = firmwareImage(4 * BLOCK_SIZE);
+    memset(&image[BLOCK_SIZE], 0xFF, 2 * BLOCK_SIZE);
+
+    FlashImage source;
+    source.data = image.data();
+    source.size = image.size();
+    FlashReport report;
+    TEST_ASSERT_EQUAL_INT(SUCCESS, flash(target.config, source, &report));
+
+    TEST_ASSERT_TRUE(target.holds(0, image.data(), image.size()));
+    TEST_ASSERT_EQUAL_UINT32(2 * BLOCK_SIZE, report.blank_bytes_skipped);
+    TEST_ASSERT_EQUAL_UINT32(2, target.emulator.stats().blocks_written);
+}
+
+static void test_exit_with_go(void)
+{
+    HostTarget &target = createTarget(UART_NUM_1, fastTarget());
+    const std::vector<uint8_t> image = firmwareImage(2048);
+    target.config.exit_mode = EXIT_GO;
+    target.config.verify_mode = VERIFY_CRC;
+
+    FlashImage source;
+    source.data = image.data();
+    source.size = image.size();
+    TEST_ASSERT_EQUAL_INT(SUCCESS, flash(target.config, source));
+    TEST_ASSERT_EQUAL_INT(Stm32Emulator::MODE_APPLICATION, target.emulator.mode());
+    TEST_ASSERT_EQUAL_HEX32(STM32_FLASH_BASE, target.emulator.startAddress());
+    TEST_ASSERT_TRUE(target.holds(0, image.data(), image.size()));
+}
+
+static void test_session_device_info(void)
+{
+    EmulatorConfig emulator_config = EmulatorConfig::g071();
+    emulator_config.wire_time = false;
+    HostTarget &target = createTarget(UART_NUM_1, emulator_config);
+
+    Session session(target.config);
+    TEST_ASSERT_EQUAL_INT(SUCCESS, session.connect());
+    const DeviceInfo &info = session.deviceInfo();
+    TEST_ASSERT_EQUAL_HEX16(0x460, info.product_id);
+    TEST_ASSERT_EQUAL_HEX8(0x31, info.bootloader_version);
+    TEST_ASSERT_TRUE(info.supports(CMD_EXT_ERASE));
+    TEST_ASSERT_FALSE(info.supports(CMD_ERASE));
+    TEST_ASSERT_EQUAL_UINT32(128 * 1024, info.flash_size);
+
+    // Double-word programming: an odd word is padded, a misaligned address refused
+    const uint8_t data[12] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12};
+    TEST_ASSERT_EQUAL_INT(SUCCESS, session.erase(STM32_FLASH_BASE + 0x800, 2048));
+    TEST_ASSERT_EQUAL_INT(SUCCESS, session.write(STM32_FLASH_BASE + 0x800, data, sizeof(data)));
+    TEST_ASSERT_EQUAL_INT(ERROR_INVALID_RANGE, session.write(STM32_FLASH_BASE + 0x804, data, 4));
+    TEST_ASSERT_EQUAL_INT(SUCCESS, session.verify(STM32_FLASH_BASE + 0x800, data, sizeof(data)));
+
+    uint8_t uid[EMULATOR_UID_SIZE];
+    TEST_ASSERT_EQUAL_INT(SUCCESS, session.read(target.emulator.config().uid_address, uid, sizeof(uid)));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(target.emulator.config().uid, uid, sizeof(uid));
+    session.disconnect();
+
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(data, target.flashAt(0x800), sizeof(data));
+    TEST_ASSERT_EQUAL_HEX8(0xFF, target.flashAt(0x800)[sizeof(data)]);
+    TEST_ASSERT_EQUAL_INT(Stm32Emulator::MODE_APPLICATION, target.emulator.mode());
+}
+
+static void test_no_target(void)
+{
+    HostTarget &target = createTarget(UART_NUM_1, fastTarget());
+    detachTarget(UART_NUM_1);
+
+    const uint8_t image[BLOCK_SIZE] = {0};
+    FlashImage source;
+    source.data = image;
+    source.size = sizeof(image);
+    TEST_ASSERT_EQUAL_INT(ERROR_STM_NOT_FOUND, flash(target.config, source));
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_xor_checksum);
+    RUN_TEST(test_blank_and_equal_blocks);
+    RUN_TEST(test_flash_memory_image);
+    RUN_TEST(test_flash_skips_blank_blocks);
+    RUN_TEST(test_exit_with_go);
+    RUN_TEST(test_session_device_info);
+    RUN_TEST(test_no_target);
+    return UNITY_END();
+}
@@ -0,0 +1,103 @@
+// Session statistics: phase timings and command ACKs, checked against what the emulated bootloader saw
+
+#include <unity.h>
+
+#include "STM32Flasher.h"
+#include "host_images.h"
+#include "host_target.h"
+
+using namespace stm32flash;
+using namespace stm32host;
+
+static uint32_t commandCount(HostTarget &target, BootloaderCommand code)
+{
+    return target.emulator.stats().commands[code].count;
+}
+
+static uint64_t commandTime(HostTarget &target, BootloaderCommand code)
+{
+    return target.emulator.stats().commands[code].total_us;
+}
+
+// One timed ACK per command, plus the address ACK of WRITE, READ and GO and the count ACK of READ.
+// The erase parameters and the WRITE data wait for the flash and are not timed.
+static uint32_t timedAcks(HostTarget &target)
+{
+    return commandCount(target, CMD_GET) + commandCount(target, CMD_GET_VERSION) + commandCount(target, CMD_GET_ID) +
+           3 * commandCount(target, CMD_READ) + 2 * commandCount(target, CMD_WRITE) + 2 * commandCount(target, CMD_GO) +
+           commandCount(target, CMD_ERASE) + commandCount(target, CMD_EXT_ERASE);
+}
+
+void setUp(void)
+{
+    clearNvs();
+}
+
+void tearDown(void)
+{
+    releaseTargets();
+}
+
+static void test_phases_and_acks(void)
+{
+    EmulatorConfig emulator_config;
+    emulator_config.write_us = 500;
+    emulator_config.mass_erase_us = 20000;
+    HostTarget &target = createTarget(UART_NUM_1, emulator_config);
+    const std::vector<uint8_t> image = firmwareImage(8 * 1024);
+
+    FlashImage source;
+    source.data = image.data();
+    source.size = image.size();
+    FlashReport report;
+    TEST_ASSERT_EQUAL_INT(SUCCESS, flash(target.config, source, &report));
+
+    // Phases follow each other with no gap: with the exit they make up the whole session
+    uint64_t phases = 0;
+    for (int phase = 0; phase < PHASE_DONE; phase++) {
+        phases += report.phase_us[phase];
+    }
+    TEST_ASSERT_EQUAL_UINT32(0, report.phase_us[PHASE_COMPARE]);
+    TEST_ASSERT_LESS_OR_EQUAL(report.total_us, phases + report.exit_us);
+    TEST_ASSERT_GREATER_OR_EQUAL(report.total_us - 1000, phases + report.exit_us);
+    TEST_ASSERT_LESS_OR_EQUAL(report.phase_us[PHASE_CONNECT], report.sync_us);
+
+    // Each phase lasts at least as long as the bootloader spent on its commands, and not much longer
+    TEST_ASSERT_GREATER_OR_EQUAL(commandTime(target, CMD_ERASE), report.phase_us[PHASE_ERASE]);
+    TEST_ASSERT_GREATER_OR_EQUAL(commandTime(target, CMD_WRITE), report.phase_us[PHASE_WRITE]);
+    TEST_ASSERT_LESS_OR_EQUAL(2 * commandTime(target, CMD_WRITE), report.phase_us[PHASE_WRITE]);
+    TEST_ASSERT_GREATER_OR_EQUAL(commandTime(target, CMD_READ), report.phase_us[PHASE_CONNECT] + report.phase_us[PHASE_VERIFY]);
+
+    TEST_ASSERT_EQUAL_UINT32(timedAcks(target), report.ack_count);
+    TEST_ASSERT_EQUAL_UINT32(image.size() / BLOCK_SIZE, commandCount(target, CMD_WRITE));
+    TEST_ASSERT_LESS_OR_EQUAL(report.ack_avg_us, report.ack_min_us);
+    TEST_ASSERT_LESS_OR_EQUAL(report.ack_max_us, report.ack_avg_us);
+    TEST_ASSERT_EQUAL_UINT32(115200, report.baud_rate);
+}
+
+static void test_exit_go_acks(void)
+{
+    EmulatorConfig emulator_config = EmulatorConfig::g071();
+    emulator_config.wire_time = false;
+    HostTarget &target = createTarget(UART_NUM_1, emulator_config);
+    target.config.exit_mode = EXIT_GO;
+    target.config.verify_mode = VERIFY_CRC;
+    const std::vector<uint8_t> image = firmwareImage(4 * 1024);
+
+    FlashImage source;
+    source.data = image.data();
+    source.size = image.size();
+    FlashReport report;
+    TEST_ASSERT_EQUAL_INT(SUCCESS, flash(target.config, source, &report));
+    TEST_ASSERT_EQUAL_UINT32(1, commandCount(target, CMD_GO));
+    TEST_ASSERT_EQUAL_UINT32(1, commandCount(target, CMD_EXT_ERASE));
+    TEST_ASSERT_EQUAL_UINT32(timedAcks(target), report.ack_count);
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_phases_and_acks);
+    RUN_TEST(test_exit_go_acks);
+    return UNITY_END();
+}
@@ -0,0 +1,129 @@
+// Block writes retried after a NACK or a lost ACK, instead of failing the whole flash
+
+#include <unity.h>
+
+#include "STM32Flasher.h"
+#include "stm_pro_mode.h"
+#include "host_images.h"
+#include "host_target.h"
+
+using namespace stm32flash;
+using namespace stm32host;
+
+static FlashStatus flashData(HostTarget &target, const std::vector<uint8_t> &image, FlashReport *report)
+{
+    FlashImage source;
+    source.data = image.data();
+    source.size = image.size();
+    return flash(target.config, source, report);
+}
+
+void setUp(void)
+{
+    clearNvs();
+}
+
+void tearDown(void)
+{
+    releaseTargets();
+}
+
+static void test_nack_recovery(void)
+{
+    EmulatorConfig emulator_config;
+    emulator_config.wire_time = false;
+    emulator_config.nack_every = 10;
+    HostTarget &target = createTarget(UART_NUM_1, emulator_config);
+    const std::vector<uint8_t> image = firmwareImage(8 * 1024);
+
+    FlashReport report;
+    TEST_ASSERT_EQUAL_INT(SUCCESS, flashData(target, image, &report));
+    TEST_ASSERT_TRUE(target.holds(0, image.data(), image.size()));
+    TEST_ASSERT_GREATER_THAN(0, report.retries);
+    TEST_ASSERT_EQUAL_UINT32(report.retries, report.pages_retried);
+}
+
+static void test_lost_ack_recovery(void)
+{
+    // The block was programmed but its ACK never came: it is written again after a resync
+    EmulatorConfig emulator_config;
+    emulator_config.wire_time = false;
+    emulator_config.lost_ack_every = 12;
+    HostTarget &target = createTarget(UART_NUM_1, emulator_config);
+    const std::vector<uint8_t> image = firmwareImage(8 * 1024);
+
+    FlashReport report;
+    TEST_ASSERT_EQUAL_INT(SUCCESS, flashData(target, image, &report));
+    TEST_ASSERT_TRUE(target.holds(0, image.data(), image.size()));
+    TEST_ASSERT_GREATER_THAN(0, report.pages_retried);
+}
+
+static void test_retries_exhausted(void)
+{
+    EmulatorConfig emulator_config;
+    emulator_config.wire_time = false;
+    emulator_config.nack_every = 1;
+    HostTarget &target = createTarget(UART_NUM_1, emulator_config);
+    target.config.retries = 2;
+    const std::vector<uint8_t> image = firmwareImage(2 * 1024);
+
+    FlashReport report;
+    TEST_ASSERT_EQUAL_INT(ERROR_WRITE_FAILED, flashData(target, image, &report));
+    TEST_ASSERT_EQUAL_UINT32(2, report.retries);
+    TEST_ASSERT_EQUAL_UINT32(0, target.emulator.stats().blocks_written);
+}
+
+static void test_stuck_cell(void)
+{
+    // Retries do not hide a cell that never programs: verification catches it
+    EmulatorConfig emulator_config;
+    emulator_config.wire_time = false;
+    emulator_config.stuck_address = STM32_FLASH_BASE + 1234;
+    HostTarget &target = createTarget(UART_NUM_1, emulator_config);
+    std::vector<uint8_t> image = firmwareImage(4 * 1024);
+    image[1234] = 0x00;
+
+    TEST_ASSERT_EQUAL_INT(ERROR_VERIFY_FAILED, flashData(target, image, NULL));
+}
+
+static void test_resync_pending_ext_erase(void)
+{
+    // EXTENDED ERASE frames cut short: the bootloader waits for the rest of a page list, up to
+    // 2 * (N + 1) bytes with the filler as N. The fillers end it without erasing anything.
+    EmulatorConfig emulator_config = EmulatorConfig::g071();
+    emulator_config.wire_time = false;
+    HostTarget &target = createTarget(UART_NUM_1, emulator_config);
+    const std::vector<uint8_t> image = firmwareImage(4 * 1024);
+    TEST_ASSERT_EQUAL_INT(SUCCESS, flashData(target, image, NULL));
+    target.emulator.resetStats();
+
+    Session session(target.config);
+    TEST_ASSERT_EQUAL_INT(SUCCESS, session.connect());
+    const char command[] = {0x44, (char)0xBB};
+    const char partial[] = {0x00, 0x03, 0x00, 0x00, 0x00}; // 4 pages announced, 1.5 sent
+    for (int sent = 0; sent <= (int)sizeof(partial); sent += sizeof(partial)) {
+        TEST_ASSERT_EQUAL_INT(1, internal::sendBytes(command, sizeof(command), 1, target.config.uart_num));
+        internal::sendData("test", partial, sent, target.config.uart_num);
+        TEST_ASSERT_EQUAL_INT(1, internal::resyncSTM(target.config.uart_num));
+
+        uint8_t data[BLOCK_SIZE];
+        TEST_ASSERT_EQUAL_INT(SUCCESS, session.read(STM32_FLASH_BASE, data, sizeof(data)));
+        TEST_ASSERT_EQUAL_UINT8_ARRAY(image.data(), data, sizeof(data));
+    }
+    session.disconnect();
+
+    TEST_ASSERT_EQUAL_UINT32(0, target.emulator.stats().pages_erased);
+    TEST_ASSERT_EQUAL_UINT32(0, target.emulator.stats().mass_erases);
+    TEST_ASSERT_TRUE(target.holds(0, image.data(), image.size()));
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_nack_recovery);
+    RUN_TEST(test_lost_ack_recovery);
+    RUN_TEST(test_retries_exhausted);
+    RUN_TEST(test_stuck_cell);
+    RUN_TEST(test_resync_pending_ext_erase);
+    return UNITY_END();
+}
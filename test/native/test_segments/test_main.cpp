@@ -0,0 +1,173 @@
+// Intel HEX and ELF images: segments parsed from the records or program headers, gaps left untouched
+
+#include <unity.h>
+
+#include "STM32Flasher.h"
+#include "stm_flash.h"
+#include "host_images.h"
+#include "host_target.h"
+
+using namespace stm32flash;
+using namespace stm32flash::internal;
+using namespace stm32host;
+
+// Code, a configuration block in another page, and data above 64 KB (an extended linear address in HEX)
+static std::vector<LoadSegment> loadSegments()
+{
+    return {
+        {STM32_FLASH_BASE, firmwareImage(3000, 1)},
+        {STM32_FLASH_BASE + 0x4000, firmwareImage(1000, 2)},
+        {STM32_FLASH_BASE + 0x10010, firmwareImage(600, 3)},
+    };
+}
+
+static void checkSegments(ImageSource &source, const std::vector<LoadSegment> &segments)
+{
+    TEST_ASSERT_EQUAL_UINT32(segments.size(), source.segmentCount());
+    char scratch[BLOCK_SIZE];
+    for (size_t i = 0; i < segments.size(); i++) {
+        const uint32_t offset = segments[i].address - STM32_FLASH_BASE;
+        TEST_ASSERT_EQUAL_UINT32(offset, source.segment(i).offset);
+        TEST_ASSERT_EQUAL_UINT32(segments[i].data.size(), source.segment(i).length);
+
+        // The block holding the start of the segment, 0xFF before it
+        const uint32_t block_offset = offset - offset % BLOCK_SIZE;
+        const uint32_t length = MIN((uint32_t)(BLOCK_SIZE - offset % BLOCK_SIZE), (uint32_t)segments[i].data.size());
+        const char *data = source.block(block_offset, scratch);
+        TEST_ASSERT_NOT_NULL(data);
+        TEST_ASSERT_TRUE(isBlockBlank(data, offset % BLOCK_SIZE));
+        TEST_ASSERT_EQUAL_MEMORY(segments[i].data.data(), data + offset % BLOCK_SIZE, length);
+    }
+    TEST_ASSERT_FALSE(source.covers(0x2000));
+    TEST_ASSERT_TRUE(source.covers(0x10000));
+}
+
+void setUp(void)
+{
+    clearNvs();
+}
+
+void tearDown(void)
+{
+    releaseTargets();
+}
+
+static void test_hex_segments(void)
+{
+    const std::vector<LoadSegment> segments = loadSegments();
+    const std::string hex = hexImage(segments);
+    MemoryImageSource input((const uint8_t *)hex.data(), hex.size());
+    TEST_ASSERT_TRUE(HexImageSource::isHex(input));
+    TEST_ASSERT_FALSE(ElfImageSource::isElf(input));
+
+    HexImageSource source(input);
+    TEST_ASSERT_EQUAL_INT(SUCCESS, source.open());
+    TEST_ASSERT_EQUAL_UINT32(0x10010 + 600, source.size());
+    checkSegments(source, segments);
+}
+
+static void test_elf_segments(void)
+{
+    // Program headers need not be in address order
+    std::vector<LoadSegment> segments = loadSegments();
+    std::swap(segments[0], segments[2]);
+    const std::vector<uint8_t> elf = elfImage(segments);
+    MemoryImageSource input(elf.data(), elf.size());
+    TEST_ASSERT_TRUE(ElfImageSource::isElf(input));
+    TEST_ASSERT_FALSE(HexImageSource::isHex(input));
+
+    ElfImageSource source(input);
+    TEST_ASSERT_EQUAL_INT(SUCCESS, source.open());
+    checkSegments(source, loadSegments());
+}
+
+static void test_invalid_images(void)
+{
+    // Bad record checksum
+    std::string hex = hexImage(loadSegments());
+    hex[hex.find('\n') - 2] ^= 0x01;
+    MemoryImageSource bad_checksum((const uint8_t *)hex.data(), hex.size());
+    HexImageSource checksum_source(bad_checksum);
+    TEST_ASSERT_EQUAL_INT(ERROR_CANNOT_OPEN_FILE, checksum_source.open());
+
+    // HEX records going back, overlapping ELF segments
+    std::vector<LoadSegment> segments = loadSegments();
+    std::swap(segments[0], segments[1]);
+    hex = hexImage(segments);
+    MemoryImageSource backwards((const uint8_t *)hex.data(), hex.size());
+    HexImageSource backwards_source(backwards);
+    TEST_ASSERT_EQUAL_INT(ERROR_INVALID_RANGE, backwards_source.open());
+
+    segments = loadSegments();
+    segments[1].address = STM32_FLASH_BASE + 2048;
+    const std::vector<uint8_t> elf = elfImage(segments);
+    MemoryImageSource overlapping(elf.data(), elf.size());
+    ElfImageSource overlapping_source(overlapping);
+    TEST_ASSERT_EQUAL_INT(ERROR_INVALID_RANGE, overlapping_source.open());
+}
+
+static void test_outside_main_flash(void)
+{
+    // Option bytes in a HEX file, data linked at its RAM address in an ELF file, a segment past 2MB
+    const uint32_t addresses[] = {0x1FFF7800, 0x20000000, STM32_FLASH_BASE + 0x200000 - 16};
+    for (uint32_t address : addresses) {
+        std::vector<LoadSegment> segments = loadSegments();
+        segments.push_back({address, firmwareImage(32, 4)});
+
+        const std::string hex = hexImage(segments);
+        MemoryImageSource hex_input((const uint8_t *)hex.data(), hex.size());
+        HexImageSource hex_source(hex_input);
+        TEST_ASSERT_EQUAL_INT(ERROR_INVALID_RANGE, hex_source.open());
+
+        const std::vector<uint8_t> elf = elfImage(segments);
+        MemoryImageSource elf_input(elf.data(), elf.size());
+        ElfImageSource elf_source(elf_input);
+        TEST_ASSERT_EQUAL_INT(ERROR_INVALID_RANGE, elf_source.open());
+    }
+}
+
+static void test_flash_with_gaps(void)
+{
+    EmulatorConfig emulator_config;
+    emulator_config.wire_time = false;
+    HostTarget &target = createTarget(UART_NUM_1, emulator_config);
+    target.config.erase_mode = ERASE_PAGES;
+    const std::vector<LoadSegment> segments = loadSegments();
+
+    for (int elf = 0; elf <= 1; elf++) {
+        // Earlier firmware everywhere: only the pages of the segments are erased and written
+        std::vector<uint8_t> &flash_memory = target.emulator.flash();
+        const std::vector<uint8_t> old = firmwareImage(0x12000, 9);
+        memcpy(flash_memory.data(), old.data(), old.size());
+        target.emulator.resetStats();
+
+        const std::string hex = hexImage(segments);
+        const std::vector<uint8_t> image = elf ? elfImage(segments) : std::vector<uint8_t>(hex.begin(), hex.end());
+        FlashImage source;
+        source.data = image.data();
+        source.size = image.size();
+        FlashReport report;
+        TEST_ASSERT_EQUAL_INT(SUCCESS, flash(target.config, source, &report));
+
+        for (const LoadSegment &segment : segments) {
+            TEST_ASSERT_TRUE(target.holds(segment.address - STM32_FLASH_BASE, segment.data.data(), segment.data.size()));
+        }
+        TEST_ASSERT_EQUAL_UINT32(12 + 4 + 3, report.pages_written);
+        TEST_ASSERT_EQUAL_UINT32(12 + 4 + 3, target.emulator.stats().blocks_written);
+        TEST_ASSERT_EQUAL_UINT32(3 + 1 + 1, target.emulator.stats().pages_erased);
+        TEST_ASSERT_EQUAL_UINT32(0, target.emulator.stats().mass_erases);
+        TEST_ASSERT_TRUE(target.holds(0x3000, &old[0x3000], 0x1000));
+        TEST_ASSERT_TRUE(target.holds(0x8000, &old[0x8000], 0x8000));
+    }
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_hex_segments);
+    RUN_TEST(test_elf_segments);
+    RUN_TEST(test_invalid_images);
+    RUN_TEST(test_outside_main_flash);
+    RUN_TEST(test_flash_with_gaps);
+    return UNITY_END();
+}
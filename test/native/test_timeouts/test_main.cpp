@@ -0,0 +1,104 @@
+// Reply timeouts from the baud rate and the device table: slow operations within them pass, longer ones fail
+
+#include <unity.h>
+
+#include "STM32Flasher.h"
+#include "stm_pro_mode.h"
+#include "host_images.h"
+#include "host_target.h"
+
+using namespace stm32flash;
+using namespace stm32flash::internal;
+using namespace stm32host;
+
+// Allowances of the default emulated part, an STM32F103 (F0/F1 row of the device table)
+#define WRITE_MS 15
+#define PAGE_ERASE_MS 60
+#define MASS_ERASE_MS 200
+
+// Real wire times, so that the timeouts are as tight as on the hardware
+static HostTarget &slowTarget(uint32_t write_us, uint32_t page_erase_us, uint32_t mass_erase_us)
+{
+    EmulatorConfig emulator_config;
+    emulator_config.write_us = write_us;
+    emulator_config.page_erase_us = page_erase_us;
+    emulator_config.mass_erase_us = mass_erase_us;
+    HostTarget &target = createTarget(UART_NUM_1, emulator_config);
+    target.config.retries = 0;
+    return target;
+}
+
+static FlashStatus flashData(HostTarget &target, const std::vector<uint8_t> &image)
+{
+    FlashImage source;
+    source.data = image.data();
+    source.size = image.size();
+    return flash(target.config, source);
+}
+
+void setUp(void)
+{
+    clearNvs();
+}
+
+void tearDown(void)
+{
+    releaseTargets();
+}
+
+static void test_reply_timeout(void)
+{
+    // Wire time of the bytes sent and of the reply, plus the allowance and the margin
+    uart_config_t uart_config = {};
+    uart_config.baud_rate = 115200;
+    TEST_ASSERT_EQUAL_INT(ESP_OK, uart_param_config(UART_NUM_1, &uart_config));
+    TEST_ASSERT_EQUAL_INT(3 + 10 + TIMEOUT_MARGIN, replyTimeout(UART_NUM_1, 27, 10));
+    TEST_ASSERT_EQUAL_INT(25 + WRITE_MS + TIMEOUT_MARGIN, replyTimeout(UART_NUM_1, BLOCK_SIZE + 3, WRITE_MS));
+    TEST_ASSERT_EQUAL_INT(ESP_OK, uart_set_baudrate(UART_NUM_1, 921600));
+    TEST_ASSERT_EQUAL_INT(4 + WRITE_MS + TIMEOUT_MARGIN, replyTimeout(UART_NUM_1, BLOCK_SIZE + 3, WRITE_MS));
+}
+
+static void test_slow_write(void)
+{
+    const std::vector<uint8_t> image = firmwareImage(2 * 1024);
+    HostTarget &slow = slowTarget(WRITE_MS * 1000 * 2 / 3, 0, 0);
+    TEST_ASSERT_EQUAL_INT(SUCCESS, flashData(slow, image));
+    TEST_ASSERT_TRUE(slow.holds(0, image.data(), image.size()));
+    releaseTargets();
+
+    HostTarget &too_slow = slowTarget(WRITE_MS * 1000 * 2, 0, 0);
+    TEST_ASSERT_EQUAL_INT(ERROR_WRITE_FAILED, flashData(too_slow, image));
+}
+
+static void test_slow_erase(void)
+{
+    const std::vector<uint8_t> image = firmwareImage(2 * 1024);
+    HostTarget &slow = slowTarget(0, 0, MASS_ERASE_MS * 1000 * 3 / 4);
+    TEST_ASSERT_EQUAL_INT(SUCCESS, flashData(slow, image));
+    releaseTargets();
+
+    HostTarget &too_slow = slowTarget(0, 0, MASS_ERASE_MS * 1000 * 3 / 2);
+    TEST_ASSERT_EQUAL_INT(ERROR_ERASE_FAILED, flashData(too_slow, image));
+    TEST_ASSERT_EQUAL_UINT32(0, too_slow.emulator.stats().blocks_written);
+    releaseTargets();
+
+    // Page erases: the allowance grows with the number of pages
+    HostTarget &pages = slowTarget(0, PAGE_ERASE_MS * 1000 * 3 / 4, 0);
+    pages.config.erase_mode = ERASE_PAGES;
+    TEST_ASSERT_EQUAL_INT(SUCCESS, flashData(pages, firmwareImage(8 * 1024)));
+    TEST_ASSERT_EQUAL_UINT32(8, pages.emulator.stats().pages_erased);
+    releaseTargets();
+
+    HostTarget &slow_pages = slowTarget(0, PAGE_ERASE_MS * 1000 * 3 / 2, 0);
+    slow_pages.config.erase_mode = ERASE_PAGES;
+    TEST_ASSERT_EQUAL_INT(ERROR_ERASE_FAILED, flashData(slow_pages, firmwareImage(8 * 1024)));
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_reply_timeout);
+    RUN_TEST(test_slow_write);
+    RUN_TEST(test_slow_erase);
+    return UNITY_END();
+}
@@ -0,0 +1,121 @@
+#!/usr/bin/env python3
+"""Pack a raw STM32 .bin into a compressed image for esp32-stm-flash.
+
+The output is decompressed on the fly by the library when flashing, so it can be
+uploaded to SPIFFS (data/ folder) or to a data partition instead of the raw .bin.
+
+Format (little-endian):
+    "STZ1"         magic
+    uint32         size of the raw image
+    uint32         CRC32 of the raw image
+    LZSS stream    groups of 8 tokens, each group preceded by a flag byte (LSB first):
+                   bit = 1 -> 1 literal byte
+                   bit = 0 -> 2-byte big-endian match: (distance - 1) << 6 | (length - 3)
+                   distance 1..1024, length 3..66
+
+Usage: stm32_pack.py firmware.bin firmware.stz
+"""
+
+import sys
+import zlib
+import struct
+
+MAGIC = b"STZ1"
+WINDOW_BITS = 10
+LENGTH_BITS = 6
+WINDOW_SIZE = 1 << WINDOW_BITS
+MIN_MATCH = 3
+MAX_MATCH = MIN_MATCH + (1 << LENGTH_BITS) - 1
+MAX_CANDIDATES = 64
+
+
+def compress(data):
+    out = bytearray()
+    flags_pos = 0
+    flag_bit = 8
+    chains = {}
+    i = 0
+
+    while i < len(data):
+        # Longest match among the most recent positions with the same 3-byte prefix
+        best_len, best_dist = 0, 0
+        if i + MIN_MATCH <= len(data):
+            for p in reversed(chains.get(data[i:i + MIN_MATCH], [])[-MAX_CANDIDATES:]):
+                dist = i - p
+                if dist > WINDOW_SIZE:
+                    break
+                length = MIN_MATCH
+                while length < MAX_MATCH and i + length < len(data) and data[p + length] == data[i + length]:
+                    length += 1
+                if length > best_len:
+                    best_len, best_dist = length, dist
+                    if length == MAX_MATCH:
+                        break
+
+        if flag_bit == 8:
+            flags_pos = len(out)
+            out.append(0)
+            flag_bit = 0
+
+        if best_len >= MIN_MATCH:
+            token = ((best_dist - 1) << LENGTH_BITS) | (best_len - MIN_MATCH)
+            out += struct.pack(">H", token)
+            step = best_len
+        else:
+            out[flags_pos] |= 1 << flag_bit
+            out.append(data[i])
+            step = 1
+        flag_bit += 1
+
+        for k in range(i, i + step):
+            if k + MIN_MATCH <= len(data):
+                chains.setdefault(data[k:k + MIN_MATCH], []).append(k)
+        i += step
+
+    return out
+
+
+def decompress(stream, size):
+    out = bytearray()
+    pos = 0
+    while len(out) < size:
+        flags = stream[pos]
+        pos += 1
+        for bit in range(8):
+            if len(out) >= size:
+                break
+            if flags & (1 << bit):
+                out.append(stream[pos])
+                pos += 1
+            else:
+                token = (stream[pos] << 8) | stream[pos + 1]
+                pos += 2
+                dist = (token >> LENGTH_BITS) + 1
+                for _ in range((token & ((1 << LENGTH_BITS) - 1)) + MIN_MATCH):
+                    out.append(out[-dist])
+    return bytes(out)
+
+
+def main():
+    if len(sys.argv) != 3:
+        print(__doc__.strip().splitlines()[-1])
+        return 1
+
+    with open(sys.argv[1], "rb") as f:
+        data = f.read()
+
+    stream = compress(data)
+    if decompress(stream, len(data)) != data:
+        print("Round-trip check failed")
+        return 1
+
+    with open(sys.argv[2], "wb") as f:
+        f.write(MAGIC + struct.pack("<II", len(data), zlib.crc32(data) & 0xFFFFFFFF) + stream)
+
+    print("%s: %d -> %d bytes (%.1f%%)" % (sys.argv[2], len(data), len(stream) + 12,
+                                          100.0 * (len(stream) + 12) / max(len(data), 1)))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())